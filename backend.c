@@ -0,0 +1,181 @@
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include "backend.h"
+
+static struct backend backends[NR_BACKENDS] = {
+        [BACKEND_TWEET] = {
+                .name = "tweet",
+                .timeout_ms = 2000,
+                .placeholder = "The tweet service isn't answering right now. Try again in a little while.",
+                .lock = PTHREAD_MUTEX_INITIALIZER,
+        },
+        [BACKEND_WEATHER] = {
+                .name = "weather",
+                .timeout_ms = 3000,
+                .placeholder = "The weather service isn't answering right now. Try again in a little while.\n",
+                .lock = PTHREAD_MUTEX_INITIALIZER,
+        },
+        [BACKEND_AIR_QUALITY] = {
+                .name = "air quality",
+                .timeout_ms = 3000,
+                .placeholder = "The air quality service isn't answering right now. Try again in a little while.\n",
+                .lock = PTHREAD_MUTEX_INITIALIZER,
+        },
+};
+
+struct backend *backend_get(int id)
+{
+    return &backends[id];
+}
+
+uint64_t backend_now_ms(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
+
+/* How long a request to b gets, from start to finish, hedge included */
+unsigned int backend_timeout(struct backend *b)
+{
+    const char *env = getenv("SPARKLER_FETCH_TIMEOUT_MS");
+
+    if (env && atoi(env) > 0)
+        return atoi(env);
+    return b->timeout_ms;
+}
+
+/* Whether a request to b would go out right now, without claiming the probe if it's half open */
+int backend_available(struct backend *b)
+{
+    int available;
+
+    pthread_mutex_lock(&b->lock);
+    available = b->state == BACKEND_CLOSED
+                || (b->state == BACKEND_OPEN && backend_now_ms() >= b->retry_at);
+    pthread_mutex_unlock(&b->lock);
+    return available;
+}
+
+/*
+ * Called before a request goes out to b. Returns 0 if it may, or -1 if the
+ * circuit is open and the caller should make do without. Once an open
+ * circuit's wait is over, the first caller through becomes the probe and
+ * everyone else keeps being turned away until it's back.
+ * */
+int backend_begin(struct backend *b)
+{
+    int ret = 0;
+
+    pthread_mutex_lock(&b->lock);
+    if (b->state == BACKEND_OPEN && backend_now_ms() >= b->retry_at)
+        b->state = BACKEND_HALF_OPEN;
+    else if (b->state != BACKEND_CLOSED)
+        ret = -1;
+
+    if (ret == 0)
+        b->stats.requests++;
+    else
+        b->stats.short_circuited++;
+    pthread_mutex_unlock(&b->lock);
+    return ret;
+}
+
+static int compare_latency(const void *a, const void *b)
+{
+    uint32_t x = *(const uint32_t *)a, y = *(const uint32_t *)b;
+
+    return x < y ? -1 : x > y;
+}
+
+/* How many ms into a request to b a duplicate should go out, or 0 if it shouldn't */
+unsigned int backend_hedge_after(struct backend *b)
+{
+    uint32_t sorted[BACKEND_LATENCY_SAMPLES];
+    unsigned int n, after;
+    int state;
+
+    pthread_mutex_lock(&b->lock);
+    n = b->nr_latencies;
+    state = b->state;
+    memcpy(sorted, b->latencies, n * sizeof(sorted[0]));
+    pthread_mutex_unlock(&b->lock);
+
+    /* Too early to say what slow is, or this request is a probe, which should stay on its own */
+    if (n < BACKEND_HEDGE_MIN_SAMPLES || state != BACKEND_CLOSED)
+        return 0;
+    qsort(sorted, n, sizeof(sorted[0]), compare_latency);
+    after = sorted[(n * BACKEND_HEDGE_PERCENTILE) / 100];
+    if (after < BACKEND_HEDGE_MIN_MS)
+        after = BACKEND_HEDGE_MIN_MS;
+
+    /* A hedge that can't finish before the deadline is no use */
+    return after < backend_timeout(b) / 2 ? after : 0;
+}
+
+/* A request to b had a duplicate sent after it, and won says whether the duplicate answered first */
+void backend_hedged(struct backend *b, int won)
+{
+    pthread_mutex_lock(&b->lock);
+    b->stats.hedged++;
+    if (won)
+        b->stats.hedge_wins++;
+    pthread_mutex_unlock(&b->lock);
+}
+
+/* A request that backend_begin() let out has finished, one way or the other */
+void backend_end(struct backend *b, int ok, unsigned int latency_ms)
+{
+    pthread_mutex_lock(&b->lock);
+    if (ok) {
+        b->latencies[b->next_latency] = latency_ms;
+        b->next_latency = (b->next_latency + 1) % BACKEND_LATENCY_SAMPLES;
+        if (b->nr_latencies < BACKEND_LATENCY_SAMPLES)
+            b->nr_latencies++;
+        b->state = BACKEND_CLOSED;
+        b->failures = 0;
+        b->backoff_ms = 0;
+        goto out;
+    }
+
+    b->stats.failures++;
+    b->failures++;
+    if (b->state == BACKEND_HALF_OPEN) {
+        /* A failed probe waits twice as long for the next one */
+        b->backoff_ms = b->backoff_ms * 2 < BACKEND_BACKOFF_MAX_MS ? b->backoff_ms * 2 : BACKEND_BACKOFF_MAX_MS;
+    } else if (b->state == BACKEND_CLOSED && b->failures >= BACKEND_TRIP_FAILURES) {
+        b->backoff_ms = BACKEND_BACKOFF_MS;
+    } else {
+        goto out;
+    }
+    b->state = BACKEND_OPEN;
+    b->retry_at = backend_now_ms() + b->backoff_ms;
+
+out:
+    pthread_mutex_unlock(&b->lock);
+}
+
+void backend_placeholder_served(struct backend *b)
+{
+    pthread_mutex_lock(&b->lock);
+    b->stats.placeholders++;
+    pthread_mutex_unlock(&b->lock);
+}
+
+void backend_print_stats(FILE *f)
+{
+    static const char *const states[] = { "closed", "open", "half open" };
+
+    for (int i = 0; i < NR_BACKENDS; i++) {
+        struct backend *b = &backends[i];
+
+        pthread_mutex_lock(&b->lock);
+        fprintf(f, "backend %s: %lu requests, %lu failures, %lu hedged, %lu won by the hedge, "
+                   "%lu short-circuited, %lu placeholders, circuit %s\n",
+                b->name, b->stats.requests, b->stats.failures, b->stats.hedged, b->stats.hedge_wins,
+                b->stats.short_circuited, b->stats.placeholders, states[b->state]);
+        pthread_mutex_unlock(&b->lock);
+    }
+}
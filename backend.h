@@ -0,0 +1,79 @@
+#ifndef SPARKLER_BACKEND_H
+#define SPARKLER_BACKEND_H
+
+#include <pthread.h>
+#include <stdint.h>
+#include <stdio.h>
+
+/*
+ * How each of the service's endpoints is holding up, and what we do about
+ * it, so that a slow or dead service can't keep the guest waiting.
+ *
+ * Every request to a backend has its own deadline. Once we have seen
+ * enough requests to know what a slow one looks like, a request still
+ * going after BACKEND_HEDGE_PERCENTILE of them would have finished gets a
+ * duplicate sent alongside it, and whichever answers first wins. After
+ * BACKEND_TRIP_FAILURES failures in a row the backend's circuit opens:
+ * requests fail straight away, and callers serve whatever they have cached
+ * or a placeholder, until a single probe is let through to see whether it
+ * has come back. Each failed probe doubles how long we wait before the
+ * next, up to BACKEND_BACKOFF_MAX_MS.
+ * */
+
+enum {
+    BACKEND_TWEET,
+    BACKEND_WEATHER,
+    BACKEND_AIR_QUALITY,
+    NR_BACKENDS,
+};
+
+/* SPARKLER_FETCH_TIMEOUT_MS overrides each backend's own deadline */
+#define BACKEND_CONNECT_TIMEOUT_MS  1000
+#define BACKEND_LATENCY_SAMPLES     64
+#define BACKEND_HEDGE_MIN_SAMPLES   16
+#define BACKEND_HEDGE_PERCENTILE    95
+#define BACKEND_HEDGE_MIN_MS        20
+#define BACKEND_TRIP_FAILURES       3
+#define BACKEND_BACKOFF_MS          1000
+#define BACKEND_BACKOFF_MAX_MS      60000
+
+#define BACKEND_CLOSED              0   /* all's well */
+#define BACKEND_OPEN                1   /* failing: nothing goes out until retry_at */
+#define BACKEND_HALF_OPEN           2   /* a probe is out */
+
+struct backend_stats {
+    unsigned long requests;         /* that went out to the service */
+    unsigned long failures;
+    unsigned long hedged;           /* requests that got a duplicate */
+    unsigned long hedge_wins;       /* ...which answered first */
+    unsigned long short_circuited;  /* requests refused while the circuit was open */
+    unsigned long placeholders;     /* times we had nothing better to give the guest */
+};
+
+struct backend {
+    const char *name;
+    unsigned int timeout_ms;
+    const char *placeholder;        /* what the guest sees when we have nothing at all */
+    pthread_mutex_t lock;
+    int state;
+    unsigned int failures;          /* in a row */
+    unsigned int backoff_ms;
+    uint64_t retry_at;              /* CLOCK_MONOTONIC ms when an open circuit lets a probe through */
+    uint32_t latencies[BACKEND_LATENCY_SAMPLES];   /* ms, of the most recent successes */
+    unsigned int nr_latencies;
+    unsigned int next_latency;
+    struct backend_stats stats;
+};
+
+struct backend *backend_get(int id);
+uint64_t backend_now_ms(void);
+unsigned int backend_timeout(struct backend *b);
+int backend_available(struct backend *b);
+int backend_begin(struct backend *b);
+unsigned int backend_hedge_after(struct backend *b);
+void backend_hedged(struct backend *b, int won);
+void backend_end(struct backend *b, int ok, unsigned int latency_ms);
+void backend_placeholder_served(struct backend *b);
+void backend_print_stats(FILE *f);
+
+#endif
@@ -0,0 +1,286 @@
+#include <err.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <signal.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include "balloon.h"
+#include "lazymem.h"
+#include "migrate.h"
+#include "placement.h"
+
+static uint64_t now_ns(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+static int test_page(const uint64_t *bits, size_t page)
+{
+    return (bits[page / 64] >> (page % 64)) & 1;
+}
+
+static void set_page(uint64_t *bits, size_t page)
+{
+    bits[page / 64] |= 1ULL << (page % 64);
+}
+
+static void clear_page(uint64_t *bits, size_t page)
+{
+    bits[page / 64] &= ~(1ULL << (page % 64));
+}
+
+static size_t nr_pages(struct balloon *balloon)
+{
+    size_t pages = balloon->mem_size / BALLOON_PAGE_SIZE;
+
+    return pages < BALLOON_MAX_PAGES ? pages : BALLOON_MAX_PAGES;
+}
+
+/* Give the host back the pages from first up to end. Called with the lock held. */
+static void drop(struct balloon *balloon, size_t first, size_t end)
+{
+    uint64_t gpa = (uint64_t)first * BALLOON_PAGE_SIZE;
+    size_t len = (end - first) * BALLOON_PAGE_SIZE;
+
+    /* Demand paging has to stop thinking they're there before they go, or it would never fill them in again */
+    lazymem_forget(gpa, len);
+    if (placement_discard(balloon->mem + gpa, len) == -1) {
+        warn("dropping guest pages %#lx-%#lx", (unsigned long)gpa, (unsigned long)(gpa + len));
+        return;
+    }
+    /* They're zeroes now, and a migration in progress has to send them as such */
+    migrate_note_dirty(gpa, len);
+
+    for (size_t page = first; page < end; page++)
+        set_page(balloon->dropped, page);
+    balloon->stats.reclaimed += end - first;
+}
+
+/* Drop everything we've been given and still have, a run of pages at a time. Called with the lock held. */
+static void reclaim(struct balloon *balloon)
+{
+    size_t pages = nr_pages(balloon), first = 0;
+
+    for (size_t page = 0; page <= pages; page++) {
+        int keep = page < pages && test_page(balloon->given, page) && !test_page(balloon->dropped, page);
+
+        if (!keep) {
+            if (first < page)
+                drop(balloon, first, page);
+            first = page + 1;
+        }
+    }
+}
+
+static void *pressure_thread(void *arg)
+{
+    struct balloon *balloon = arg;
+
+    placement_io_thread();
+
+    for (;;) {
+        struct pollfd pfd = { .fd = balloon->psi_fd, .events = POLLPRI };
+
+        if (poll(&pfd, 1, -1) == -1) {
+            if (errno == EINTR)
+                continue;
+            err(1, "polling %s", BALLOON_PSI_FILE);
+        }
+        /* The trigger goes away with the cgroup it was set on */
+        if (pfd.revents & POLLERR) {
+            warnx("memory pressure trigger gone, so guest pages are no longer reclaimed under pressure");
+            return NULL;
+        }
+        if (!(pfd.revents & POLLPRI))
+            continue;
+
+        pthread_mutex_lock(&balloon->lock);
+        balloon->stats.pressure_events++;
+        balloon->pressure_until = now_ns() + BALLOON_PRESSURE_HOLD_MS * 1000000ULL;
+        reclaim(balloon);
+        pthread_mutex_unlock(&balloon->lock);
+    }
+    return NULL;
+}
+
+/* Set a trigger on the host's memory pressure and wait on it. Returns -1 if we can't. */
+static int watch_pressure(struct balloon *balloon)
+{
+    const char *trigger = getenv("SPARKLER_RECLAIM_PSI");
+    sigset_t all, old;
+    pthread_t thread;
+    int ret;
+
+    if (!trigger)
+        trigger = BALLOON_PSI_TRIGGER;
+    balloon->psi_fd = open(BALLOON_PSI_FILE, O_RDWR | O_NONBLOCK | O_CLOEXEC);
+    if (balloon->psi_fd == -1)
+        return -1;
+    if (write(balloon->psi_fd, trigger, strlen(trigger) + 1) == -1)
+        goto error_exit;
+
+    /* We're started before migration blocks SIGUSR1, which is meant for its thread, not ours */
+    sigfillset(&all);
+    pthread_sigmask(SIG_SETMASK, &all, &old);
+    ret = pthread_create(&thread, NULL, pressure_thread, balloon);
+    pthread_sigmask(SIG_SETMASK, &old, NULL);
+    if (ret != 0)
+        goto error_exit;
+    pthread_detach(thread);
+    return 0;
+
+error_exit:
+    close(balloon->psi_fd);
+    balloon->psi_fd = -1;
+    return -1;
+}
+
+void balloon_init(struct balloon *balloon, uint8_t *mem, size_t mem_size)
+{
+    const char *policy = getenv("SPARKLER_RECLAIM");
+
+    memset(balloon, 0, sizeof(*balloon));
+    pthread_mutex_init(&balloon->lock, NULL);
+    balloon->mem = mem;
+    balloon->mem_size = mem_size;
+    balloon->psi_fd = -1;
+
+    if (!policy || strcmp(policy, "pressure") == 0) {
+        balloon->policy = BALLOON_RECLAIM_PRESSURE;
+    } else if (strcmp(policy, "now") == 0) {
+        balloon->policy = BALLOON_RECLAIM_NOW;
+    } else if (strcmp(policy, "never") == 0) {
+        balloon->policy = BALLOON_RECLAIM_NEVER;
+    } else {
+        warnx("SPARKLER_RECLAIM should be pressure, now or never, not %s", policy);
+        balloon->policy = BALLOON_RECLAIM_PRESSURE;
+    }
+
+    if (balloon->policy == BALLOON_RECLAIM_PRESSURE && watch_pressure(balloon) == -1) {
+        warn("watching %s, so guest pages are reclaimed as soon as they're given back", BALLOON_PSI_FILE);
+        balloon->policy = BALLOON_RECLAIM_NOW;
+    }
+}
+
+/* The guest can't give us gpa up to gpa + len: what it sees there isn't the RAM behind it */
+void balloon_exclude(struct balloon *balloon, uint64_t gpa, uint64_t len)
+{
+    pthread_mutex_lock(&balloon->lock);
+    balloon->hole = gpa;
+    balloon->hole_size = len;
+    pthread_mutex_unlock(&balloon->lock);
+}
+
+/*
+ * Apply the first count ranges on the guest's list, giving us the pages
+ * or taking them back. Anything that isn't whole pages of guest RAM is
+ * skipped. Called with the lock held.
+ * */
+static void apply(struct balloon *balloon, uint32_t count, int give)
+{
+    size_t pages = nr_pages(balloon);
+
+    if (count > BALLOON_MAX_RANGES || (uint64_t)balloon->list + count * sizeof(struct balloon_range) > balloon->mem_size) {
+        balloon->stats.bad_ranges += count;
+        return;
+    }
+
+    for (uint32_t i = 0; i < count; i++) {
+        struct balloon_range range;
+
+        memcpy(&range, balloon->mem + balloon->list + i * sizeof(range), sizeof(range));
+        if (range.gpa % BALLOON_PAGE_SIZE || range.len % BALLOON_PAGE_SIZE
+            || (uint64_t)range.gpa + range.len > pages * BALLOON_PAGE_SIZE
+            || (balloon->hole_size && range.gpa < balloon->hole + balloon->hole_size
+                && (uint64_t)range.gpa + range.len > balloon->hole)) {
+            balloon->stats.bad_ranges++;
+            continue;
+        }
+
+        for (size_t page = range.gpa / BALLOON_PAGE_SIZE; page < (range.gpa + range.len) / BALLOON_PAGE_SIZE; page++) {
+            if (give && !test_page(balloon->given, page)) {
+                set_page(balloon->given, page);
+                balloon->nr_given++;
+            } else if (!give && test_page(balloon->given, page)) {
+                /* Whatever it finds there now is its own, zeroes if we dropped it */
+                clear_page(balloon->given, page);
+                clear_page(balloon->dropped, page);
+                balloon->nr_given--;
+            }
+        }
+    }
+}
+
+uint32_t balloon_read(struct balloon *balloon, unsigned int reg)
+{
+    uint32_t value = 0;
+
+    pthread_mutex_lock(&balloon->lock);
+    if (reg == BALLOON_LIST)
+        value = balloon->list;
+    else if (reg == BALLOON_INFLATE)
+        value = balloon->nr_given;
+    pthread_mutex_unlock(&balloon->lock);
+    return value;
+}
+
+void balloon_write(struct balloon *balloon, unsigned int reg, uint32_t value)
+{
+    pthread_mutex_lock(&balloon->lock);
+    switch (reg) {
+        case BALLOON_LIST:
+            balloon->list = value;
+            break;
+        case BALLOON_INFLATE:
+            balloon->stats.inflations++;
+            apply(balloon, value, 1);
+            if (balloon->policy == BALLOON_RECLAIM_NOW
+                || (balloon->policy == BALLOON_RECLAIM_PRESSURE && now_ns() < balloon->pressure_until))
+                reclaim(balloon);
+            break;
+        case BALLOON_DEFLATE:
+            balloon->stats.deflations++;
+            apply(balloon, value, 0);
+            break;
+    }
+    pthread_mutex_unlock(&balloon->lock);
+}
+
+void balloon_save(struct balloon *balloon, struct balloon_state *state)
+{
+    pthread_mutex_lock(&balloon->lock);
+    memset(state, 0, sizeof(*state));
+    state->list = balloon->list;
+    memcpy(state->given, balloon->given, sizeof(state->given));
+    pthread_mutex_unlock(&balloon->lock);
+}
+
+/* Pages the guest had given back come over as they were, so none of them has been dropped here yet */
+void balloon_load(struct balloon *balloon, const struct balloon_state *state)
+{
+    pthread_mutex_lock(&balloon->lock);
+    balloon->list = state->list;
+    memcpy(balloon->given, state->given, sizeof(balloon->given));
+    memset(balloon->dropped, 0, sizeof(balloon->dropped));
+    balloon->nr_given = 0;
+    for (size_t page = 0; page < BALLOON_MAX_PAGES; page++)
+        balloon->nr_given += test_page(balloon->given, page);
+    pthread_mutex_unlock(&balloon->lock);
+}
+
+void balloon_print_stats(struct balloon *balloon, FILE *f)
+{
+    static const char *const policies[] = { "under pressure", "at once", "never" };
+
+    pthread_mutex_lock(&balloon->lock);
+    fprintf(f, "balloon: %u pages given back, %lu reclaimed (%s), %lu inflations, %lu deflations, %lu pressure events, %lu bad ranges\n",
+            balloon->nr_given, balloon->stats.reclaimed, policies[balloon->policy], balloon->stats.inflations,
+            balloon->stats.deflations, balloon->stats.pressure_events, balloon->stats.bad_ranges);
+    pthread_mutex_unlock(&balloon->lock);
+}
@@ -0,0 +1,100 @@
+#ifndef SPARKLER_BALLOON_H
+#define SPARKLER_BALLOON_H
+
+#include <pthread.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <stdio.h>
+
+/*
+ * A memory balloon on ports, so guest RAM the guest isn't using stops
+ * costing the host anything. The guest keeps a list of page-aligned
+ * ranges somewhere in its memory and tells us where once. Writing a count
+ * to BALLOON_INFLATE gives us the first that many ranges: the guest won't
+ * touch them again until it has taken them back by writing a count to
+ * BALLOON_DEFLATE, after which they may read as zeroes.
+ *
+ * When we actually drop pages we've been given is up to
+ * SPARKLER_RECLAIM:
+ *
+ *   pressure   (the default) when the host is short of memory, going by
+ *              a pressure stall trigger on /proc/pressure/memory, which
+ *              SPARKLER_RECLAIM_PSI can replace ("some 300000 2000000",
+ *              300ms of stalls in any two seconds, by default; a window
+ *              that isn't a multiple of two seconds needs
+ *              CAP_SYS_RESOURCE). Until then the pages stay where they
+ *              are, so a guest that hands the same buffer back and forth
+ *              doesn't fault it in again every time.
+ *   now        as soon as they're given to us
+ *   never      not at all, though the guest can still tell us
+ *
+ * Without PSI, pressure falls back to now.
+ * */
+
+#define BALLOON_NR_REGS         12
+
+/* Register offsets from the base port, 32 bits each */
+#define BALLOON_LIST            0       /* guest physical address of the range list */
+#define BALLOON_INFLATE         4       /* out: ranges to give us; in: pages we have */
+#define BALLOON_DEFLATE         8       /* out: ranges to take back */
+
+#define BALLOON_PAGE_SIZE       4096
+#define BALLOON_MAX_PAGES       256     /* all a real mode guest can reach */
+#define BALLOON_MAX_RANGES      (BALLOON_PAGE_SIZE / sizeof(struct balloon_range))
+
+#define BALLOON_PSI_FILE        "/proc/pressure/memory"
+#define BALLOON_PSI_TRIGGER     "some 300000 2000000"
+#define BALLOON_PRESSURE_HOLD_MS 10000  /* after a stall, pages given to us go straight away for this long */
+
+/* An entry in the guest's list, in bytes, both multiples of BALLOON_PAGE_SIZE */
+struct balloon_range {
+    uint32_t gpa;
+    uint32_t len;
+};
+
+enum balloon_policy {
+    BALLOON_RECLAIM_PRESSURE,
+    BALLOON_RECLAIM_NOW,
+    BALLOON_RECLAIM_NEVER,
+};
+
+struct balloon_stats {
+    unsigned long inflations;
+    unsigned long deflations;
+    unsigned long bad_ranges;       /* that weren't whole pages of guest RAM */
+    unsigned long pressure_events;
+    unsigned long reclaimed;        /* pages dropped, altogether */
+};
+
+struct balloon {
+    pthread_mutex_t lock;           /* the pressure thread reclaims while the vCPU carries on */
+    uint8_t *mem;
+    size_t mem_size;
+    uint64_t hole;                  /* guest memory that isn't RAM, hole_size long, such as the ROM */
+    uint64_t hole_size;
+    enum balloon_policy policy;
+    int psi_fd;
+    uint64_t pressure_until;        /* CLOCK_MONOTONIC ns */
+    uint32_t list;
+    uint64_t given[BALLOON_MAX_PAGES / 64];         /* pages the guest has given us */
+    uint64_t dropped[BALLOON_MAX_PAGES / 64];       /* and which of them we've let go of */
+    unsigned int nr_given;
+    struct balloon_stats stats;
+};
+
+/* What the guest has given us, for carrying on in another process */
+struct balloon_state {
+    uint32_t list;
+    uint32_t reserved;
+    uint64_t given[BALLOON_MAX_PAGES / 64];
+};
+
+void balloon_init(struct balloon *balloon, uint8_t *mem, size_t mem_size);
+void balloon_exclude(struct balloon *balloon, uint64_t gpa, uint64_t len);
+uint32_t balloon_read(struct balloon *balloon, unsigned int reg);
+void balloon_write(struct balloon *balloon, unsigned int reg, uint32_t value);
+void balloon_save(struct balloon *balloon, struct balloon_state *state);
+void balloon_load(struct balloon *balloon, const struct balloon_state *state);
+void balloon_print_stats(struct balloon *balloon, FILE *f);
+
+#endif
@@ -0,0 +1,184 @@
+bits 16
+
+; A guest that does nothing but exit, to see what each of sparkler's ports
+; costs. Every test hits one port ITERATIONS times, or moves STRING_BYTES
+; through it with a single rep ins or outs, and prints how many TSC cycles
+; an access took on average, the round trip out to sparkler included.
+; Build it with "make bench" and run it with SPARKLER_GUEST=bench ./sparkler
+;
+; The device ports aren't here: they go out to the network for every
+; payload, which would swamp whatever the exits themselves cost.
+
+SERIAL_PORT             equ 0x3f8
+SERIAL_LSR              equ SERIAL_PORT + 5
+SERIAL_SCR              equ SERIAL_PORT + 7
+TIMER_STATUS            equ 0x148
+
+ITERATIONS              equ 20000
+STRING_BUF              equ 0x3000          ; in DS, out of the way of our code and stack
+STRING_BYTES            equ 0x4000
+
+; Like the monitor we run read-only, so the stack and our one variable are in the page after us
+STACK_SEG               equ 0x200
+tsc_start               equ 0x1000          ; in DS, so physical 0x2000; a dq
+
+start:
+    mov ax, STACK_SEG
+    mov ss, ax
+    mov sp, 0x1000
+    cld
+
+    mov ax, 0x100
+    mov ds, ax
+    mov es, ax
+
+    mov si, welcome_msg
+    call print_str
+
+    ; Serial ports never get to the device table
+    mov si, scr_out_msg
+    call begin
+    mov dx, SERIAL_SCR
+    mov cx, ITERATIONS
+    .scr_out:
+        out dx, al
+        loop .scr_out
+    mov ecx, ITERATIONS
+    call report
+
+    mov si, scr_in_msg
+    call begin
+    mov dx, SERIAL_SCR
+    mov cx, ITERATIONS
+    .scr_in:
+        in al, dx
+        loop .scr_in
+    mov ecx, ITERATIONS
+    call report
+
+    mov si, lsr_in_msg
+    call begin
+    mov dx, SERIAL_LSR
+    mov cx, ITERATIONS
+    .lsr_in:
+        in al, dx
+        loop .lsr_in
+    mov ecx, ITERATIONS
+    call report
+
+    ; The timer does
+    mov si, timer_in_msg
+    call begin
+    mov dx, TIMER_STATUS
+    mov cx, ITERATIONS
+    .timer_in:
+        in eax, dx
+        loop .timer_in
+    mov ecx, ITERATIONS
+    call report
+
+    ; String I/O, which KVM hands over a page at a time
+    mov si, rep_outsb_msg
+    call begin
+    mov dx, SERIAL_SCR
+    mov si, STRING_BUF
+    mov cx, STRING_BYTES
+    rep outsb
+    mov si, rep_outsb_msg
+    mov ecx, STRING_BYTES
+    call report
+
+    mov si, rep_insb_msg
+    call begin
+    mov dx, SERIAL_SCR
+    mov di, STRING_BUF
+    mov cx, STRING_BYTES
+    rep insb
+    mov ecx, STRING_BYTES
+    call report
+
+    cli
+    hlt
+
+; Start the clock, keeping SI
+begin:
+    push eax
+    push edx
+    rdtsc
+    mov [tsc_start], eax
+    mov [tsc_start + 4], edx
+    pop edx
+    pop eax
+    ret
+
+; Print the name of the test at SI and the cycles since begin, divided by ECX
+report:
+    push ecx
+    rdtsc
+    sub eax, [tsc_start]
+    sbb edx, [tsc_start + 4]
+    pop ecx
+    div ecx
+    call print_str
+    call print_dec
+    mov si, cycles_msg
+    call print_str
+    ret
+
+; Print the unsigned number in EAX in decimal
+print_dec:
+    push eax
+    push ecx
+    push edx
+    push bx
+    mov ecx, 10
+    xor bx, bx
+    .next_digit:
+        xor edx, edx
+        div ecx
+        push dx
+        inc bx
+        test eax, eax
+        jnz .next_digit
+    .print_digit:
+        pop ax
+        add al, '0'
+        call print_char
+        dec bx
+        jnz .print_digit
+    pop bx
+    pop edx
+    pop ecx
+    pop eax
+    ret
+
+print_char:
+    push dx
+    mov dx, SERIAL_PORT
+    out dx, al
+    pop dx
+    ret
+
+print_str:
+    push dx
+    push ax
+    mov dx, SERIAL_PORT
+    .print_next_char:
+        lodsb
+        cmp al, 0
+        je .printstr_done
+        out dx, al
+        jmp .print_next_char
+    .printstr_done:
+        pop ax
+        pop dx
+        ret
+
+welcome_msg             db `Sparkler port benchmark, TSC cycles per access\n`, 0
+scr_out_msg             db `  out serial scratch:  `, 0
+scr_in_msg              db `  in serial scratch:   `, 0
+lsr_in_msg              db `  in serial LSR:       `, 0
+timer_in_msg            db `  in timer status:     `, 0
+rep_outsb_msg           db `  rep outsb scratch:   `, 0
+rep_insb_msg            db `  rep insb scratch:    `, 0
+cycles_msg              db `\n`, 0
@@ -0,0 +1,41 @@
+#include <string.h>
+#include "blob.h"
+#include "pool.h"
+
+/* A blob with one reference and room to render capacity bytes into. Only its creator writes to it. */
+struct blob *blob_alloc(size_t capacity)
+{
+    struct blob *b = pool_alloc(sizeof(*b) + capacity + 1);
+
+    if (!b)
+        return NULL;
+    b->refs = 1;
+    b->len = 0;
+    b->data[0] = '\0';
+    return b;
+}
+
+struct blob *blob_from(const void *data, size_t len)
+{
+    struct blob *b = blob_alloc(len);
+
+    if (!b)
+        return NULL;
+    memcpy(b->data, data, len);
+    b->data[len] = '\0';
+    b->len = len;
+    return b;
+}
+
+struct blob *blob_get(struct blob *b)
+{
+    if (b)
+        __atomic_add_fetch(&b->refs, 1, __ATOMIC_RELAXED);
+    return b;
+}
+
+void blob_put(struct blob *b)
+{
+    if (b && __atomic_sub_fetch(&b->refs, 1, __ATOMIC_ACQ_REL) == 0)
+        pool_free(b);
+}
@@ -0,0 +1,26 @@
+#ifndef SPARKLER_BLOB_H
+#define SPARKLER_BLOB_H
+
+#include <stddef.h>
+
+/*
+ * A rendered device payload: the exact bytes the guest reads, built once
+ * per version of the data and never written to again after that. Anybody
+ * who wants to hold on to one takes a reference, so the caches, in-flight
+ * fetches and guests reading at their own pace can all share one copy.
+ * The bytes are followed by a NUL, which the port interface hands the
+ * guest as its end marker.
+ * */
+
+struct blob {
+    unsigned int refs;
+    size_t len;
+    char data[];
+};
+
+struct blob *blob_alloc(size_t capacity);
+struct blob *blob_from(const void *data, size_t len);
+struct blob *blob_get(struct blob *b);
+void blob_put(struct blob *b);
+
+#endif
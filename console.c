@@ -0,0 +1,220 @@
+#include <errno.h>
+#include <poll.h>
+#include <signal.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <termios.h>
+#include <unistd.h>
+#include "console.h"
+#include "migrate.h"
+#include "replay.h"
+
+static struct termios saved_termios;
+static int termios_saved;
+static int echo_input;
+static int input_eof;
+
+static char ring[CONSOLE_RING_SIZE];
+static unsigned int ring_head, ring_tail;   /* free running, masked on access */
+
+static void console_signal(int sig)
+{
+    console_restore();
+    signal(sig, SIG_DFL);
+    raise(sig);
+}
+
+/* Switch the terminal to raw mode once, for the life of the VM */
+void console_init(void)
+{
+    struct termios raw;
+    static const int fatal_signals[] = { SIGINT, SIGTERM, SIGHUP, SIGQUIT };
+
+    /* Scripted input comes in on a pipe or a file: nothing to set up, nothing to echo */
+    if (!isatty(STDIN_FILENO) || tcgetattr(STDIN_FILENO, &saved_termios) == -1)
+        return;
+
+    raw = saved_termios;
+    raw.c_lflag &= ~(ICANON | ECHO);    /* no line buffering, we echo ourselves */
+    raw.c_cc[VMIN] = 1;
+    raw.c_cc[VTIME] = 0;
+    if (tcsetattr(STDIN_FILENO, TCSANOW, &raw) == -1)
+        return;
+
+    termios_saved = 1;
+    echo_input = 1;
+    atexit(console_restore);
+    for (unsigned int i = 0; i < sizeof(fatal_signals) / sizeof(fatal_signals[0]); i++)
+        signal(fatal_signals[i], console_signal);
+}
+
+/* Put the terminal back the way we found it. Safe to call from a signal handler. */
+void console_restore(void)
+{
+    if (termios_saved) {
+        tcsetattr(STDIN_FILENO, TCSANOW, &saved_termios);
+        termios_saved = 0;
+    }
+}
+
+static unsigned int ring_used(void)
+{
+    return ring_tail - ring_head;
+}
+
+/* Read whatever stdin has for us into the ring, without blocking */
+int console_poll(void)
+{
+    struct pollfd pfd = { .fd = STDIN_FILENO, .events = POLLIN };
+
+    /* Played back, input comes from the recording, and only where it came in before */
+    while (replay_replaying() && !input_eof && ring_used() < CONSOLE_RING_SIZE) {
+        unsigned int off = ring_tail & (CONSOLE_RING_SIZE - 1);
+        unsigned int space = CONSOLE_RING_SIZE - ring_used();
+        int n;
+
+        if (space > CONSOLE_RING_SIZE - off)
+            space = CONSOLE_RING_SIZE - off;
+        n = replay_input(ring + off, space);
+        if (n == -1)
+            input_eof = 1;
+        if (n <= 0)
+            break;
+        ring_tail += n;
+    }
+
+    while (!replay_replaying() && !input_eof && ring_used() < CONSOLE_RING_SIZE
+           && poll(&pfd, 1, 0) == 1) {
+        unsigned int off = ring_tail & (CONSOLE_RING_SIZE - 1);
+        unsigned int space = CONSOLE_RING_SIZE - ring_used();
+        ssize_t n;
+
+        if (space > CONSOLE_RING_SIZE - off)
+            space = CONSOLE_RING_SIZE - off;    /* up to the wrap, the rest next time round */
+
+        n = read(STDIN_FILENO, ring + off, space);
+        if (n == -1 && (errno == EINTR || errno == EAGAIN))
+            continue;
+        if (n <= 0) {
+            input_eof = 1;
+            break;
+        }
+        replay_note_input(ring + off, n);
+        ring_tail += n;
+    }
+
+    return ring_used();
+}
+
+/*
+ * Wait up to timeout_ms (-1 for ever) for input to show up. Returns the
+ * number of buffered bytes, which is zero on timeout or end of input.
+ * */
+int console_wait(int timeout_ms)
+{
+    return console_wait_fd(-1, timeout_ms);
+}
+
+/* Like console_wait(), but also stops waiting as soon as fd, if it isn't -1, is readable */
+int console_wait_fd(int fd, int timeout_ms)
+{
+    struct pollfd pfd[2] = {
+            { .fd = STDIN_FILENO, .events = POLLIN },
+            { .fd = fd, .events = POLLIN },
+    };
+
+    if (ring_used() || console_poll())
+        return ring_used();
+    /* A recording has nothing more to wait for: the input would have been here */
+    if (replay_replaying()) {
+        input_eof = 1;
+        return 0;
+    }
+    if (input_eof) {
+        if (fd == -1)
+            return 0;
+        pfd[0].fd = -1;     /* nothing more is coming, so only fd can wake us */
+    }
+
+    console_flush();
+    if (poll(pfd, 2, timeout_ms) == -1 && errno != EINTR)
+        return 0;
+    return console_poll();
+}
+
+static int ring_pop(void)
+{
+    char c = ring[ring_head & (CONSOLE_RING_SIZE - 1)];
+
+    ring_head++;
+    return (unsigned char)c;
+}
+
+/*
+ * Returns the next input byte, blocking until there is one, or -1 at end
+ * of input. Migration kicks us with a signal when it wants the vCPU
+ * thread, and gets it back from here as CONSOLE_INTERRUPTED.
+ * */
+int console_getc(void)
+{
+    while (!console_wait(-1)) {
+        if (input_eof)
+            return -1;
+        if (migrate_pending())
+            return CONSOLE_INTERRUPTED;
+    }
+
+    return ring_pop();
+}
+
+/* Returns the next input byte if one is waiting, or -1 if there is none */
+int console_trygetc(void)
+{
+    if (!ring_used() && !console_poll())
+        return -1;
+
+    return ring_pop();
+}
+
+/* The terminal no longer echoes for us, so the consumer of a key does */
+void console_echo(char c)
+{
+    if (echo_input)
+        console_putc(c);
+}
+
+void console_putc(char c)
+{
+    putchar(c);
+}
+
+void console_write(const void *buf, size_t len)
+{
+    fwrite(buf, 1, len, stdout);
+}
+
+void console_flush(void)
+{
+    fflush(stdout);
+}
+
+/* Copy out input we've buffered that the guest hasn't read yet, for a guest that's moving elsewhere */
+size_t console_save_input(void *buf, size_t len)
+{
+    size_t n = ring_used() < len ? ring_used() : len;
+
+    for (size_t i = 0; i < n; i++)
+        ((char *)buf)[i] = ring[(ring_head + i) & (CONSOLE_RING_SIZE - 1)];
+    return n;
+}
+
+/* Put back input a guest migrating in hadn't read yet, ahead of anything typed here */
+void console_load_input(const void *buf, size_t len)
+{
+    if (len > CONSOLE_RING_SIZE - ring_used())
+        len = CONSOLE_RING_SIZE - ring_used();
+    ring_head -= len;
+    for (size_t i = 0; i < len; i++)
+        ring[(ring_head + i) & (CONSOLE_RING_SIZE - 1)] = ((const char *)buf)[i];
+}
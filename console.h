@@ -0,0 +1,33 @@
+#ifndef SPARKLER_CONSOLE_H
+#define SPARKLER_CONSOLE_H
+
+/*
+ * The host side of the guest's console. The terminal is put into raw mode
+ * once at startup and put back the way we found it on exit or on a fatal
+ * signal. Input is pulled off stdin in as big a gulp as is available and
+ * buffered in a ring, so pasted or scripted input costs one read() for
+ * many guest keystrokes instead of a read() plus two tcsetattr()s each.
+ * */
+
+#include <stddef.h>
+
+#define CONSOLE_RING_SIZE   4096    /* must be a power of two */
+
+/* What console_getc() returns when a migration starting cuts its wait short */
+#define CONSOLE_INTERRUPTED (-2)
+
+void console_init(void);
+void console_restore(void);
+int console_poll(void);
+int console_wait(int timeout_ms);
+int console_wait_fd(int fd, int timeout_ms);
+int console_getc(void);
+int console_trygetc(void);
+void console_echo(char c);
+void console_putc(char c);
+void console_write(const void *buf, size_t len);
+void console_flush(void);
+size_t console_save_input(void *buf, size_t len);
+void console_load_input(const void *buf, size_t len);
+
+#endif
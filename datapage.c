@@ -0,0 +1,117 @@
+#include <err.h>
+#include <linux/kvm.h>
+#include <pthread.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/ioctl.h>
+#include <sys/mman.h>
+#include <time.h>
+#include "datapage.h"
+#include "placement.h"
+#include "trace.h"
+
+static uint8_t *page;
+static int enabled = 1;
+static datapage_fetch_fn fetch_device;
+
+static struct datapage_device *device_slot(unsigned int device)
+{
+    return (struct datapage_device *)(page + device * DATAPAGE_DEVICE_SIZE);
+}
+
+/* Map the data page into the guest, read-only, at DATAPAGE_ADDR. It stays empty if we've been told not to use it. */
+void datapage_init(int vmfd)
+{
+    const char *use = getenv("SPARKLER_DATA_PAGE");
+    struct kvm_userspace_memory_region region = {
+            .slot = DATAPAGE_SLOT,
+            .flags = KVM_MEM_READONLY,
+            .guest_phys_addr = DATAPAGE_ADDR,
+            .memory_size = DATAPAGE_SIZE,
+    };
+
+    enabled = !(use && strcmp(use, "0") == 0);
+
+    /* stats_init() has already made sure KVM can do read-only memory */
+    page = mmap(NULL, DATAPAGE_SIZE, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (page == MAP_FAILED)
+        err(1, "allocating the data page");
+
+    region.userspace_addr = (uint64_t)page;
+    if (ioctl(vmfd, KVM_SET_USER_MEMORY_REGION, &region) == -1)
+        err(1, "KVM_SET_USER_MEMORY_REGION for the data page");
+}
+
+/*
+ * Copy in a new version of a device's payload. The count goes odd before
+ * anything else changes and even again only once everything has, so a
+ * guest copying it out at the same time sees it's been changed under it.
+ * There's only ever the one writer.
+ * */
+void datapage_publish(unsigned int device, const struct blob *payload)
+{
+    struct datapage_device *slot;
+    uint32_t seq;
+
+    if (!enabled || device >= DATAPAGE_NR_DEVICES || payload->len > DATAPAGE_MAX_PAYLOAD)
+        return;
+    slot = device_slot(device);
+    seq = slot->seq;
+
+    __atomic_store_n(&slot->seq, seq + 1, __ATOMIC_RELAXED);
+    __atomic_thread_fence(__ATOMIC_RELEASE);
+    memcpy(slot + 1, payload->data, payload->len);
+    __atomic_store_n(&slot->len, payload->len, __ATOMIC_RELAXED);
+    __atomic_store_n(&slot->seq, seq + 2, __ATOMIC_RELEASE);
+}
+
+static void *refresh_thread(void *arg)
+{
+    /* What's on the page now, so the same version isn't copied in again */
+    struct blob *published[DATAPAGE_NR_DEVICES] = { NULL };
+    struct timespec interval = {
+            .tv_sec = DATAPAGE_REFRESH_MS / 1000,
+            .tv_nsec = (DATAPAGE_REFRESH_MS % 1000) * 1000000,
+    };
+
+    placement_io_thread();
+    trace_thread_name("data page");
+
+    for (;;) {
+        for (unsigned int i = 0; i < DATAPAGE_NR_DEVICES; i++) {
+            struct blob *payload = fetch_device(i);
+
+            if (!payload)
+                continue;
+            if (payload == published[i]) {
+                blob_put(payload);
+                continue;
+            }
+            datapage_publish(i, payload);
+            if (published[i])
+                blob_put(published[i]);
+            published[i] = payload;
+        }
+        nanosleep(&interval, NULL);
+    }
+    return NULL;
+}
+
+/* Keep the page up to date with whatever fetch comes up with for each device */
+void datapage_start(datapage_fetch_fn fetch)
+{
+    pthread_t thread;
+
+    if (!enabled)
+        return;
+    fetch_device = fetch;
+    if (pthread_create(&thread, NULL, refresh_thread, NULL) != 0)
+        errx(1, "starting the data page thread");
+    pthread_detach(thread);
+}
+
+/* Whether an MMIO exit at addr was the guest writing to the data page, which we just ignore */
+int datapage_mmio(uint64_t addr)
+{
+    return addr >= DATAPAGE_ADDR && addr < DATAPAGE_ADDR + DATAPAGE_SIZE;
+}
@@ -0,0 +1,48 @@
+#ifndef SPARKLER_DATAPAGE_H
+#define SPARKLER_DATAPAGE_H
+
+#include <stddef.h>
+#include <stdint.h>
+#include "blob.h"
+
+/*
+ * Device payloads the guest can read for itself, without asking us. Like
+ * the stats page, it's mapped into the guest read-only through a slot of
+ * its own, here in the unbacked hole at 0xa0000, with a fixed size slot
+ * for every device in the same order as the stats page has them. A thread
+ * of ours keeps fetching every device and copies in each new version of a
+ * payload as it turns up, so reading the latest one is a plain copy for
+ * the guest: no exits, and nothing for us to do.
+ *
+ * Each slot is guarded by a sequence count, odd while we're writing it.
+ * A reader copies the payload out between two reads of the count and
+ * tries again if they differ or the first was odd. A slot whose count is
+ * still 0 hasn't had anything in it yet, and the guest has to ask us the
+ * old way. SPARKLER_DATA_PAGE=0 leaves it that way for good.
+ * */
+
+#define DATAPAGE_ADDR           0xa0000
+#define DATAPAGE_SLOT           4           /* after guest RAM's */
+#define DATAPAGE_DEVICE_SIZE    0x3000
+#define DATAPAGE_NR_DEVICES     13
+#define DATAPAGE_SIZE           (DATAPAGE_NR_DEVICES * DATAPAGE_DEVICE_SIZE)
+#define DATAPAGE_MAX_PAYLOAD    (DATAPAGE_DEVICE_SIZE - sizeof(struct datapage_device))
+
+/* How often every device is fetched again; fetches are mostly served from the cache */
+#define DATAPAGE_REFRESH_MS     5000
+
+/* Followed by the payload, without a NUL */
+struct datapage_device {
+    uint32_t seq;
+    uint32_t len;
+};
+
+/* A reference to device's latest payload, or NULL */
+typedef struct blob *(*datapage_fetch_fn)(unsigned int device);
+
+void datapage_init(int vmfd);
+void datapage_publish(unsigned int device, const struct blob *payload);
+void datapage_start(datapage_fetch_fn fetch);
+int datapage_mmio(uint64_t addr);
+
+#endif
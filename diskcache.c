@@ -0,0 +1,432 @@
+#include <err.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <stddef.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#include "diskcache.h"
+#include "pool.h"
+
+#define INITIAL_BUCKETS     64
+
+struct cache_entry {
+    const char *key;            /* not NUL terminated when it points into the mapping */
+    uint16_t key_len;
+    const char *data;
+    uint32_t data_len;
+    uint64_t timestamp;
+    int owned;                  /* key and data are pool copies rather than pointers into the mapping */
+};
+
+static pthread_mutex_t cache_lock = PTHREAD_MUTEX_INITIALIZER;
+static int cache_fd = -1;
+static uint8_t *map;
+static size_t map_size;
+static struct cache_entry *buckets;
+static unsigned int nr_buckets, nr_entries;
+static struct diskcache_stats stats;
+
+static uint32_t crc_table[256];
+
+static void crc_init(void)
+{
+    for (uint32_t i = 0; i < 256; i++) {
+        uint32_t c = i;
+
+        for (int k = 0; k < 8; k++)
+            c = (c & 1) ? 0xedb88320 ^ (c >> 1) : c >> 1;
+        crc_table[i] = c;
+    }
+}
+
+static uint32_t crc_update(uint32_t crc, const void *buf, size_t len)
+{
+    const uint8_t *p = buf;
+
+    crc = ~crc;
+    while (len--)
+        crc = crc_table[(crc ^ *p++) & 0xff] ^ (crc >> 8);
+    return ~crc;
+}
+
+static uint32_t record_crc(const struct diskcache_record *rec, const char *key, const char *data)
+{
+    uint32_t crc = crc_update(0, &rec->timestamp, sizeof(*rec) - offsetof(struct diskcache_record, timestamp));
+
+    crc = crc_update(crc, key, rec->key_len);
+    return crc_update(crc, data, rec->data_len);
+}
+
+static size_t record_size(size_t key_len, size_t data_len)
+{
+    return (sizeof(struct diskcache_record) + key_len + data_len + 7) & ~(size_t)7;
+}
+
+/* FNV-1a */
+static uint32_t hash_key(const char *key, size_t len)
+{
+    uint32_t h = 2166136261u;
+
+    while (len--)
+        h = (h ^ (uint8_t)*key++) * 16777619u;
+    return h;
+}
+
+static struct cache_entry *find_slot(struct cache_entry *table, unsigned int size, const char *key, size_t len)
+{
+    unsigned int i = hash_key(key, len) & (size - 1);
+
+    while (table[i].key && (table[i].key_len != len || memcmp(table[i].key, key, len) != 0))
+        i = (i + 1) & (size - 1);
+    return &table[i];
+}
+
+static int grow_index(void)
+{
+    unsigned int size = nr_buckets ? nr_buckets * 2 : INITIAL_BUCKETS;
+    struct cache_entry *table = pool_zalloc(sizeof(*table) * size);
+
+    if (!table)
+        return -1;
+    for (unsigned int i = 0; i < nr_buckets; i++) {
+        if (buckets[i].key)
+            *find_slot(table, size, buckets[i].key, buckets[i].key_len) = buckets[i];
+    }
+    pool_free(buckets);
+    buckets = table;
+    nr_buckets = size;
+    return 0;
+}
+
+/* Records later in the log replace earlier ones for the same key */
+static int index_insert(const struct cache_entry *entry)
+{
+    struct cache_entry *slot;
+
+    if ((nr_entries + 1) * 4 > nr_buckets * 3 && grow_index() == -1)
+        return -1;
+
+    slot = find_slot(buckets, nr_buckets, entry->key, entry->key_len);
+    if (slot->key) {
+        if (slot->owned) {
+            pool_free((void *)slot->key);
+            pool_free((void *)slot->data);
+        }
+    } else {
+        nr_entries++;
+    }
+    *slot = *entry;
+    return 0;
+}
+
+static void index_clear(void)
+{
+    for (unsigned int i = 0; i < nr_buckets; i++) {
+        if (buckets[i].key && buckets[i].owned) {
+            pool_free((void *)buckets[i].key);
+            pool_free((void *)buckets[i].data);
+        }
+    }
+    pool_free(buckets);
+    buckets = NULL;
+    nr_buckets = nr_entries = 0;
+}
+
+static void unmap_file(void)
+{
+    index_clear();
+    if (map)
+        munmap(map, map_size);
+    map = NULL;
+    map_size = 0;
+    if (cache_fd != -1)
+        close(cache_fd);
+    cache_fd = -1;
+}
+
+static int write_all(int fd, const void *buf, size_t len)
+{
+    const uint8_t *p = buf;
+
+    while (len) {
+        ssize_t n = write(fd, p, len);
+
+        if (n <= 0)
+            return -1;
+        p += n;
+        len -= n;
+    }
+    return 0;
+}
+
+static int append_record(int fd, const char *key, size_t key_len, const char *data, size_t data_len, uint64_t timestamp)
+{
+    size_t size = record_size(key_len, data_len);
+    struct diskcache_record *rec = pool_zalloc(size);
+    int ret;
+
+    if (!rec)
+        return -1;
+    rec->magic = DISKCACHE_RECORD_MAGIC;
+    rec->timestamp = timestamp;
+    rec->key_len = key_len;
+    rec->data_len = data_len;
+    memcpy(rec + 1, key, key_len);
+    memcpy((char *)(rec + 1) + key_len, data, data_len);
+    rec->crc = record_crc(rec, key, data);
+
+    /* One write per record, so a crash leaves at worst a torn tail for the next open to cut off */
+    ret = write_all(fd, rec, size);
+    pool_free(rec);
+    return ret;
+}
+
+/* Start the file over with nothing but a header */
+static int reset_file(int fd)
+{
+    struct diskcache_header hdr = { DISKCACHE_MAGIC, DISKCACHE_VERSION };
+
+    if (ftruncate(fd, 0) == -1 || lseek(fd, 0, SEEK_SET) == -1)
+        return -1;
+    return write_all(fd, &hdr, sizeof(hdr));
+}
+
+/* Walk the log, indexing every intact record. Returns the length of the intact part. */
+static size_t scan_log(void)
+{
+    size_t off = sizeof(struct diskcache_header);
+
+    while (off + sizeof(struct diskcache_record) <= map_size) {
+        struct diskcache_record *rec = (struct diskcache_record *)(map + off);
+        const char *key = (const char *)(rec + 1);
+        const char *data = key + rec->key_len;
+        struct cache_entry entry;
+
+        if (rec->magic != DISKCACHE_RECORD_MAGIC
+            || record_size(rec->key_len, rec->data_len) > map_size - off
+            || record_crc(rec, key, data) != rec->crc)
+            break;
+
+        entry.key = key;
+        entry.key_len = rec->key_len;
+        entry.data = data;
+        entry.data_len = rec->data_len;
+        entry.timestamp = rec->timestamp;
+        entry.owned = 0;
+        if (index_insert(&entry) == -1)
+            break;
+        off += record_size(rec->key_len, rec->data_len);
+    }
+    return off;
+}
+
+static size_t live_bytes(void)
+{
+    size_t live = sizeof(struct diskcache_header);
+
+    for (unsigned int i = 0; i < nr_buckets; i++) {
+        if (buckets[i].key)
+            live += record_size(buckets[i].key_len, buckets[i].data_len);
+    }
+    return live;
+}
+
+/* Rewrite the log with only the newest record for each key, then swap it in */
+static int compact(const char *path)
+{
+    char tmp_path[4096];
+    int fd;
+
+    snprintf(tmp_path, sizeof(tmp_path), "%s.tmp", path);
+    fd = open(tmp_path, O_RDWR | O_CREAT | O_TRUNC, 0644);
+    if (fd == -1)
+        return -1;
+    if (reset_file(fd) == -1)
+        goto error_exit;
+    for (unsigned int i = 0; i < nr_buckets; i++) {
+        struct cache_entry *e = &buckets[i];
+
+        if (e->key && append_record(fd, e->key, e->key_len, e->data, e->data_len, e->timestamp) == -1)
+            goto error_exit;
+    }
+    if (fsync(fd) == -1 || rename(tmp_path, path) == -1)
+        goto error_exit;
+    close(fd);
+    return 0;
+
+error_exit:
+    close(fd);
+    unlink(tmp_path);
+    return -1;
+}
+
+static int load(const char *path, int allow_compact)
+{
+    struct stat st;
+    size_t good;
+
+    cache_fd = open(path, O_RDWR | O_CREAT | O_APPEND, 0644);
+    if (cache_fd == -1 || fstat(cache_fd, &st) == -1) {
+        warn("diskcache: %s", path);
+        goto error_exit;
+    }
+
+    if ((size_t)st.st_size >= sizeof(struct diskcache_header)) {
+        map = mmap(NULL, st.st_size, PROT_READ, MAP_SHARED, cache_fd, 0);
+        if (map == MAP_FAILED) {
+            map = NULL;
+            warn("diskcache: mmap %s", path);
+            goto error_exit;
+        }
+        map_size = st.st_size;
+    }
+
+    if (!map || ((struct diskcache_header *)map)->magic != DISKCACHE_MAGIC
+        || ((struct diskcache_header *)map)->version != DISKCACHE_VERSION) {
+        if (map)
+            warnx("diskcache: %s isn't a cache we understand, starting it afresh", path);
+        if (reset_file(cache_fd) == -1) {
+            warn("diskcache: %s", path);
+            goto error_exit;
+        }
+        return 0;
+    }
+
+    good = scan_log();
+    if (good < map_size) {
+        /* Records only ever point below `good`, so what lies past it can go */
+        warnx("diskcache: dropping %zu bytes of damaged records from the end of %s", map_size - good, path);
+        if (ftruncate(cache_fd, good) == -1) {
+            warn("diskcache: %s", path);
+            goto error_exit;
+        }
+    }
+
+    if (allow_compact && good >= DISKCACHE_COMPACT_MIN && live_bytes() * 2 < good) {
+        if (compact(path) == 0) {
+            unmap_file();
+            return load(path, 0);
+        }
+        warn("diskcache: compacting %s", path);
+    }
+
+    stats.loaded = nr_entries;
+    return 0;
+
+error_exit:
+    unmap_file();
+    return -1;
+}
+
+/* Open, and create if needed, the cache at path. Without it, everything else here is a no-op. */
+int diskcache_open(const char *path)
+{
+    int ret;
+
+    pthread_mutex_lock(&cache_lock);
+    crc_init();
+    ret = load(path, 1);
+    pthread_mutex_unlock(&cache_lock);
+    return ret;
+}
+
+void diskcache_close(void)
+{
+    pthread_mutex_lock(&cache_lock);
+    unmap_file();
+    pthread_mutex_unlock(&cache_lock);
+}
+
+/* A fresh blob holding the last payload stored under key, or NULL. *fetched is when it was stored. */
+struct blob *diskcache_get(const char *key, time_t *fetched)
+{
+    struct cache_entry *e;
+    struct blob *copy = NULL;
+
+    pthread_mutex_lock(&cache_lock);
+    if (!buckets) {
+        stats.misses++;
+        goto out;
+    }
+    e = find_slot(buckets, nr_buckets, key, strlen(key));
+    if (!e->key) {
+        stats.misses++;
+        goto out;
+    }
+    copy = blob_from(e->data, e->data_len);
+    if (!copy)
+        goto out;
+    *fetched = e->timestamp;
+    stats.hits++;
+
+out:
+    pthread_mutex_unlock(&cache_lock);
+    return copy;
+}
+
+/* Append a fresh payload for key to the log and make it the one diskcache_get() returns */
+int diskcache_put(const char *key, const char *data, size_t len)
+{
+    struct cache_entry entry;
+    size_t key_len = strlen(key);
+    char *key_copy, *data_copy;
+    int ret = -1;
+
+    if (key_len > UINT16_MAX || len > UINT32_MAX)
+        return -1;
+
+    pthread_mutex_lock(&cache_lock);
+    if (cache_fd == -1)
+        goto out;
+
+    entry.timestamp = time(NULL);
+    if (append_record(cache_fd, key, key_len, data, len, entry.timestamp) == -1) {
+        warn("diskcache: write");
+        goto out;
+    }
+    stats.writes++;
+
+    key_copy = pool_alloc(key_len);
+    data_copy = pool_alloc(len ? len : 1);
+    if (!key_copy || !data_copy) {
+        pool_free(key_copy);
+        pool_free(data_copy);
+        goto out;
+    }
+    memcpy(key_copy, key, key_len);
+    memcpy(data_copy, data, len);
+    entry.key = key_copy;
+    entry.key_len = key_len;
+    entry.data = data_copy;
+    entry.data_len = len;
+    entry.owned = 1;
+    if (index_insert(&entry) == -1) {
+        pool_free(key_copy);
+        pool_free(data_copy);
+        goto out;
+    }
+    ret = 0;
+
+out:
+    pthread_mutex_unlock(&cache_lock);
+    return ret;
+}
+
+void diskcache_get_stats(struct diskcache_stats *out)
+{
+    pthread_mutex_lock(&cache_lock);
+    *out = stats;
+    pthread_mutex_unlock(&cache_lock);
+}
+
+void diskcache_print_stats(FILE *f)
+{
+    struct diskcache_stats s;
+
+    diskcache_get_stats(&s);
+    fprintf(f, "diskcache: %lu records loaded, %lu hits, %lu misses, %lu writes\n",
+            s.loaded, s.hits, s.misses, s.writes);
+}
@@ -0,0 +1,60 @@
+#ifndef SPARKLER_DISKCACHE_H
+#define SPARKLER_DISKCACHE_H
+
+#include <stdint.h>
+#include <stdio.h>
+#include <time.h>
+#include "blob.h"
+
+/*
+ * A persistent cache of rendered device payloads, so a freshly started
+ * sparkler has something to show the guest before it has been anywhere
+ * near the network.
+ *
+ * The file is a log: a header followed by records that are only ever
+ * appended, each carrying its key, payload, the time it was fetched and
+ * a CRC32 over all of that. At startup we mmap the whole file, walk it
+ * and index the newest record for every key, pointing straight into the
+ * mapping. A torn or corrupt tail is cut off, and the log is rewritten
+ * with just the live records once most of it is dead.
+ * */
+
+#define DISKCACHE_FILE          "sparkler.cache"
+
+/* Once the log is at least this big and more than half dead, it is compacted on open */
+#define DISKCACHE_COMPACT_MIN   (64 * 1024)
+
+#define DISKCACHE_MAGIC         0x48435053  /* "SPCH" */
+#define DISKCACHE_VERSION       1
+#define DISKCACHE_RECORD_MAGIC  0x43455253  /* "SREC" */
+
+struct diskcache_header {
+    uint32_t magic;
+    uint32_t version;
+};
+
+/* Followed by key_len bytes of key and data_len bytes of payload, padded out to 8 bytes */
+struct diskcache_record {
+    uint32_t magic;
+    uint32_t crc;               /* covers everything after this field, key and payload included */
+    uint64_t timestamp;         /* when the payload was fetched, in seconds since the epoch */
+    uint16_t key_len;
+    uint16_t reserved;
+    uint32_t data_len;
+};
+
+struct diskcache_stats {
+    unsigned long loaded;       /* live records found at startup */
+    unsigned long hits;
+    unsigned long misses;
+    unsigned long writes;
+};
+
+int diskcache_open(const char *path);
+void diskcache_close(void);
+struct blob *diskcache_get(const char *key, time_t *fetched);
+int diskcache_put(const char *key, const char *data, size_t len);
+void diskcache_get_stats(struct diskcache_stats *stats);
+void diskcache_print_stats(FILE *f);
+
+#endif
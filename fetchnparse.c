@@ -1,16 +1,75 @@
+#include <pthread.h>
+#include <stdarg.h>
+#include <strings.h>
+#include "backend.h"
+#include "blob.h"
+#include "diskcache.h"
 #include "fetchnparse.h"
 #include "json.h"
+#include "placement.h"
+#include "pool.h"
+#include "singleflight.h"
+#include "trace.h"
+#include "wire.h"
+
+/* Each thread that fetches keeps its own curl sessions; easy handles can't be shared between threads */
+static __thread CURL *curl_handle;
+static __thread CURL *hedge_handle;
+static __thread CURLM *curl_multi;
+static __thread int last_source;
+static __thread json_keys *response_keys;
+static __thread int quiet;          /* nobody on this thread's fetches is watching the console for them */
+static pthread_once_t curl_once = PTHREAD_ONCE_INIT;
+
+/* Ask for the binary encoding, but make it clear JSON will do */
+#define ACCEPT_HEADER       "Accept: " WIRE_CONTENT_TYPE ", application/json;q=0.5"
+
+/*
+ * The current version of every payload we've rendered, keyed by request
+ * URL. Every read of that URL is served by handing out another reference
+ * to the same blob until a newer version replaces it. Alongside it we keep
+ * what the service told us about the version, so that we can later ask it
+ * whether anything has changed.
+ * */
+struct report {
+    struct report *next;
+    char *url;
+    struct blob *blob;
+    time_t fetched;
+    char etag[VALIDATOR_SIZE];
+    char last_modified[VALIDATOR_SIZE];
+    int refreshing;             /* a background refresh of it is under way */
+    time_t refresh_tried;       /* when the last one set off */
+};
+
+static pthread_mutex_t reports_lock = PTHREAD_MUTEX_INITIALIZER;
+static struct report *reports;
+
+/* Room in a report blob, such that the whole blob fits in a REPORT_SIZE pool block */
+#define REPORT_CAPACITY     (REPORT_SIZE - sizeof(struct blob) - 1)
+
+/* One day of a weather report, whichever format it reached us in */
+#define WEATHER_DAY_FORMAT  "Date: %.*s\n\tWeather: %.*s\n\tMin. temp: %.02f\n\tMax. temp: %.02f\n\tHumidity: %ld\n"
+#define AIR_QUALITY_FORMAT  "%.*s: %.*s\n"
 
 static size_t
 WriteMemoryCallback(void *contents, size_t size, size_t nmemb, void *userp)
 {
     size_t realsize = size * nmemb;
     struct MemoryStruct *mem = (struct MemoryStruct *)userp;
+    size_t needed = mem->size + realsize + 1;
+    curl_off_t content_length;
 
-    char *ptr = realloc(mem->memory, mem->size + realsize + 1);
+    /* If the server told us how big the body is, size the buffer for all of it up front */
+    if (mem->size == 0
+        && curl_easy_getinfo(mem->curl, CURLINFO_CONTENT_LENGTH_DOWNLOAD_T, &content_length) == CURLE_OK
+        && (size_t)content_length + 1 > needed)
+        needed = content_length + 1;
+
+    char *ptr = pool_realloc(mem->memory, needed);
     if(ptr == NULL) {
         /* out of memory! */
-        printf("not enough memory (realloc returned NULL)\n");
+        printf("not enough memory (pool_realloc returned NULL)\n");
         return 0;
     }
 
@@ -22,205 +81,858 @@ WriteMemoryCallback(void *contents, size_t size, size_t nmemb, void *userp)
     return realsize;
 }
 
-CURL *curl_handle;
-struct MemoryStruct chunk;
+/* Copy out the value of a "name: value" header line if it is the one we're after and it fits */
+static void copy_header(const char *line, size_t len, const char *name, char *out, size_t size)
+{
+    size_t name_len = strlen(name);
+
+    if (len <= name_len || strncasecmp(line, name, name_len) != 0 || line[name_len] != ':')
+        return;
+    line += name_len + 1;
+    len -= name_len + 1;
+    while (len && (*line == ' ' || *line == '\t')) {
+        line++;
+        len--;
+    }
+    while (len && (line[len - 1] == '\r' || line[len - 1] == '\n' || line[len - 1] == ' '))
+        len--;
+    if (len >= size)
+        return;     /* too long to keep; we just won't revalidate this one */
+    memcpy(out, line, len);
+    out[len] = '\0';
+}
 
-int _fetch_url(char *url)
+static size_t HeaderCallback(char *buffer, size_t size, size_t nitems, void *userp)
 {
-    CURLcode res;
+    struct MemoryStruct *mem = (struct MemoryStruct *)userp;
+    size_t len = size * nitems;
+
+    copy_header(buffer, len, "ETag", mem->etag, sizeof(mem->etag));
+    copy_header(buffer, len, "Last-Modified", mem->last_modified, sizeof(mem->last_modified));
+    return len;
+}
+
+/* Called with reports_lock held */
+static struct report *find_report(const char *url)
+{
+    for (struct report *r = reports; r; r = r->next) {
+        if (strcmp(r->url, url) == 0)
+            return r;
+    }
+    return NULL;
+}
+
+/* A reference to the current version of url's payload, if we have one */
+static struct blob *current_report(const char *url, time_t *fetched)
+{
+    struct report *r;
+    struct blob *b = NULL;
+
+    pthread_mutex_lock(&reports_lock);
+    r = find_report(url);
+    if (r && r->blob) {
+        b = blob_get(r->blob);
+        *fetched = r->fetched;
+    }
+    pthread_mutex_unlock(&reports_lock);
+    return b;
+}
+
+/*
+ * Make b the current version of url's payload, fetched at the given time.
+ * etag and last_modified are what the service said about it, if anything.
+ * */
+static void publish_report(const char *url, struct blob *b, time_t fetched,
+                           const char *etag, const char *last_modified)
+{
+    struct report *r;
+
+    pthread_mutex_lock(&reports_lock);
+    r = find_report(url);
+    if (!r) {
+        r = pool_zalloc(sizeof(*r));
+        if (!r)
+            goto out;
+        r->url = pool_alloc(strlen(url) + 1);
+        if (!r->url) {
+            pool_free(r);
+            goto out;
+        }
+        strcpy(r->url, url);
+        r->next = reports;
+        reports = r;
+    }
+
+    blob_put(r->blob);
+    r->blob = blob_get(b);
+    r->fetched = fetched;
+    strcpy(r->etag, etag);
+    strcpy(r->last_modified, last_modified);
+
+out:
+    pthread_mutex_unlock(&reports_lock);
+}
+
+/* The conditional request headers for url, added on to headers */
+static struct curl_slist *add_conditions(struct curl_slist *headers, const char *url)
+{
+    struct report *r;
+    char line[VALIDATOR_SIZE + 32];
+
+    pthread_mutex_lock(&reports_lock);
+    r = find_report(url);
+    if (r && r->blob && r->etag[0]) {
+        snprintf(line, sizeof(line), "If-None-Match: %s", r->etag);
+        headers = curl_slist_append(headers, line);
+    }
+    if (r && r->blob && r->last_modified[0]) {
+        snprintf(line, sizeof(line), "If-Modified-Since: %s", r->last_modified);
+        headers = curl_slist_append(headers, line);
+    }
+    pthread_mutex_unlock(&reports_lock);
+    return headers;
+}
 
-    chunk.memory = malloc(1);  /* will be grown as needed by the realloc above */
-    chunk.size = 0;    /* no data at this point */
+/* The service says the version of url we have still stands: it's fresh again, and it's what we hand out */
+static struct blob *not_modified(const char *url)
+{
+    struct report *r;
+    struct blob *b = NULL;
+
+    pthread_mutex_lock(&reports_lock);
+    r = find_report(url);
+    if (r && r->blob) {
+        b = blob_get(r->blob);
+        r->fetched = time(NULL);
+    }
+    pthread_mutex_unlock(&reports_lock);
+    return b;
+}
 
+void _fetch_cleanup(struct MemoryStruct *chunk) {
+    pool_free(chunk->memory);
+    chunk->memory = NULL;
+}
+
+static void curl_global_setup(void)
+{
     curl_global_init(CURL_GLOBAL_ALL);
+}
 
-    /* init the curl session */
-    curl_handle = curl_easy_init();
+/* Where the sparkler service lives. SPARKLER_SERVICE points us elsewhere, such as at a local stand-in. */
+static const char *service_url(void)
+{
+    const char *url = getenv("SPARKLER_SERVICE");
 
-    /* specify URL to get */
-    curl_easy_setopt(curl_handle, CURLOPT_URL, url);
+    return url ? url : SERVICE_URL;
+}
 
-    /* send all data to this function  */
-    curl_easy_setopt(curl_handle, CURLOPT_WRITEFUNCTION, WriteMemoryCallback);
+static CURL *new_handle(void)
+{
+    CURL *curl;
 
-    /* we pass our 'chunk' struct to the callback function */
-    curl_easy_setopt(curl_handle, CURLOPT_WRITEDATA, (void *)&chunk);
+    pthread_once(&curl_once, curl_global_setup);
+
+    /* init the curl session */
+    curl = curl_easy_init();
+    if (!curl)
+        return NULL;
+
+    /* send all data to this function  */
+    curl_easy_setopt(curl, CURLOPT_WRITEFUNCTION, WriteMemoryCallback);
 
     /* some servers don't like requests that are made without a user-agent
        field, so we provide one */
-    curl_easy_setopt(curl_handle, CURLOPT_USERAGENT, "sparkler-agent/1.0");
+    curl_easy_setopt(curl, CURLOPT_USERAGENT, "sparkler-agent/1.0");
+
+    /* Offer every content encoding curl can undo for us; "" means all of them */
+    curl_easy_setopt(curl, CURLOPT_ACCEPT_ENCODING, "");
+
+    curl_easy_setopt(curl, CURLOPT_HEADERFUNCTION, HeaderCallback);
+    return curl;
+}
+
+/*
+ * The curl sessions are set up once and reused for every fetch, so we
+ * neither pay for their setup nor drop connections between requests. The
+ * hedge handle only ever gets used when a request is running late.
+ * */
+static int setup_handles(void)
+{
+    if (!curl_handle)
+        curl_handle = new_handle();
+    if (!hedge_handle)
+        hedge_handle = new_handle();
+    if (!curl_multi)
+        curl_multi = curl_multi_init();
+    return curl_handle && hedge_handle && curl_multi ? 0 : -1;
+}
+
+static void cleanup_handles(void)
+{
+    curl_easy_cleanup(curl_handle);
+    curl_easy_cleanup(hedge_handle);
+    curl_multi_cleanup(curl_multi);
+    curl_handle = hedge_handle = NULL;
+    curl_multi = NULL;
+}
+
+static void start_transfer(CURL *curl, struct MemoryStruct *chunk, const char *url,
+                           struct curl_slist *headers, unsigned int timeout_ms)
+{
+    chunk->memory = NULL;  /* sized on the first write by the pool_realloc above */
+    chunk->size = 0;    /* no data at this point */
+    chunk->curl = curl;
+    chunk->sent = trace_now();
+    chunk->etag[0] = '\0';
+    chunk->last_modified[0] = '\0';
+
+    /* we pass our 'chunk' struct to the callback function */
+    curl_easy_setopt(curl, CURLOPT_WRITEDATA, (void *)chunk);
+    curl_easy_setopt(curl, CURLOPT_HEADERDATA, (void *)chunk);
+
+    /* specify URL to get */
+    curl_easy_setopt(curl, CURLOPT_URL, url);
+    curl_easy_setopt(curl, CURLOPT_HTTPHEADER, headers);
+
+    /* Never wait on the service for longer than its backend allows */
+    curl_easy_setopt(curl, CURLOPT_TIMEOUT_MS, (long)timeout_ms);
+    curl_easy_setopt(curl, CURLOPT_CONNECTTIMEOUT_MS,
+                     (long)(timeout_ms < BACKEND_CONNECT_TIMEOUT_MS ? timeout_ms : BACKEND_CONNECT_TIMEOUT_MS));
+
+    curl_multi_add_handle(curl_multi, curl);
+}
+
+/* A phase of a transfer, from and to times curl gave in microseconds since it went out */
+static void trace_phase(const char *name, uint64_t sent, curl_off_t from_us, curl_off_t to_us)
+{
+    if (to_us > from_us)
+        trace_record("curl", name, sent + from_us * 1000, sent + to_us * 1000, NULL, 0);
+}
+
+/*
+ * Lay out how a transfer went, as curl timed it: looking the host up,
+ * connecting, the TLS handshake, waiting for the first byte and the rest
+ * of the response, all under a span for the whole thing. Phases that
+ * didn't happen, say on a connection kept from before, are left out.
+ * */
+static void trace_transfer(struct backend *b, struct MemoryStruct *chunk)
+{
+    curl_off_t dns = 0, connect = 0, tls = 0, request = 0, first_byte = 0, total = 0;
+    uint64_t now = trace_clock();
+
+    curl_easy_getinfo(chunk->curl, CURLINFO_NAMELOOKUP_TIME_T, &dns);
+    curl_easy_getinfo(chunk->curl, CURLINFO_CONNECT_TIME_T, &connect);
+    curl_easy_getinfo(chunk->curl, CURLINFO_APPCONNECT_TIME_T, &tls);
+    curl_easy_getinfo(chunk->curl, CURLINFO_PRETRANSFER_TIME_T, &request);
+    curl_easy_getinfo(chunk->curl, CURLINFO_STARTTRANSFER_TIME_T, &first_byte);
+    curl_easy_getinfo(chunk->curl, CURLINFO_TOTAL_TIME_T, &total);
+
+    /* One that's given up on part way through hasn't a total yet */
+    if (!total)
+        total = (now - chunk->sent) / 1000;
+
+    trace_record("curl", b->name, chunk->sent, chunk->sent + total * 1000, "bytes", chunk->size);
+    trace_phase("dns", chunk->sent, 0, dns);
+    trace_phase("connect", chunk->sent, dns, connect);
+    trace_phase("tls", chunk->sent, connect, tls);
+    trace_phase("first byte", chunk->sent, request, first_byte);
+    trace_phase("body", chunk->sent, first_byte, total);
+}
+
+static void finish_transfer(CURL *curl)
+{
+    curl_multi_remove_handle(curl_multi, curl);
+    curl_easy_setopt(curl, CURLOPT_HTTPHEADER, NULL);
+}
+
+/*
+ * Run the request in chunk until it finishes or its deadline passes. If
+ * it's still going hedge_after ms in, the same request goes out on the
+ * hedge handle too, into hedge, and whichever succeeds first is the one we
+ * keep. Returns the handle that finished, with its result in res, or NULL.
+ * */
+static CURL *run_transfers(struct backend *b, const char *url, struct curl_slist *headers,
+                           struct MemoryStruct *hedge, unsigned int hedge_after, CURLcode *res)
+{
+    unsigned int timeout = backend_timeout(b);
+    uint64_t start = backend_now_ms(), elapsed;
+    int running = 1, hedged = 0;
+
+    *res = CURLE_OPERATION_TIMEDOUT;
+    while (1) {
+        CURLMsg *msg;
+        int left, wait_ms;
+
+        curl_multi_perform(curl_multi, &running);
+        while ((msg = curl_multi_info_read(curl_multi, &left))) {
+            if (msg->msg != CURLMSG_DONE)
+                continue;
+            *res = msg->data.result;
+            if (*res == CURLE_OK)
+                return msg->easy_handle;
+            /* The other one might yet do better */
+            curl_multi_remove_handle(curl_multi, msg->easy_handle);
+        }
+
+        elapsed = backend_now_ms() - start;
+        if (elapsed >= timeout)
+            return NULL;
+        if (!running && (hedged || !hedge_after))
+            return NULL;
+        if (hedge_after && !hedged && (elapsed >= hedge_after || !running)) {
+            start_transfer(hedge_handle, hedge, url, headers, timeout - elapsed);
+            hedged = 1;
+            continue;
+        }
+
+        wait_ms = timeout - elapsed;
+        if (hedge_after && !hedged && hedge_after - elapsed < (unsigned int)wait_ms)
+            wait_ms = hedge_after - elapsed;
+        curl_multi_wait(curl_multi, NULL, 0, wait_ms, NULL);
+    }
+}
+
+/* Returns 0 with the payload in chunk, FETCH_NOT_MODIFIED if what we had is still current, or -1 */
+int _fetch_url(struct backend *b, const char *url, struct MemoryStruct *chunk)
+{
+    CURLcode res;
+    CURL *winner;
+    char *content_type;
+    struct curl_slist *headers;
+    struct MemoryStruct hedge = { 0 };
+    unsigned int hedge_after;
+    uint64_t start;
+    long response_code = 0;
+    int ret = -1;
+
+    chunk->memory = NULL;
+    chunk->size = 0;
+
+    /* While the service keeps failing we don't even try; the caller has something else to give the guest */
+    if (setup_handles() == -1 || backend_begin(b) == -1)
+        return -1;
+
+    headers = add_conditions(curl_slist_append(NULL, ACCEPT_HEADER), url);
+    hedge_after = backend_hedge_after(b);
+    start = backend_now_ms();
 
     /* get it! */
-    res = curl_easy_perform(curl_handle);
+    start_transfer(curl_handle, chunk, url, headers, backend_timeout(b));
+    winner = run_transfers(b, url, headers, &hedge, hedge_after, &res);
+
+    if (trace_on) {
+        trace_transfer(b, chunk);
+        if (hedge.curl)
+            trace_transfer(b, &hedge);
+    }
+    finish_transfer(curl_handle);
+    if (hedge.curl) {
+        finish_transfer(hedge_handle);
+        backend_hedged(b, winner == hedge_handle);
+    }
+    curl_slist_free_all(headers);
+
+    /* Keep whichever of the two answers we're going with in chunk */
+    if (winner == hedge_handle) {
+        _fetch_cleanup(chunk);
+        *chunk = hedge;
+    } else {
+        _fetch_cleanup(&hedge);
+    }
 
     /* check for errors */
-    if(res != CURLE_OK) {
-        fprintf(stderr, "curl_easy_perform() failed: %s\n",
-                curl_easy_strerror(res));
-        return -1;
+    if (!winner) {
+        if (!quiet)
+            fprintf(stderr, "fetching from the %s service failed: %s\n", b->name, curl_easy_strerror(res));
+        goto out;
     }
-    else {
-        /*
-         * Now, our chunk.memory points to a memory block that is chunk.size
-         * bytes big and contains the remote file.
-         *
-         * Do something nice with it!
-         */
 
-        printf("%lu bytes retrieved\n", (unsigned long)chunk.size);
+    curl_easy_getinfo(winner, CURLINFO_RESPONSE_CODE, &response_code);
+    if (response_code >= 500) {
+        if (!quiet)
+            fprintf(stderr, "the %s service answered %ld\n", b->name, response_code);
+        goto out;
     }
-    return 0;
+    if (response_code == 304) {
+        if (!quiet)
+            printf("not modified since the last fetch\n");
+        ret = FETCH_NOT_MODIFIED;
+        goto out;
+    }
+
+    /*
+     * Now, our chunk.memory points to a memory block that is chunk.size
+     * bytes big and contains the remote file.
+     *
+     * Do something nice with it!
+     */
+    if (!quiet)
+        printf("%lu bytes retrieved\n", (unsigned long)chunk->size);
+
+    /* Anything but the binary encoding we asked for is treated as JSON, as it always was */
+    chunk->binary = curl_easy_getinfo(winner, CURLINFO_CONTENT_TYPE, &content_type) == CURLE_OK
+                    && content_type
+                    && strncmp(content_type, WIRE_CONTENT_TYPE, strlen(WIRE_CONTENT_TYPE)) == 0;
+    ret = 0;
+
+out:
+    backend_end(b, ret != -1, backend_now_ms() - start);
+    if (ret != 0)
+        _fetch_cleanup(chunk);
+    return ret;
 }
 
-void _fetch_cleanup() {
-    curl_easy_cleanup(curl_handle);
-    free(chunk.memory);
-    curl_global_cleanup();
+/* Tapes are built out of the same pool as everything else */
+static void *json_pool_alloc(size_t size, int zero, void *user_data)
+{
+    return zero ? pool_zalloc(size) : pool_alloc(size);
 }
 
-json_value *get_value_for_key(json_value *v, char *key) {
-    for (unsigned int i = 0; i < v->u.object.length; i++) {
-        if (strcmp(key, v->u.object.values[i].name) == 0)
-            return v->u.object.values[i].value;
-    }
+static void json_pool_free(void *ptr, void *user_data)
+{
+    pool_free(ptr);
+}
 
-    return NULL;
+/*
+ * Responses are read off a tape rather than a tree, going straight to the
+ * few values we use. Parsing is in situ: the response buffer is ours to
+ * scribble on, strings are unescaped where they are and the tape points
+ * into it, so the tape has to go before the buffer does.
+ *
+ * Every response from a service has the same keys as the last one, so each
+ * thread keeps its keys interned from one parse to the next. Should the
+ * table not get made, the tape just interns them for itself.
+ * */
+static json_settings json_pool_settings = {
+        .mem_alloc = json_pool_alloc,
+        .mem_free = json_pool_free,
+};
+
+static json_tape *parse_chunk(struct MemoryStruct *chunk)
+{
+    uint64_t start = trace_now();
+    json_tape *tape;
+
+    if (!response_keys)
+        response_keys = json_keys_new(&json_pool_settings);
+    tape = json_tape_parse_keys(&json_pool_settings, response_keys, chunk->memory, chunk->size, NULL);
+    trace_span("parse", "json", start, "bytes", chunk->size);
+    return tape;
+}
+
+static void free_parse(json_tape *tape)
+{
+    json_tape_free(tape);
+}
+
+/* Whether a response is an object whose "status" is "success" */
+static int succeeded(json_tape *tape)
+{
+    const char *status = json_cursor_string(json_cursor_get(json_tape_root(tape), "status"), NULL);
+
+    return status && strcmp(status, "success") == 0;
+}
+
+/* Appends to a report blob, truncating once it fills up */
+static void report_append(struct blob *report, const char *fmt, ...)
+{
+    va_list ap;
+    int n;
+
+    va_start(ap, fmt);
+    n = vsnprintf(report->data + report->len, REPORT_CAPACITY + 1 - report->len, fmt, ap);
+    va_end(ap);
+    if (n < 0)
+        return;
+    if (report->len + n > REPORT_CAPACITY)
+        report->len = REPORT_CAPACITY;
+    else
+        report->len += n;
 }
 
-char *fetch_latest_tweet() {
-    if (_fetch_url(TWEET_URL) != 0)
+/*
+ * A freshly rendered payload becomes the version every read is served
+ * from. It also goes on disk so the next run has it without going out,
+ * and its validators are kept so that this run can later find out it
+ * hasn't changed without downloading it.
+ * */
+static struct blob *remember(const char *url, struct MemoryStruct *chunk, struct blob *result)
+{
+    diskcache_put(url, result->data, result->len);
+    publish_report(url, result, time(NULL), chunk->etag, chunk->last_modified);
+    return result;
+}
+
+/*
+ * The binary counterparts of the JSON handling below. Records are read in
+ * place in the response buffer, and the text they render to is the same.
+ * */
+static struct blob *tweet_from_wire(struct MemoryStruct *chunk)
+{
+    struct wire_reader r;
+    const struct wire_tweet *t;
+
+    if (wire_open(&r, chunk->memory, chunk->size, WIRE_KIND_TWEET) == -1 || !(t = wire_next_tweet(&r)))
         return NULL;
+    return blob_from(wire_tweet_text(t), t->text_len);
+}
 
-    json_value *v = json_parse(chunk.memory, chunk.size);
+static struct blob *air_quality_from_wire(struct MemoryStruct *chunk)
+{
+    struct wire_reader r;
+    const struct wire_air_quality *aq;
+    struct blob *aq_report;
 
-    /* Make sure we got a JSON object back */
-    if (v->type == json_object) {
-        /* Make sure that "status" is "success" */
-        json_value *v_status = get_value_for_key(v, "status");
-        if (v_status == NULL)
-            goto error_exit;
-        if (strcmp(v_status->u.string.ptr, "success") != 0)
-            goto error_exit;
+    if (wire_open(&r, chunk->memory, chunk->size, WIRE_KIND_AIR_QUALITY) == -1)
+        return NULL;
+    aq_report = blob_alloc(REPORT_CAPACITY);
+    if (!aq_report)
+        return NULL;
 
+    while ((aq = wire_next_air_quality(&r)))
+        report_append(aq_report, AIR_QUALITY_FORMAT,
+                            aq->location_len, wire_air_quality_location(aq),
+                            aq->reading_len, wire_air_quality_reading(aq));
+    if (r.left) {
+        blob_put(aq_report);
+        return NULL;
+    }
+    return aq_report;
+}
+
+static struct blob *weather_from_wire(struct MemoryStruct *chunk)
+{
+    struct wire_reader r;
+    const struct wire_weather *w;
+    struct blob *weather_forecast;
+
+    if (wire_open(&r, chunk->memory, chunk->size, WIRE_KIND_WEATHER) == -1)
+        return NULL;
+    weather_forecast = blob_alloc(REPORT_CAPACITY);
+    if (!weather_forecast)
+        return NULL;
+
+    while ((w = wire_next_weather(&r)))
+        report_append(weather_forecast, WEATHER_DAY_FORMAT,
+                            w->date_len, wire_weather_date(w),
+                            w->state_len, wire_weather_state(w),
+                            w->min_temp, w->max_temp, (long)w->humidity);
+    if (r.left) {
+        blob_put(weather_forecast);
+        return NULL;
+    }
+    return weather_forecast;
+}
+
+/* Render a binary response with from_wire, then remember the result like the JSON paths do */
+static struct blob *render_wire(const char *url, struct MemoryStruct *chunk,
+                                struct blob *(*from_wire)(struct MemoryStruct *))
+{
+    uint64_t start = trace_now();
+    struct blob *result = from_wire(chunk);
+
+    trace_span("parse", "wire", start, "bytes", chunk->size);
+    _fetch_cleanup(chunk);
+    return result ? remember(url, chunk, result) : NULL;
+}
+
+static struct blob *_fetch_latest_tweet(const char *url) {
+    struct MemoryStruct chunk;
+    int ret;
+
+    ret = _fetch_url(backend_get(BACKEND_TWEET), url, &chunk);
+    if (ret == FETCH_NOT_MODIFIED)
+        return not_modified(url);
+    if (ret != 0)
+        return NULL;
+    if (chunk.binary)
+        return render_wire(url, &chunk, tweet_from_wire);
+
+    json_tape *tape = parse_chunk(&chunk);
+    const char *text;
+    unsigned int text_len;
+
+    /* Make sure we got a JSON object back, and that "status" is "success" */
+    if (tape && succeeded(tape)) {
         /* Get value of the "text" key inside object pointed to by "tweet" */
-        json_value *v_tweet = get_value_for_key(v, "tweet");
-        if (v_tweet == NULL)
+        text = json_cursor_string(json_cursor_get(json_cursor_get(json_tape_root(tape), "tweet"), "text"), &text_len);
+        if (text == NULL)
             goto error_exit;
-        json_value *v_tweet_text = get_value_for_key(v_tweet, "text");
-        if (v_tweet_text == NULL)
-            goto error_exit;
-        char *tweet_text = malloc(v_tweet_text->u.string.length + 1);
+        struct blob *tweet_text = blob_from(text, text_len);
         if (!tweet_text)
             goto error_exit;
-        bzero(tweet_text, v_tweet_text->u.string.length + 1);
-        strcpy(tweet_text, v_tweet_text->u.string.ptr);
-        json_value_free(v);
-        _fetch_cleanup();
-        return tweet_text;
+        free_parse(tape);
+        _fetch_cleanup(&chunk);
+        return remember(url, &chunk, tweet_text);
     }
     /* Gotos are bad, but they're perfect for error handling scenarios */
 error_exit:
-    _fetch_cleanup();
+    free_parse(tape);
+    _fetch_cleanup(&chunk);
     return NULL;
 }
 
-char *fetch_air_quality(char *country, char *city) {
-    char request_url[2048];
+static struct blob *_fetch_air_quality(const char *url) {
+    struct MemoryStruct chunk;
+    int ret;
 
-    snprintf(request_url, sizeof(request_url), "%s?country=%s&city=%s", AIR_QUALITY_URL, country, city);
-    if (_fetch_url(request_url) != 0)
+    ret = _fetch_url(backend_get(BACKEND_AIR_QUALITY), url, &chunk);
+    if (ret == FETCH_NOT_MODIFIED)
+        return not_modified(url);
+    if (ret != 0)
         return NULL;
+    if (chunk.binary)
+        return render_wire(url, &chunk, air_quality_from_wire);
 
-    char *aq_report = malloc(8192);
-    if (!aq_report)
+    struct blob *aq_report = blob_alloc(REPORT_CAPACITY);
+    if (!aq_report) {
+        _fetch_cleanup(&chunk);
         return NULL;
-    bzero(aq_report, 8192);
-
-    json_value *v = json_parse(chunk.memory, chunk.size);
-    /* Make sure we got a JSON object back */
-    if (v->type == json_object) {
-        /* Make sure that "status" is "success" */
-        json_value *v_status = get_value_for_key(v, "status");
-        if (v_status == NULL)
-            goto error_exit;
-        if (strcmp(v_status->u.string.ptr, "success") != 0)
-            goto error_exit;
+    }
 
-        json_value *v_data = get_value_for_key(v, "data");
-        if (v_data == NULL)
+    json_tape *tape = parse_chunk(&chunk);
+    /* Make sure we got a JSON object back, and that "status" is "success" */
+    if (tape && succeeded(tape)) {
+        json_cursor data = json_cursor_get(json_tape_root(tape), "data");
+        if (json_cursor_type(data) != json_array)
             goto error_exit;
-        for (unsigned int i = 0; i < v_data->u.array.length; i++) {
-            char record[1024];
-            json_value *v_record = v_data->u.array.values[i];
-            char *v_location = v_record->u.object.values[0].name;
-            json_value *v_reading = v_record->u.object.values[0].value;
-            snprintf(record, sizeof(record), "%s: %s\n", v_location, v_reading->u.string.ptr);
-            strncat(aq_report, record, 8192);
+
+        /* Each record is an object with a single member, the station's reading */
+        for (json_cursor record = json_cursor_first(data); json_cursor_valid(record);
+             record = json_cursor_next(record)) {
+            json_cursor reading = json_cursor_first(record);
+            unsigned int location_len, reading_len;
+            const char *location = json_cursor_key(reading, &location_len);
+            const char *text = json_cursor_string(reading, &reading_len);
+
+            if (!location || !text)
+                continue;
+            report_append(aq_report, AIR_QUALITY_FORMAT,
+                          (int)location_len, location, (int)reading_len, text);
         }
-        _fetch_cleanup();
-        return aq_report;
+        free_parse(tape);
+        _fetch_cleanup(&chunk);
+        return remember(url, &chunk, aq_report);
     }
 
     /* Gotos are bad, but they're perfect for error handling scenarios */
     error_exit:
-    _fetch_cleanup();
-    free(aq_report);
+    free_parse(tape);
+    _fetch_cleanup(&chunk);
+    blob_put(aq_report);
     return NULL;
 }
 
-char *fetch_weather(char *city) {
-    char request_url[2048];
+static struct blob *_fetch_weather(const char *url) {
+    struct MemoryStruct chunk;
+    int ret;
 
-    snprintf(request_url, sizeof(request_url), "%s?city=%s", WEATHER_URL, city);
-    if (_fetch_url(request_url) != 0)
+    ret = _fetch_url(backend_get(BACKEND_WEATHER), url, &chunk);
+    if (ret == FETCH_NOT_MODIFIED)
+        return not_modified(url);
+    if (ret != 0)
         return NULL;
+    if (chunk.binary)
+        return render_wire(url, &chunk, weather_from_wire);
 
-    char *weather_forecast = malloc(8192);
-    if (!weather_forecast)
+    struct blob *weather_forecast = blob_alloc(REPORT_CAPACITY);
+    if (!weather_forecast) {
+        _fetch_cleanup(&chunk);
         return NULL;
-    bzero(weather_forecast, 8192);
-
-    json_value *v = json_parse(chunk.memory, chunk.size);
-    /* Make sure we got a JSON object back */
-    if (v->type == json_object) {
-        /* Make sure that "status" is "success" */
-        json_value *v_status = get_value_for_key(v, "status");
-        if (v_status == NULL)
-            goto error_exit;
-        if (strcmp(v_status->u.string.ptr, "success") != 0)
-            goto error_exit;
+    }
 
-        json_value *v_data = get_value_for_key(v, "data");
-        if (v_data == NULL)
-            goto error_exit;
-        json_value *v_weather = get_value_for_key(v_data, "consolidated_weather");
-        if (v_weather == NULL)
+    json_tape *tape = parse_chunk(&chunk);
+    /* Make sure we got a JSON object back, and that "status" is "success" */
+    if (tape && succeeded(tape)) {
+        json_cursor days = json_cursor_get(json_cursor_get(json_tape_root(tape), "data"), "consolidated_weather");
+        if (json_cursor_type(days) != json_array)
             goto error_exit;
 
-        for (unsigned int i = 0; i < v_weather->u.array.length; i++) {
-            char record[1024];
-            json_value *v_record = v_weather->u.array.values[i];
-            json_value *v_date = get_value_for_key(v_record, "applicable_date");
-            json_value *v_weather_state_name = get_value_for_key(v_record, "weather_state_name");
-            json_value *v_min_temp = get_value_for_key(v_record, "min_temp");
-            json_value *v_max_temp = get_value_for_key(v_record, "max_temp");
-            json_value *v_humidity = get_value_for_key(v_record, "humidity");
-            snprintf(record, sizeof(record), "Date: %s\n\tWeather: %s\n\tMin. temp: %.02f\n\tMax. temp: %.02f\n\tHumidity: %ld\n",
-                    v_date->u.string.ptr,
-                    v_weather_state_name->u.string.ptr,
-                    v_min_temp->u.dbl,
-                    v_max_temp->u.dbl,
-                    v_humidity->u.integer
+        /* Every day has the same keys, so they're only looked up the once */
+        const char *date_key = json_tape_key(tape, "applicable_date");
+        const char *state_key = json_tape_key(tape, "weather_state_name");
+        const char *min_key = json_tape_key(tape, "min_temp");
+        const char *max_key = json_tape_key(tape, "max_temp");
+        const char *humidity_key = json_tape_key(tape, "humidity");
+
+        for (json_cursor day = json_cursor_first(days); json_cursor_valid(day); day = json_cursor_next(day)) {
+            unsigned int date_len, state_len;
+            const char *date = json_cursor_string(json_cursor_get_key(day, date_key), &date_len);
+            const char *state = json_cursor_string(json_cursor_get_key(day, state_key), &state_len);
+
+            if (!date || !state)
+                continue;
+            report_append(weather_forecast, WEATHER_DAY_FORMAT,
+                    (int)date_len, date,
+                    (int)state_len, state,
+                    json_cursor_double(json_cursor_get_key(day, min_key)),
+                    json_cursor_double(json_cursor_get_key(day, max_key)),
+                    (long)json_cursor_integer(json_cursor_get_key(day, humidity_key))
                     );
-            strncat(weather_forecast, record, 8192);
         }
-        _fetch_cleanup();
-        return weather_forecast;
+        free_parse(tape);
+        _fetch_cleanup(&chunk);
+        return remember(url, &chunk, weather_forecast);
     }
 
     /* Gotos are bad, but they're perfect for error handling scenarios */
     error_exit:
-    _fetch_cleanup();
-    free(weather_forecast);
+    free_parse(tape);
+    _fetch_cleanup(&chunk);
+    blob_put(weather_forecast);
     return NULL;
 }
+
+struct refresh {
+    singleflight_fn fetch;
+    char url[];
+};
+
+/*
+ * Whether to set off a background refresh of url: not if one is still
+ * going, nor if the last one set off less than CACHE_REFRESH_AFTER ago.
+ * A refresh that gets an answer but no report, say a 404 or a response
+ * we can't parse, leaves the version we have as old as it was, so without
+ * this every read of it would set off another one.
+ * */
+static int begin_refresh(const char *url)
+{
+    struct report *r;
+    time_t now = time(NULL);
+    int ret = 0;
+
+    pthread_mutex_lock(&reports_lock);
+    r = find_report(url);
+    if (r && !r->refreshing && now - r->refresh_tried >= CACHE_REFRESH_AFTER) {
+        r->refreshing = 1;
+        r->refresh_tried = now;
+        ret = 1;
+    }
+    pthread_mutex_unlock(&reports_lock);
+    return ret;
+}
+
+static void end_refresh(const char *url)
+{
+    struct report *r;
+
+    pthread_mutex_lock(&reports_lock);
+    r = find_report(url);
+    if (r)
+        r->refreshing = 0;
+    pthread_mutex_unlock(&reports_lock);
+}
+
+static void *refresh_thread(void *arg)
+{
+    struct refresh *r = arg;
+
+    placement_io_thread();
+    trace_thread_name("refresh");
+    fetch_quietly();
+    blob_put(singleflight_do(r->url, r->fetch));
+    end_refresh(r->url);
+    pool_free(r);
+
+    /* This thread is done for good, so its curl sessions and keys are too */
+    cleanup_handles();
+    json_keys_free(response_keys);
+    response_keys = NULL;
+    return NULL;
+}
+
+static void refresh_in_background(const char *url, singleflight_fn fetch)
+{
+    struct refresh *r;
+    pthread_attr_t attr;
+    pthread_t thread;
+
+    if (!begin_refresh(url))
+        return;
+    r = pool_alloc(sizeof(*r) + strlen(url) + 1);
+    if (!r) {
+        end_refresh(url);
+        return;
+    }
+    r->fetch = fetch;
+    strcpy(r->url, url);
+
+    pthread_attr_init(&attr);
+    pthread_attr_setdetachstate(&attr, PTHREAD_CREATE_DETACHED);
+    if (pthread_create(&thread, &attr, refresh_thread, r) != 0) {
+        end_refresh(url);
+        pool_free(r);
+    }
+    pthread_attr_destroy(&attr);
+}
+
+/*
+ * The request URL names everything a fetch depends on, so it doubles as
+ * the single-flight and cache key: guests asking for the same thing at the
+ * same time share one trip to the service. Whatever version we have, in
+ * memory or else on disk, is served straight away; if it's getting on,
+ * we fetch a new one behind the guest's back for next time. With nothing
+ * at all and the service failing, the guest gets its backend's placeholder.
+ * */
+static struct blob *fetch_cached(const char *url, singleflight_fn fetch, struct backend *b)
+{
+    time_t fetched;
+    struct blob *cached = current_report(url, &fetched);
+
+    last_source = FETCH_FROM_MEMORY;
+    if (!cached) {
+        cached = diskcache_get(url, &fetched);
+        if (!cached) {
+            last_source = FETCH_FROM_SERVICE;
+            cached = singleflight_do(url, fetch);
+            if (!cached) {
+                last_source = FETCH_PLACEHOLDER;
+                backend_placeholder_served(b);
+                cached = blob_from(b->placeholder, strlen(b->placeholder));
+            }
+            return cached;
+        }
+        last_source = FETCH_FROM_DISK;
+        publish_report(url, cached, fetched, "", "");
+    }
+    if (time(NULL) - fetched >= CACHE_REFRESH_AFTER && backend_available(b))
+        refresh_in_background(url, fetch);
+    return cached;
+}
+
+struct blob *fetch_latest_tweet() {
+    char request_url[2048];
+
+    snprintf(request_url, sizeof(request_url), "%s" TWEET_PATH, service_url());
+    return fetch_cached(request_url, _fetch_latest_tweet, backend_get(BACKEND_TWEET));
+}
+
+struct blob *fetch_air_quality(const char *country, const char *city) {
+    char request_url[2048];
+
+    snprintf(request_url, sizeof(request_url), "%s" AIR_QUALITY_PATH "?country=%s&city=%s", service_url(), country, city);
+    return fetch_cached(request_url, _fetch_air_quality, backend_get(BACKEND_AIR_QUALITY));
+}
+
+struct blob *fetch_weather(const char *city) {
+    char request_url[2048];
+
+    snprintf(request_url, sizeof(request_url), "%s" WEATHER_PATH "?city=%s", service_url(), city);
+    return fetch_cached(request_url, _fetch_weather, backend_get(BACKEND_WEATHER));
+}
+
+/*
+ * Fetches the guest didn't ask for, made on the calling thread from now
+ * on, don't say how they went: stdout is the guest's console, and they'd
+ * print all over whatever it has on it.
+ * */
+void fetch_quietly(void)
+{
+    quiet = 1;
+}
+
+int fetch_last_source(void)
+{
+    return last_source;
+}
@@ -1,17 +1,46 @@
 #include <stdlib.h>
 #include <string.h>
 #include <curl/curl.h>
+#include "blob.h"
 #include "json.h"
 
-#define TWEET_URL       "https://sparkler-service.herokuapp.com/tweet"
-#define WEATHER_URL     "https://sparkler-service.herokuapp.com/weather"
-#define AIR_QUALITY_URL "https://sparkler-service.herokuapp.com/air_quality"
+#define SERVICE_URL         "https://sparkler-service.herokuapp.com"
+#define TWEET_PATH          "/tweet"
+#define WEATHER_PATH        "/weather"
+#define AIR_QUALITY_PATH    "/air_quality"
+
+/* Rendered weather and air quality reports are at most this big */
+#define REPORT_SIZE     8192
+
+/* Payloads served from the disk cache are refreshed in the background once they're this many seconds old */
+#define CACHE_REFRESH_AFTER     60
+
+/* Longest ETag or Last-Modified value we keep around to revalidate with */
+#define VALIDATOR_SIZE          128
+
+/* What _fetch_url() returns when the service says our last copy is still good */
+#define FETCH_NOT_MODIFIED      1
+
+/* Where the payload from the last fetch_*() call on a thread came from, as fetch_last_source() has it */
+#define FETCH_FROM_MEMORY       0
+#define FETCH_FROM_DISK         1
+#define FETCH_FROM_SERVICE      2
+#define FETCH_PLACEHOLDER       3   /* the service failed and we had nothing better */
 
 struct MemoryStruct {
     char *memory;
     size_t size;
+    CURL *curl;     /* the session it's being fetched on */
+    uint64_t sent;  /* when it went out, if we're tracing */
+    int binary;     /* the service answered in the wire format rather than JSON */
+    char etag[VALIDATOR_SIZE];
+    char last_modified[VALIDATOR_SIZE];
 };
 
-char *fetch_latest_tweet();
-char *fetch_weather(char *city);
-char *fetch_air_quality(char *country, char *city);
+struct blob *fetch_latest_tweet();
+struct blob *fetch_weather(const char *city);
+struct blob *fetch_air_quality(const char *country, const char *city);
+int fetch_last_source(void);
+void fetch_quietly(void);
+
+/* Reports and tweets returned above are shared and read-only; drop them with blob_put() */
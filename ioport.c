@@ -0,0 +1,39 @@
+#include <err.h>
+#include <stdio.h>
+#include "ioport.h"
+
+/* Slot 0 means nobody's there, so handlers start at 1 */
+uint8_t ioport_map[0x10000];
+struct ioport ioport_handlers[IOPORT_MAX_HANDLERS];
+static unsigned int nr_handlers = 1;
+
+void ioport_register(const char *name, uint16_t base, uint16_t nr_ports, ioport_in_fn in, ioport_out_fn out, void *opaque)
+{
+    struct ioport *io;
+
+    if (nr_handlers == IOPORT_MAX_HANDLERS)
+        errx(1, "too many I/O port handlers");
+    if (base + nr_ports > 0x10000)
+        errx(1, "I/O ports 0x%x-0x%x out of range", base, base + nr_ports - 1);
+    for (unsigned int port = base; port < base + nr_ports; port++) {
+        if (ioport_map[port])
+            errx(1, "I/O port 0x%x registered twice", port);
+    }
+
+    io = &ioport_handlers[nr_handlers];
+    io->base = base;
+    io->nr_ports = nr_ports;
+    io->in = in;
+    io->out = out;
+    io->opaque = opaque;
+    io->name = name;
+    for (unsigned int port = base; port < base + nr_ports; port++)
+        ioport_map[port] = nr_handlers;
+    nr_handlers++;
+}
+
+int ioport_unhandled(struct kvm_run *run)
+{
+    printf("Port: 0x%x\n", run->io.port);
+    errx(1, "unhandled KVM_EXIT_IO");
+}
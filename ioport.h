@@ -0,0 +1,60 @@
+#ifndef SPARKLER_IOPORT_H
+#define SPARKLER_IOPORT_H
+
+#include <linux/kvm.h>
+#include <stdint.h>
+
+/*
+ * Port I/O dispatch. Every device registers the range of ports it answers
+ * on along with its own state, and a port's handler is then one table
+ * lookup away: the 64K port space maps straight to a handler slot. The
+ * handlers see a whole exit at once, so a rep ins or outs that KVM hands
+ * us as count accesses of size bytes each is dealt with in one call.
+ * */
+
+#define IOPORT_MAX_HANDLERS     32
+
+/* Both return 0, or -1 if the guest can't carry on */
+typedef int (*ioport_in_fn)(void *opaque, uint16_t offset, void *data, unsigned int size, unsigned int count);
+typedef int (*ioport_out_fn)(void *opaque, uint16_t offset, const void *data, unsigned int size, unsigned int count);
+
+struct ioport {
+    uint16_t base;
+    uint16_t nr_ports;
+    ioport_in_fn in;            /* NULL if the ports are write-only, which reads then see as all ones */
+    ioport_out_fn out;          /* NULL if they're read-only, which drops writes */
+    void *opaque;               /* handed back to in and out */
+    const char *name;           /* of the device, for tracing */
+};
+
+extern uint8_t ioport_map[0x10000];
+extern struct ioport ioport_handlers[IOPORT_MAX_HANDLERS];
+
+void ioport_register(const char *name, uint16_t base, uint16_t nr_ports, ioport_in_fn in, ioport_out_fn out, void *opaque);
+int ioport_unhandled(struct kvm_run *run);
+
+/* Who answers on port, or NULL if nobody does */
+static inline const char *ioport_name(uint16_t port)
+{
+    return ioport_map[port] ? ioport_handlers[ioport_map[port]].name : NULL;
+}
+
+static inline int ioport_dispatch(struct kvm_run *run)
+{
+    struct ioport *io;
+    uint8_t *data = (uint8_t *)run + run->io.data_offset;
+    uint8_t slot = ioport_map[run->io.port];
+
+    if (!slot)
+        return ioport_unhandled(run);
+    io = &ioport_handlers[slot];
+    if (run->io.direction == KVM_EXIT_IO_OUT)
+        return io->out ? io->out(io->opaque, run->io.port - io->base, data, run->io.size, run->io.count) : 0;
+    if (io->in)
+        return io->in(io->opaque, run->io.port - io->base, data, run->io.size, run->io.count);
+    for (unsigned int i = 0; i < run->io.size * run->io.count; i++)
+        data[i] = 0xff;
+    return 0;
+}
+
+#endif
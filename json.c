@@ -41,7 +41,6 @@ const struct _json_value json_value_none;
 #include <stdio.h>
 #include <string.h>
 #include <ctype.h>
-#include <math.h>
 
 typedef unsigned int json_uchar;
 
@@ -70,9 +69,205 @@ static unsigned char hex_value (json_char c)
     }
 }
 
-static int would_overflow (json_int_t value, json_char b)
+/* Numbers are scanned in one go rather than a character at a time through
+ * the main loop. Digits are gathered into a 64-bit mantissa, eight at a
+ * time where there's a run of them, and the double is made from that with
+ * a single correctly rounded multiply or divide whenever both the mantissa
+ * and the power of ten are exactly representable (Clinger's fast path).
+ * Anything else goes to strtod, which rounds correctly too.
+ */
+
+#define JSON_MANTISSA_DIGITS  19        /* a uint64_t holds any 19 digit number */
+#define JSON_FAST_MANTISSA    (1ULL << 53)
+#define JSON_FAST_EXPONENT    22
+
+static const double exact_powers_of_ten [] =
+{
+    1e0, 1e1, 1e2, 1e3, 1e4, 1e5, 1e6, 1e7, 1e8, 1e9, 1e10, 1e11,
+    1e12, 1e13, 1e14, 1e15, 1e16, 1e17, 1e18, 1e19, 1e20, 1e21, 1e22
+};
+
+/* Whether the 8 bytes at p are all ASCII digits */
+static int is_eight_digits (const json_char * p)
+{
+    uint64_t v;
+
+    memcpy (&v, p, sizeof (v));
+    return (((v & 0xF0F0F0F0F0F0F0F0ULL) | (((v + 0x0606060606060606ULL) & 0xF0F0F0F0F0F0F0F0ULL) >> 4))
+            == 0x3333333333333333ULL);
+}
+
+/* The value of the 8 digits at p, combining them pairwise with three multiplies */
+static uint32_t parse_eight_digits (const json_char * p)
+{
+    uint64_t v;
+
+    memcpy (&v, p, sizeof (v));
+    v -= 0x3030303030303030ULL;
+    v = (v * 10) + (v >> 8);
+    v = (((v & 0x000000FF000000FFULL) * (100 + (1000000ULL << 32)))
+         + (((v >> 16) & 0x000000FF000000FFULL) * (1 + (10000ULL << 32)))) >> 32;
+    return (uint32_t) v;
+}
+
+/* Consume a run of digits at p, adding them to the mantissa for as long as it
+ * has room. Leading zeros count against that room, which only ever sends a
+ * number to the slow path.
+ */
+static const json_char * scan_digits (const json_char * p, const json_char * end,
+                                      uint64_t * mantissa, int * digits, int * dropped)
+{
+    while (end - p >= 8 && is_eight_digits (p))
+    {
+        if (*digits + 8 <= JSON_MANTISSA_DIGITS)
+        {
+            *mantissa = (*mantissa * 100000000) + parse_eight_digits (p);
+            *digits += 8;
+        }
+        else
+            *dropped += 8;
+
+        p += 8;
+    }
+
+    for (; p < end && isdigit (*p); ++ p)
+    {
+        if (*digits < JSON_MANTISSA_DIGITS)
+        {
+            *mantissa = (*mantissa * 10) + (*p - '0');
+            ++ *digits;
+        }
+        else
+            ++ *dropped;
+    }
+
+    return p;
+}
+
+/* strtod wants the number on its own, which the input isn't */
+static int slow_double (const json_char * start, const json_char * end, double * d)
+{
+    char buf [64];
+    char * copy = buf;
+    size_t len = end - start;
+
+    if (len >= sizeof (buf) && ! (copy = (char *) malloc (len + 1)))
+        return 0;
+
+    memcpy (copy, start, len);
+    copy [len] = 0;
+    *d = strtod (copy, 0);
+
+    if (copy != buf)
+        free (copy);
+
+    return 1;
+}
+
+/* Scan the number starting at ptr, storing it in value unless this is just the
+ * first pass. Returns where the number ends, or 0 with *problem saying why it
+ * isn't a valid one.
+ */
+static const json_char * scan_number (const json_char * ptr, const json_char * end,
+                                      json_value * value, int convert, const char ** problem)
 {
-    return ((JSON_INT_MAX - (b - '0')) / 10 ) < value;
+    const json_char * start = ptr, * p;
+    uint64_t mantissa = 0;
+    int digits = 0, dropped = 0, fraction = 0, negative = 0, is_double = 0;
+    long exponent = 0;
+
+    if (*ptr == '-')
+    {
+        negative = 1;
+        ++ ptr;
+    }
+
+    if (ptr == end || !isdigit (*ptr))
+    {
+        *problem = "Expected digit after `-`";
+        return 0;
+    }
+
+    if (*ptr == '0' && ptr + 1 < end && isdigit (ptr [1]))
+    {
+        *problem = "Unexpected `0` before digit";
+        return 0;
+    }
+
+    p = scan_digits (ptr, end, &mantissa, &digits, &dropped);
+
+    if (p < end && *p == '.')
+    {
+        const json_char * fraction_start = ++ p;
+
+        p = scan_digits (p, end, &mantissa, &digits, &dropped);
+        if (p == fraction_start)
+        {
+            *problem = "Expected digit after `.`";
+            return 0;
+        }
+
+        fraction = (int) (p - fraction_start);
+        is_double = 1;
+    }
+
+    if (p < end && (*p == 'e' || *p == 'E'))
+    {
+        int exponent_negative = 0;
+        const json_char * exponent_start;
+
+        ++ p;
+        if (p < end && (*p == '+' || *p == '-'))
+            exponent_negative = (*p ++ == '-');
+
+        for (exponent_start = p; p < end && isdigit (*p); ++ p)
+        {
+            if (exponent < 100000)
+                exponent = (exponent * 10) + (*p - '0');
+        }
+
+        if (p == exponent_start)
+        {
+            *problem = "Expected digit after `e`";
+            return 0;
+        }
+
+        if (exponent_negative)
+            exponent = - exponent;
+
+        is_double = 1;
+    }
+
+    if (!convert)
+        return p;
+
+    if (!is_double && !dropped && (mantissa <= (uint64_t) JSON_INT_MAX || (negative && mantissa == (uint64_t) JSON_INT_MAX + 1)))
+    {
+        value->type = json_integer;
+        value->u.integer = negative ? (json_int_t) (0 - mantissa) : (json_int_t) mantissa;
+        return p;
+    }
+
+    value->type = json_double;
+    exponent -= fraction;
+
+    if (!dropped && mantissa <= JSON_FAST_MANTISSA
+        && exponent >= - JSON_FAST_EXPONENT && exponent <= JSON_FAST_EXPONENT)
+    {
+        double d = (double) mantissa;
+
+        d = exponent < 0 ? d / exact_powers_of_ten [- exponent] : d * exact_powers_of_ten [exponent];
+        value->u.dbl = negative ? - d : d;
+        return p;
+    }
+
+    if (!slow_double (start, p, &value->u.dbl))
+    {
+        *problem = "Memory allocation failure";
+        return 0;
+    }
+
+    return p;
 }
 
 typedef struct
@@ -165,7 +360,9 @@ static int new_value (json_state * state,
 
             case json_string:
 
-                if (! (value->u.string.ptr = (json_char *) json_alloc
+                /* In situ, the string stays where it is in the input */
+                if (! (state->settings.settings & json_in_situ)
+                    && ! (value->u.string.ptr = (json_char *) json_alloc
                         (state, (value->u.string.length + 1) * sizeof (json_char), 0)) )
                 {
                     return 0;
@@ -225,14 +422,8 @@ static const long
         flag_string           = 1 << 5,
         flag_need_colon       = 1 << 6,
         flag_done             = 1 << 7,
-        flag_num_negative     = 1 << 8,
-        flag_num_zero         = 1 << 9,
-        flag_num_e            = 1 << 10,
-        flag_num_e_got_sign   = 1 << 11,
-        flag_num_e_negative   = 1 << 12,
-        flag_line_comment     = 1 << 13,
-        flag_block_comment    = 1 << 14,
-        flag_num_got_decimal  = 1 << 15;
+        flag_line_comment     = 1 << 8,
+        flag_block_comment    = 1 << 9;
 
 json_value * json_parse_ex (json_settings * settings,
                             const json_char * json,
@@ -244,8 +435,8 @@ json_value * json_parse_ex (json_settings * settings,
     json_value * top, * root, * alloc = 0;
     json_state state = { 0 };
     long flags = 0;
-    double num_digits = 0, num_e = 0;
-    double num_fraction = 0;
+    const char * problem;
+    int in_situ = settings->settings & json_in_situ;
 
     /* Skip UTF-8 BOM
      */
@@ -403,6 +594,8 @@ json_value * json_parse_ex (json_settings * settings,
 
                 if (b == '"')
                 {
+                    json_char * name = string;
+
                     if (!state.first_pass)
                         string [string_length] = 0;
 
@@ -420,7 +613,15 @@ json_value * json_parse_ex (json_settings * settings,
 
                         case json_object:
 
-                            if (state.first_pass)
+                            if (in_situ)
+                            {
+                                if (!state.first_pass)
+                                {
+                                    top->u.object.values [top->u.object.length].name = name;
+                                    top->u.object.values [top->u.object.length].name_length = string_length;
+                                }
+                            }
+                            else if (state.first_pass)
                                 (*(json_char **) &top->u.object.values) += string_length + 1;
                             else
                             {
@@ -602,6 +803,9 @@ json_value * json_parse_ex (json_settings * settings,
 
                                 flags |= flag_string;
 
+                                if (in_situ && !state.first_pass)
+                                    top->u.string.ptr = (json_char *) state.ptr + 1;
+
                                 string = top->u.string.ptr;
                                 string_length = 0;
 
@@ -659,40 +863,13 @@ json_value * json_parse_ex (json_settings * settings,
                                     if (!new_value (&state, &top, &root, &alloc, json_integer))
                                         goto e_alloc_failure;
 
-                                    if (!state.first_pass)
-                                    {
-                                        while (isdigit (b) || b == '+' || b == '-'
-                                               || b == 'e' || b == 'E' || b == '.')
-                                        {
-                                            if ( (++ state.ptr) == end)
-                                            {
-                                                b = 0;
-                                                break;
-                                            }
-
-                                            b = *state.ptr;
-                                        }
-
-                                        flags |= flag_next | flag_reproc;
-                                        break;
-                                    }
-
-                                    flags &= ~ (flag_num_negative | flag_num_e |
-                                                flag_num_e_got_sign | flag_num_e_negative |
-                                                flag_num_zero);
-
-                                    num_digits = 0;
-                                    num_fraction = 0;
-                                    num_e = 0;
-
-                                    if (b != '-')
-                                    {
-                                        flags |= flag_reproc;
-                                        break;
+                                    if (! (state.ptr = scan_number (state.ptr, end, top, !state.first_pass, &problem)))
+                                    {  sprintf (error, "%d:%d: %s", line_and_col, problem);
+                                        goto e_failed;
                                     }
 
-                                    flags |= flag_num_negative;
-                                    continue;
+                                    flags |= flag_next | flag_reproc;
+                                    break;
                                 }
                                 else
                                 {  sprintf (error, "%d:%d: Unexpected %c when seeking value", line_and_col, b);
@@ -721,7 +898,10 @@ json_value * json_parse_ex (json_settings * settings,
 
                                 flags |= flag_string;
 
-                                string = (json_char *) top->_reserved.object_mem;
+                                if (in_situ)
+                                    string = (json_char *) state.ptr + 1;
+                                else
+                                    string = (json_char *) top->_reserved.object_mem;
                                 string_length = 0;
 
                                 break;
@@ -746,128 +926,6 @@ json_value * json_parse_ex (json_settings * settings,
 
                         break;
 
-                    case json_integer:
-                    case json_double:
-
-                        if (isdigit (b))
-                        {
-                            ++ num_digits;
-
-                            if (top->type == json_integer || flags & flag_num_e)
-                            {
-                                if (! (flags & flag_num_e))
-                                {
-                                    if (flags & flag_num_zero)
-                                    {  sprintf (error, "%d:%d: Unexpected `0` before `%c`", line_and_col, b);
-                                        goto e_failed;
-                                    }
-
-                                    if (num_digits == 1 && b == '0')
-                                        flags |= flag_num_zero;
-                                }
-                                else
-                                {
-                                    flags |= flag_num_e_got_sign;
-                                    num_e = (num_e * 10) + (b - '0');
-                                    continue;
-                                }
-
-                                if (would_overflow(top->u.integer, b))
-                                {  -- num_digits;
-                                    -- state.ptr;
-                                    top->type = json_double;
-                                    top->u.dbl = (double)top->u.integer;
-                                    continue;
-                                }
-
-                                top->u.integer = (top->u.integer * 10) + (b - '0');
-                                continue;
-                            }
-
-                            if (flags & flag_num_got_decimal)
-                                num_fraction = (num_fraction * 10) + (b - '0');
-                            else
-                                top->u.dbl = (top->u.dbl * 10) + (b - '0');
-
-                            continue;
-                        }
-
-                        if (b == '+' || b == '-')
-                        {
-                            if ( (flags & flag_num_e) && !(flags & flag_num_e_got_sign))
-                            {
-                                flags |= flag_num_e_got_sign;
-
-                                if (b == '-')
-                                    flags |= flag_num_e_negative;
-
-                                continue;
-                            }
-                        }
-                        else if (b == '.' && top->type == json_integer)
-                        {
-                            if (!num_digits)
-                            {  sprintf (error, "%d:%d: Expected digit before `.`", line_and_col);
-                                goto e_failed;
-                            }
-
-                            top->type = json_double;
-                            top->u.dbl = (double) top->u.integer;
-
-                            flags |= flag_num_got_decimal;
-                            num_digits = 0;
-                            continue;
-                        }
-
-                        if (! (flags & flag_num_e))
-                        {
-                            if (top->type == json_double)
-                            {
-                                if (!num_digits)
-                                {  sprintf (error, "%d:%d: Expected digit after `.`", line_and_col);
-                                    goto e_failed;
-                                }
-
-                                top->u.dbl += num_fraction / pow (10.0, num_digits);
-                            }
-
-                            if (b == 'e' || b == 'E')
-                            {
-                                flags |= flag_num_e;
-
-                                if (top->type == json_integer)
-                                {
-                                    top->type = json_double;
-                                    top->u.dbl = (double) top->u.integer;
-                                }
-
-                                num_digits = 0;
-                                flags &= ~ flag_num_zero;
-
-                                continue;
-                            }
-                        }
-                        else
-                        {
-                            if (!num_digits)
-                            {  sprintf (error, "%d:%d: Expected digit after `e`", line_and_col);
-                                goto e_failed;
-                            }
-
-                            top->u.dbl *= pow (10.0, (flags & flag_num_e_negative ? - num_e : num_e));
-                        }
-
-                        if (flags & flag_num_negative)
-                        {
-                            if (top->type == json_integer)
-                                top->u.integer = - top->u.integer;
-                            else
-                                top->u.dbl = - top->u.dbl;
-                        }
-
-                        flags |= flag_next | flag_reproc;
-                        break;
-
                     default:
                         break;
                 };
@@ -1017,7 +1075,8 @@ void json_value_free_ex (json_settings * settings, json_value * value)
 
             case json_string:
 
-                settings->mem_free (value->u.string.ptr, settings->user_data);
+                if (! (settings->settings & json_in_situ))
+                    settings->mem_free (value->u.string.ptr, settings->user_data);
                 break;
 
             default:
@@ -1037,3 +1096,938 @@ void json_value_free (json_value * value)
     json_value_free_ex (&settings, value);
 }
 
+
+/* The tape parser. Unlike the two pass parser above it makes a single
+ * pass, growing the tape as it goes, and keeps a stack of the containers
+ * it is inside so that each can be told where it ends once it does.
+ */
+
+#define JSON_TAPE_MAX_DEPTH   256
+#define JSON_TAPE_MAX_LENGTH  ((1U << 28) - 1)
+
+typedef struct
+{
+    json_settings settings;
+    json_tape_entry * entries;
+    unsigned int length, capacity;
+
+} tape_state;
+
+static int tape_push (tape_state * state, json_type type)
+{
+    if (state->length == state->capacity)
+    {
+        unsigned int capacity = state->capacity * 2;
+        json_tape_entry * entries;
+
+        if (capacity > JSON_TAPE_MAX_LENGTH || ! (entries = (json_tape_entry *) state->settings.mem_alloc
+                (capacity * sizeof (json_tape_entry), 0, state->settings.user_data)))
+        {
+            return -1;
+        }
+
+        memcpy (entries, state->entries, state->length * sizeof (json_tape_entry));
+        state->settings.mem_free (state->entries, state->settings.user_data);
+        state->entries = entries;
+        state->capacity = capacity;
+    }
+
+    memset (&state->entries [state->length], 0, sizeof (json_tape_entry));
+    state->entries [state->length].type = type;
+    state->entries [state->length].next = state->length + 1;
+
+    return state->length ++;
+}
+
+/* Append a UTF-8 encoding of uchar at out, returning where it ends */
+static json_char * put_utf8 (json_char * out, json_uchar uchar)
+{
+    if (uchar <= 0x7F)
+        *out ++ = (json_char) uchar;
+    else if (uchar <= 0x7FF)
+    {
+        *out ++ = 0xC0 | (uchar >> 6);
+        *out ++ = 0x80 | (uchar & 0x3F);
+    }
+    else if (uchar <= 0xFFFF)
+    {
+        *out ++ = 0xE0 | (uchar >> 12);
+        *out ++ = 0x80 | ((uchar >> 6) & 0x3F);
+        *out ++ = 0x80 | (uchar & 0x3F);
+    }
+    else
+    {
+        *out ++ = 0xF0 | (uchar >> 18);
+        *out ++ = 0x80 | ((uchar >> 12) & 0x3F);
+        *out ++ = 0x80 | ((uchar >> 6) & 0x3F);
+        *out ++ = 0x80 | (uchar & 0x3F);
+    }
+
+    return out;
+}
+
+static int read_hex4 (const json_char * p, const json_char * end, json_uchar * uchar)
+{
+    unsigned char digits [4];
+
+    if (end - p < 4)
+        return 0;
+
+    for (int i = 0; i < 4; ++ i)
+    {
+        if ((digits [i] = hex_value (p [i])) == 0xFF)
+            return 0;
+    }
+
+    *uchar = (digits [0] << 12) | (digits [1] << 8) | (digits [2] << 4) | digits [3];
+    return 1;
+}
+
+/* Decode the string starting just after an opening quote at p, in place,
+ * and null terminate it. Nothing is moved until the first escape, and
+ * decoding never makes a string longer, so it can't overtake itself.
+ * Returns where the closing quote was, or 0.
+ */
+static json_char * decode_string (json_char * p, const json_char * end,
+                                  unsigned int * length, const char ** problem)
+{
+    json_char * start = p, * out;
+    json_uchar uchar, uchar2;
+
+    while (p < end && *p != '"' && *p != '\\')
+        ++ p;
+
+    for (out = p; p < end; )
+    {
+        if (*p == '"')
+        {
+            *out = 0;
+            *length = out - start;
+            return p;
+        }
+
+        if (*p != '\\')
+        {
+            *out ++ = *p ++;
+            continue;
+        }
+
+        if (++ p == end)
+            break;
+
+        switch (*p ++)
+        {
+            case 'b':  *out ++ = '\b';  break;
+            case 'f':  *out ++ = '\f';  break;
+            case 'n':  *out ++ = '\n';  break;
+            case 'r':  *out ++ = '\r';  break;
+            case 't':  *out ++ = '\t';  break;
+            case 'u':
+
+                if (!read_hex4 (p, end, &uchar))
+                {
+                    *problem = "Invalid character value";
+                    return 0;
+                }
+
+                p += 4;
+
+                if ((uchar & 0xF800) == 0xD800)
+                {
+                    if (end - p < 6 || p [0] != '\\' || p [1] != 'u' || !read_hex4 (p + 2, end, &uchar2))
+                    {
+                        *problem = "Invalid character value";
+                        return 0;
+                    }
+
+                    p += 6;
+                    uchar = 0x010000 | ((uchar & 0x3FF) << 10) | (uchar2 & 0x3FF);
+                }
+
+                out = put_utf8 (out, uchar);
+                break;
+
+            default:
+                *out ++ = p [-1];
+        };
+    }
+
+    *problem = "Unexpected EOF in string";
+    return 0;
+}
+
+static const json_char * skip_whitespace (const json_char * p, const json_char * end)
+{
+    while (p < end && (*p == ' ' || *p == '\n' || *p == '\r' || *p == '\t'))
+        ++ p;
+
+    return p;
+}
+
+static int literal (const json_char * p, const json_char * end, const char * word)
+{
+    size_t len = strlen (word);
+
+    return (size_t) (end - p) >= len && memcmp (p, word, len) == 0;
+}
+
+/* Key interning: an open addressed hash table of the distinct keys seen,
+ * each kept once. A table of the caller's own copies keys in, since it
+ * outlives the input; one made for a single tape just points into it.
+ *
+ * The records in an array nearly always have the same keys in the same
+ * order, so each key also remembers which key came after it last time.
+ * That one is checked against the input first, which usually saves both
+ * decoding the key and hashing it.
+ */
+
+#define JSON_KEYS_INITIAL  64
+
+typedef struct
+{
+    unsigned int hash;
+    unsigned int length;
+    json_char * ptr;
+    unsigned int follow;        /* 1 + the slot of the key after this one, or 0 */
+    int plain;                  /* no quotes or backslashes, so it looks the same escaped */
+
+} json_key_slot;
+
+struct _json_keys
+{
+    json_settings settings;
+    int copy;
+
+    unsigned int count, capacity;
+    json_key_slot * slots;
+    unsigned int last;          /* 1 + the slot of the key interned last, or 0 */
+};
+
+static unsigned int hash_key (const json_char * key, unsigned int length)
+{
+    unsigned int hash = 2166136261U;
+
+    while (length --)
+        hash = (hash ^ (unsigned char) *key ++) * 16777619U;
+
+    return hash;
+}
+
+static json_keys * new_keys (json_settings * settings, int copy)
+{
+    json_keys * keys;
+
+    if (! (keys = (json_keys *) settings->mem_alloc (sizeof (json_keys), 0, settings->user_data)))
+        return 0;
+
+    keys->settings = *settings;
+    keys->copy = copy;
+    keys->count = 0;
+    keys->capacity = JSON_KEYS_INITIAL;
+    keys->last = 0;
+
+    if (! (keys->slots = (json_key_slot *) settings->mem_alloc
+            (keys->capacity * sizeof (json_key_slot), 1, settings->user_data)))
+    {
+        settings->mem_free (keys, settings->user_data);
+        return 0;
+    }
+
+    return keys;
+}
+
+json_keys * json_keys_new (json_settings * settings)
+{
+    json_settings defaults = { 0 };
+
+    if (settings)
+        defaults = *settings;
+
+    if (!defaults.mem_alloc)
+        defaults.mem_alloc = default_alloc;
+
+    if (!defaults.mem_free)
+        defaults.mem_free = default_free;
+
+    return new_keys (&defaults, 1);
+}
+
+void json_keys_free (json_keys * keys)
+{
+    if (!keys)
+        return;
+
+    if (keys->copy)
+    {
+        for (unsigned int i = 0; i < keys->capacity; ++ i)
+        {
+            if (keys->slots [i].ptr)
+                keys->settings.mem_free (keys->slots [i].ptr, keys->settings.user_data);
+        }
+    }
+
+    keys->settings.mem_free (keys->slots, keys->settings.user_data);
+    keys->settings.mem_free (keys, keys->settings.user_data);
+}
+
+static json_key_slot * find_slot (const json_keys * keys, const json_char * key,
+                                  unsigned int length, unsigned int hash)
+{
+    unsigned int mask = keys->capacity - 1;
+    json_key_slot * slot;
+
+    for (unsigned int i = hash & mask;; i = (i + 1) & mask)
+    {
+        slot = &keys->slots [i];
+
+        if (!slot->ptr || (slot->hash == hash && slot->length == length
+                    && memcmp (slot->ptr, key, length) == 0))
+        {
+            return slot;
+        }
+    }
+}
+
+/* The table is kept no more than half full, so there's always an empty slot to stop at */
+static int grow_keys (json_keys * keys)
+{
+    json_key_slot * old = keys->slots;
+    unsigned int old_capacity = keys->capacity;
+
+    if (! (keys->slots = (json_key_slot *) keys->settings.mem_alloc
+            (old_capacity * 2 * sizeof (json_key_slot), 1, keys->settings.user_data)))
+    {
+        keys->slots = old;
+        return 0;
+    }
+
+    keys->capacity = old_capacity * 2;
+    keys->last = 0;
+
+    /* Everything moves, so the guesses start over */
+    for (unsigned int i = 0; i < old_capacity; ++ i)
+    {
+        if (old [i].ptr)
+        {
+            old [i].follow = 0;
+            *find_slot (keys, old [i].ptr, old [i].length, old [i].hash) = old [i];
+        }
+    }
+
+    keys->settings.mem_free (old, keys->settings.user_data);
+    return 1;
+}
+
+/* The one copy of a key, adding it if it's new, or 0 if that fails */
+static json_char * intern_key (json_keys * keys, json_char * key, unsigned int length)
+{
+    unsigned int hash = hash_key (key, length);
+    json_key_slot * slot = find_slot (keys, key, length, hash);
+
+    if (slot->ptr)
+        goto found;
+
+    if ((keys->count + 1) * 2 > keys->capacity)
+    {
+        if (!grow_keys (keys))
+            return 0;
+
+        slot = find_slot (keys, key, length, hash);
+    }
+
+    if (keys->copy)
+    {
+        json_char * copy;
+
+        if (! (copy = (json_char *) keys->settings.mem_alloc
+                (length + 1, 0, keys->settings.user_data)))
+        {
+            return 0;
+        }
+
+        memcpy (copy, key, length);
+        copy [length] = 0;
+        key = copy;
+    }
+
+    slot->hash = hash;
+    slot->length = length;
+    slot->ptr = key;
+    slot->follow = 0;
+    slot->plain = !memchr (key, '"', length) && !memchr (key, '\\', length);
+    ++ keys->count;
+
+found:
+
+    if (keys->last)
+        keys->slots [keys->last - 1].follow = slot - keys->slots + 1;
+
+    keys->last = slot - keys->slots + 1;
+    return slot->ptr;
+}
+
+static const json_char * find_key (const json_keys * keys, const json_char * key, unsigned int length)
+{
+    return find_slot (keys, key, length, hash_key (key, length))->ptr;
+}
+
+/* Read the key starting just after an opening quote at p into entry,
+ * returning where its closing quote was, or 0.
+ */
+static json_char * scan_key (json_keys * keys, json_char * p, const json_char * end,
+                             json_tape_entry * entry, const char ** problem)
+{
+    json_key_slot * guess;
+    json_char * next;
+
+    if (keys->last && keys->slots [keys->last - 1].follow)
+    {
+        guess = &keys->slots [keys->slots [keys->last - 1].follow - 1];
+
+        if (guess->plain && (size_t) (end - p) > guess->length && p [guess->length] == '"'
+                && memcmp (p, guess->ptr, guess->length) == 0)
+        {
+            keys->last = guess - keys->slots + 1;
+            entry->u.ptr = guess->ptr;
+            entry->length = guess->length;
+            return p + guess->length;
+        }
+    }
+
+    if (! (next = decode_string (p, end, &entry->length, problem)))
+        return 0;
+
+    if (! (entry->u.ptr = intern_key (keys, p, entry->length)))
+        return 0;
+
+    return next;
+}
+
+json_tape * json_tape_parse (json_settings * settings,
+                             json_char * json,
+                             size_t length,
+                             char * error_buf)
+{
+    return json_tape_parse_keys (settings, 0, json, length, error_buf);
+}
+
+json_tape * json_tape_parse_keys (json_settings * settings,
+                                  json_keys * keys,
+                                  json_char * json,
+                                  size_t length,
+                                  char * error_buf)
+{
+    tape_state state = { 0 };
+    json_tape * tape = 0;
+    json_keys * caller_keys = keys;
+    unsigned int stack [JSON_TAPE_MAX_DEPTH];
+    unsigned int depth = 0;
+    json_char * p = json, * next, * end;
+    const char * problem = "Memory allocation failure";
+    int entry;
+
+    if (length >= 3 && ((unsigned char) json [0]) == 0xEF
+        && ((unsigned char) json [1]) == 0xBB
+        && ((unsigned char) json [2]) == 0xBF)
+    {
+        p += 3;
+    }
+
+    end = json + length;
+
+    memcpy (&state.settings, settings, sizeof (json_settings));
+    state.settings.settings |= json_in_situ;
+
+    if (!state.settings.mem_alloc)
+        state.settings.mem_alloc = default_alloc;
+
+    if (!state.settings.mem_free)
+        state.settings.mem_free = default_free;
+
+    if (!keys && ! (keys = new_keys (&state.settings, 0)))
+        goto e_failed;
+
+    /* Most documents need an entry for every 16 bytes or so */
+    state.capacity = length / 16 + 16;
+    if (! (state.entries = (json_tape_entry *) state.settings.mem_alloc
+            (state.capacity * sizeof (json_tape_entry), 0, state.settings.user_data)))
+    {
+        goto e_failed;
+    }
+
+    for (;;)
+    {
+        /* A value */
+        p = (json_char *) skip_whitespace (p, end);
+        if (p == end)
+        {
+            problem = "Unexpected EOF";
+            goto e_failed;
+        }
+
+        switch (*p)
+        {
+            case '{':
+            case '[':
+
+                if (depth == JSON_TAPE_MAX_DEPTH)
+                {
+                    problem = "Too deeply nested";
+                    goto e_failed;
+                }
+
+                if ((entry = tape_push (&state, *p == '{' ? json_object : json_array)) == -1)
+                    goto e_failed;
+
+                stack [depth ++] = entry;
+                p = (json_char *) skip_whitespace (p + 1, end);
+
+                if (p < end && *p == (state.entries [entry].type == json_object ? '}' : ']'))
+                    break;
+
+                if (state.entries [entry].type == json_array)
+                    continue;
+
+                goto key;
+
+            case '"':
+
+                if ((entry = tape_push (&state, json_string)) == -1)
+                    goto e_failed;
+
+                state.entries [entry].u.ptr = p + 1;
+                if (! (next = decode_string (p + 1, end, &state.entries [entry].length, &problem)))
+                    goto e_failed;
+
+                p = next + 1;
+                break;
+
+            case 't':
+            case 'f':
+            case 'n':
+
+                if ((entry = tape_push (&state, *p == 'n' ? json_null : json_boolean)) == -1)
+                    goto e_failed;
+
+                if (literal (p, end, "true"))
+                {
+                    state.entries [entry].u.boolean = 1;
+                    p += 4;
+                }
+                else if (literal (p, end, "false"))
+                    p += 5;
+                else if (literal (p, end, "null"))
+                    p += 4;
+                else
+                {
+                    problem = "Unknown value";
+                    goto e_failed;
+                }
+
+                break;
+
+            default:
+
+                if (isdigit (*p) || *p == '-')
+                {
+                    json_value number;
+
+                    if ((entry = tape_push (&state, json_integer)) == -1)
+                        goto e_failed;
+
+                    if (! (next = (json_char *) scan_number (p, end, &number, 1, &problem)))
+                        goto e_failed;
+
+                    p = next;
+
+                    state.entries [entry].type = number.type;
+                    if (number.type == json_integer)
+                        state.entries [entry].u.integer = number.u.integer;
+                    else
+                        state.entries [entry].u.dbl = number.u.dbl;
+
+                    break;
+                }
+
+                problem = "Unexpected character when seeking value";
+                goto e_failed;
+        };
+
+        /* After a value: close whatever containers end here, then on to the next one */
+        for (;;)
+        {
+            json_tape_entry * container;
+
+            p = (json_char *) skip_whitespace (p, end);
+
+            if (!depth)
+            {
+                if (p != end)
+                {
+                    problem = "Trailing garbage";
+                    goto e_failed;
+                }
+
+                goto done;
+            }
+
+            container = &state.entries [stack [depth - 1]];
+
+            /* An empty container has no value to count */
+            if ((unsigned int) stack [depth - 1] + 1 != state.length)
+                ++ container->length;
+
+            if (p < end && *p == (container->type == json_object ? '}' : ']'))
+            {
+                container->next = state.length;
+                -- depth;
+                ++ p;
+                continue;
+            }
+
+            if (p == end || *p != ',')
+            {
+                problem = "Expected , or end of container";
+                goto e_failed;
+            }
+
+            p = (json_char *) skip_whitespace (p + 1, end);
+            if (container->type == json_array)
+                break;
+
+        key:
+            if (p == end || *p != '"')
+            {
+                problem = "Expected key";
+                goto e_failed;
+            }
+
+            if ((entry = tape_push (&state, json_string)) == -1)
+                goto e_failed;
+
+            if (! (next = scan_key (keys, p + 1, end, &state.entries [entry], &problem)))
+                goto e_failed;
+
+            p = (json_char *) skip_whitespace (next + 1, end);
+            if (p == end || *p != ':')
+            {
+                problem = "Expected : after key";
+                goto e_failed;
+            }
+
+            ++ p;
+            break;
+        }
+    }
+
+done:
+
+    if (! (tape = (json_tape *) state.settings.mem_alloc (sizeof (json_tape), 0, state.settings.user_data)))
+        goto e_failed;
+
+    tape->settings = state.settings;
+    tape->length = state.length;
+    tape->entries = state.entries;
+    tape->keys = keys;
+    tape->own_keys = keys != caller_keys;
+
+    return tape;
+
+e_failed:
+
+    if (error_buf)
+        sprintf (error_buf, "At byte %d: %s", (int) (p - json), problem);
+
+    if (state.entries)
+        state.settings.mem_free (state.entries, state.settings.user_data);
+
+    if (keys != caller_keys)
+        json_keys_free (keys);
+
+    return 0;
+}
+
+void json_tape_free (json_tape * tape)
+{
+    if (!tape)
+        return;
+
+    if (tape->own_keys)
+        json_keys_free (tape->keys);
+
+    tape->settings.mem_free (tape->entries, tape->settings.user_data);
+    tape->settings.mem_free (tape, tape->settings.user_data);
+}
+
+json_cursor json_tape_root (const json_tape * tape)
+{
+    json_cursor cursor = { tape, 0, tape->length, 0 };
+    return cursor;
+}
+
+int json_cursor_valid (json_cursor cursor)
+{
+    return cursor.tape && cursor.index < cursor.end;
+}
+
+static const json_tape_entry * cursor_entry (json_cursor cursor)
+{
+    return json_cursor_valid (cursor) ? &cursor.tape->entries [cursor.index] : 0;
+}
+
+json_type json_cursor_type (json_cursor cursor)
+{
+    const json_tape_entry * entry = cursor_entry (cursor);
+    return entry ? (json_type) entry->type : json_none;
+}
+
+unsigned int json_cursor_length (json_cursor cursor)
+{
+    const json_tape_entry * entry = cursor_entry (cursor);
+    return entry ? entry->length : 0;
+}
+
+json_cursor json_cursor_first (json_cursor container)
+{
+    const json_tape_entry * entry = cursor_entry (container);
+    json_cursor first = { container.tape, 0, 0, 0 };
+
+    if (!entry || (entry->type != json_object && entry->type != json_array))
+        return first;
+
+    first.member = entry->type == json_object;
+    first.index = container.index + 1 + first.member;
+    first.end = entry->next;
+
+    return first;
+}
+
+json_cursor json_cursor_next (json_cursor cursor)
+{
+    const json_tape_entry * entry = cursor_entry (cursor);
+
+    if (!entry)
+        return cursor;
+
+    /* Past this value, and then past the next member's key */
+    cursor.index = entry->next + cursor.member;
+    return cursor;
+}
+
+const json_char * json_cursor_key (json_cursor member, unsigned int * length)
+{
+    const json_tape_entry * key;
+
+    if (!json_cursor_valid (member) || !member.member)
+        return 0;
+
+    key = &member.tape->entries [member.index - 1];
+    if (length)
+        *length = key->length;
+
+    return key->u.ptr;
+}
+
+const json_char * json_tape_key (const json_tape * tape, const json_char * key)
+{
+    return find_key (tape->keys, key, strlen (key));
+}
+
+json_cursor json_cursor_get_key (json_cursor object, const json_char * interned)
+{
+    json_cursor member;
+
+    if (json_cursor_type (object) != json_object)
+        return json_cursor_first (object);
+
+    member = json_cursor_first (object);
+
+    /* A key the document doesn't have anywhere can't be in this object */
+    if (!interned)
+        member.index = member.end;
+
+    for (; json_cursor_valid (member); member = json_cursor_next (member))
+    {
+        if (member.tape->entries [member.index - 1].u.ptr == interned)
+            return member;
+    }
+
+    return member;
+}
+
+json_cursor json_cursor_get (json_cursor object, const json_char * key)
+{
+    if (!json_cursor_valid (object))
+        return object;
+
+    return json_cursor_get_key (object, json_tape_key (object.tape, key));
+}
+
+json_cursor json_cursor_index (json_cursor array, unsigned int i)
+{
+    json_cursor element;
+
+    if (json_cursor_type (array) != json_array)
+        return json_cursor_first (array);
+
+    for (element = json_cursor_first (array); i && json_cursor_valid (element); -- i)
+        element = json_cursor_next (element);
+
+    return element;
+}
+
+const json_char * json_cursor_string (json_cursor cursor, unsigned int * length)
+{
+    const json_tape_entry * entry = cursor_entry (cursor);
+
+    if (!entry || entry->type != json_string)
+        return 0;
+
+    if (length)
+        *length = entry->length;
+
+    return entry->u.ptr;
+}
+
+double json_cursor_double (json_cursor cursor)
+{
+    const json_tape_entry * entry = cursor_entry (cursor);
+
+    if (entry && entry->type == json_double)
+        return entry->u.dbl;
+
+    if (entry && entry->type == json_integer)
+        return (double) entry->u.integer;
+
+    return 0;
+}
+
+json_int_t json_cursor_integer (json_cursor cursor)
+{
+    const json_tape_entry * entry = cursor_entry (cursor);
+
+    if (entry && entry->type == json_integer)
+        return entry->u.integer;
+
+    if (entry && entry->type == json_double)
+        return (json_int_t) entry->u.dbl;
+
+    return 0;
+}
+
+int json_cursor_boolean (json_cursor cursor)
+{
+    const json_tape_entry * entry = cursor_entry (cursor);
+    return entry && entry->type == json_boolean && entry->u.boolean;
+}
+
+static json_value * materialize (const json_tape * tape, unsigned int index, json_value * parent)
+{
+    const json_settings * settings = &tape->settings;
+    const json_tape_entry * entry = &tape->entries [index];
+    json_value * value;
+    unsigned int i, child;
+
+    if (! (value = (json_value *) settings->mem_alloc
+            (sizeof (json_value) + settings->value_extra, 1, settings->user_data)))
+    {
+        return 0;
+    }
+
+    value->type = (json_type) entry->type;
+    value->parent = parent;
+
+    switch (entry->type)
+    {
+        case json_object:
+
+            if (!entry->length)
+                break;
+
+            if (! (value->u.object.values = (json_object_entry *) settings->mem_alloc
+                    (entry->length * sizeof (json_object_entry), 0, settings->user_data)))
+            {
+                goto e_failed;
+            }
+
+            for (i = 0, child = index + 1; i < entry->length; ++ i, child = tape->entries [child + 1].next)
+            {
+                value->u.object.values [i].name = tape->entries [child].u.ptr;
+                value->u.object.values [i].name_length = tape->entries [child].length;
+
+                if (! (value->u.object.values [i].value = materialize (tape, child + 1, value)))
+                    goto e_failed;
+
+                value->u.object.length = i + 1;
+            }
+
+            break;
+
+        case json_array:
+
+            if (!entry->length)
+                break;
+
+            if (! (value->u.array.values = (json_value **) settings->mem_alloc
+                    (entry->length * sizeof (json_value *), 0, settings->user_data)))
+            {
+                goto e_failed;
+            }
+
+            for (i = 0, child = index + 1; i < entry->length; ++ i, child = tape->entries [child].next)
+            {
+                if (! (value->u.array.values [i] = materialize (tape, child, value)))
+                    goto e_failed;
+
+                value->u.array.length = i + 1;
+            }
+
+            break;
+
+        case json_string:
+
+            value->u.string.ptr = entry->u.ptr;
+            value->u.string.length = entry->length;
+            break;
+
+        case json_integer:
+
+            value->u.integer = entry->u.integer;
+            break;
+
+        case json_double:
+
+            value->u.dbl = entry->u.dbl;
+            break;
+
+        case json_boolean:
+
+            value->u.boolean = entry->u.boolean;
+            break;
+
+        default:
+            break;
+    };
+
+    return value;
+
+    e_failed:
+
+    /* Free what we have so far as if it were a whole tree */
+    value->parent = 0;
+    json_value_free_ex ((json_settings *) settings, value);
+    return 0;
+}
+
+json_value * json_cursor_materialize (json_cursor cursor)
+{
+    if (!json_cursor_valid (cursor))
+        return 0;
+
+    return materialize (cursor.tape, cursor.index, 0);
+}
+
+void json_tape_value_free (const json_tape * tape, json_value * value)
+{
+    json_value_free_ex ((json_settings *) &tape->settings, value);
+}
@@ -73,6 +73,13 @@ typedef struct
 
 #define json_enable_comments  0x01
 
+/* Parse in situ: the input buffer is the caller's to give up, and strings
+ * and object names are decoded in place and point straight into it rather
+ * than being copied out. The input must stay put for as long as the parsed
+ * value is around, and free it with the same settings.
+ */
+#define json_in_situ          0x02
+
 typedef enum
 {
     json_none,
@@ -272,6 +279,124 @@ void json_value_free (json_value *);
 void json_value_free_ex (json_settings * settings,
                          json_value *);
 
+/* The tape: a lighter way to read a document that doesn't build a tree.
+ *
+ * Every value is one entry in a flat array, in document order. Containers
+ * are followed by their contents, an object's as alternating key and value
+ * entries, and every entry knows the index of whatever comes after it and
+ * all its contents, so skipping a value is one step however big it is.
+ * Parsing is always in situ, so strings point into the input, which must
+ * stay put for as long as the tape does.
+ *
+ * Keys are interned: each distinct key in a document is kept once, every
+ * key entry points at that one copy, and json_cursor_get() compares those
+ * pointers rather than the bytes. A json_keys table of the caller's own
+ * can be passed in to share keys across parses, in which case they are
+ * copied into it and outlive the input.
+ *
+ * Cursors walk the tape. Looking something up that isn't there gets a
+ * cursor that isn't valid, and everything done with that gets nothing back
+ * in turn, so a chain of lookups only needs checking at the end. When a
+ * real json_value is wanted after all, json_cursor_materialize() builds
+ * one for just the part of the tape the cursor is on.
+ */
+
+typedef struct
+{
+    unsigned int type : 4;      /* json_type */
+    unsigned int next : 28;     /* index of the entry after this value and its contents */
+    unsigned int length;        /* of a string, or members or elements of a container */
+
+    union
+    {
+        int boolean;
+        json_int_t integer;
+        double dbl;
+        json_char * ptr;        /* a string or interned key, null terminated */
+
+    } u;
+
+} json_tape_entry;
+
+typedef struct _json_keys json_keys;
+
+typedef struct
+{
+    json_settings settings;
+    unsigned int length;
+    json_tape_entry * entries;
+
+    json_keys * keys;
+    int own_keys;               /* whether keys is just for this tape */
+
+} json_tape;
+
+typedef struct
+{
+    const json_tape * tape;
+    unsigned int index;
+    unsigned int end;           /* where the container the cursor is in ends */
+    int member;                 /* whether that container is an object */
+
+} json_cursor;
+
+json_tape * json_tape_parse (json_settings * settings,
+                             json_char * json,
+                             size_t length,
+                             char * error);
+
+/* As above, interning keys into a table that stays around between parses.
+ * A table is not safe to share between threads.
+ */
+json_tape * json_tape_parse_keys (json_settings * settings,
+                                  json_keys * keys,
+                                  json_char * json,
+                                  size_t length,
+                                  char * error);
+
+void json_tape_free (json_tape *);
+
+json_keys * json_keys_new (json_settings * settings);
+void json_keys_free (json_keys *);
+
+json_cursor json_tape_root (const json_tape *);
+int json_cursor_valid (json_cursor);
+json_type json_cursor_type (json_cursor);
+unsigned int json_cursor_length (json_cursor);
+
+/* The member called key of an object, or element i of an array */
+json_cursor json_cursor_get (json_cursor object, const json_char * key);
+json_cursor json_cursor_index (json_cursor array, unsigned int i);
+
+/* For looking the same key up over and over, as in every record of an
+ * array: json_tape_key() finds its interned copy once, or NULL if the
+ * document has no such key, and json_cursor_get_key() takes that.
+ */
+const json_char * json_tape_key (const json_tape *, const json_char * key);
+json_cursor json_cursor_get_key (json_cursor object, const json_char * interned);
+
+/* Iterating: the first element or member value inside a container, then
+ * the one after. For an object, json_cursor_key() names the member.
+ */
+json_cursor json_cursor_first (json_cursor container);
+json_cursor json_cursor_next (json_cursor);
+const json_char * json_cursor_key (json_cursor member, unsigned int * length);
+
+/* Scalars. Numbers come back as whichever type is asked for; anything of
+ * the wrong type gives 0 or NULL.
+ */
+const json_char * json_cursor_string (json_cursor, unsigned int * length);
+double json_cursor_double (json_cursor);
+json_int_t json_cursor_integer (json_cursor);
+int json_cursor_boolean (json_cursor);
+
+/* A classic tree for the value at the cursor, strings and all still in the
+ * tape's input. Free it with json_tape_value_free() before the tape goes.
+ */
+json_value * json_cursor_materialize (json_cursor);
+void json_tape_value_free (const json_tape *, json_value *);
+
+
 
 #ifdef __cplusplus
 } /* extern "C" */
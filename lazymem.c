@@ -0,0 +1,335 @@
+#define _GNU_SOURCE
+#include <err.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <linux/userfaultfd.h>
+#include <poll.h>
+#include <pthread.h>
+#include <signal.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/ioctl.h>
+#include <sys/stat.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+#include "lazymem.h"
+#include "placement.h"
+
+/* Part of guest RAM whose contents come from a file */
+struct extent {
+    uint64_t gpa;
+    size_t len;
+    int fd;
+    off_t offset;
+};
+
+static int uffd = -1;
+static uint8_t *guest_mem;
+static size_t nr_pages;
+
+static struct extent extents[LAZYMEM_MAX_EXTENTS];
+static unsigned int nr_extents;
+
+/*
+ * Only the fault thread fills pages in, so none of this needs a lock;
+ * pages can be forgotten from elsewhere, which only ever clears a byte of
+ * present. The fill order is read at exit from whichever thread is
+ * exiting, which only looks as far as nr_filled says has been written.
+ * */
+static uint8_t *present;                /* a byte per page, set once it's been filled in */
+static uint32_t *fill_order;            /* the pages in the order they were filled in */
+static size_t nr_filled;
+static uint8_t page_buf[LAZYMEM_PAGE_SIZE] __attribute__((aligned(LAZYMEM_PAGE_SIZE)));
+
+static const char *hints_path;
+static uint32_t *hints;
+static size_t nr_hints, next_hint;
+
+static struct lazymem_stats stats;
+
+static void load_hints(void)
+{
+    struct lazymem_hints_header hdr;
+    struct stat st;
+    int fd = open(hints_path, O_RDONLY | O_CLOEXEC);
+
+    if (fd == -1)
+        return;
+    if (fstat(fd, &st) == -1 || read(fd, &hdr, sizeof(hdr)) != sizeof(hdr))
+        goto out;
+    if (hdr.magic != LAZYMEM_HINTS_MAGIC || hdr.version != LAZYMEM_HINTS_VERSION
+        || hdr.page_size != LAZYMEM_PAGE_SIZE
+        || hdr.nr_pages > (st.st_size - sizeof(hdr)) / sizeof(uint32_t))
+        goto out;
+
+    hints = calloc(hdr.nr_pages ? hdr.nr_pages : 1, sizeof(uint32_t));
+    if (!hints)
+        goto out;
+    if (read(fd, hints, hdr.nr_pages * sizeof(uint32_t)) == (ssize_t)(hdr.nr_pages * sizeof(uint32_t)))
+        nr_hints = hdr.nr_pages;
+
+out:
+    close(fd);
+}
+
+/* Write out this run's fill order for the next one, by way of a temporary file */
+static void save_hints(void)
+{
+    struct lazymem_hints_header hdr = {
+            .magic = LAZYMEM_HINTS_MAGIC,
+            .version = LAZYMEM_HINTS_VERSION,
+            .page_size = LAZYMEM_PAGE_SIZE,
+            .nr_pages = __atomic_load_n(&nr_filled, __ATOMIC_ACQUIRE),
+    };
+    size_t len = hdr.nr_pages * sizeof(uint32_t);
+    char tmp_path[4096];
+    int fd;
+
+    if (!hdr.nr_pages)
+        return;
+
+    snprintf(tmp_path, sizeof(tmp_path), "%s.tmp", hints_path);
+    fd = open(tmp_path, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+    if (fd == -1)
+        return;
+    if (write(fd, &hdr, sizeof(hdr)) != sizeof(hdr) || write(fd, fill_order, len) != (ssize_t)len
+        || rename(tmp_path, hints_path) == -1) {
+        close(fd);
+        unlink(tmp_path);
+        return;
+    }
+    close(fd);
+}
+
+/* Put together the page from whatever extents it overlaps, returning 0 if it's all zeroes */
+static int read_page(uint64_t gpa)
+{
+    int data = 0;
+
+    for (unsigned int i = 0; i < nr_extents; i++) {
+        struct extent *e = &extents[i];
+        uint64_t start = gpa > e->gpa ? gpa : e->gpa;
+        uint64_t end = gpa + LAZYMEM_PAGE_SIZE < e->gpa + e->len ? gpa + LAZYMEM_PAGE_SIZE : e->gpa + e->len;
+        ssize_t n;
+
+        if (start >= end)
+            continue;
+        if (!data) {
+            memset(page_buf, 0, sizeof(page_buf));
+            data = 1;
+        }
+        /* Anything past the end of the file just stays zero */
+        n = pread(e->fd, page_buf + (start - gpa), end - start, e->offset + (start - e->gpa));
+        if (n > 0)
+            stats.bytes_read += n;
+    }
+    return data;
+}
+
+static void fill_page(size_t page)
+{
+    uint64_t gpa = (uint64_t)page * LAZYMEM_PAGE_SIZE;
+    int ret;
+
+    if (read_page(gpa)) {
+        struct uffdio_copy copy = {
+                .dst = (uintptr_t)guest_mem + gpa,
+                .src = (uintptr_t)page_buf,
+                .len = LAZYMEM_PAGE_SIZE,
+        };
+
+        ret = ioctl(uffd, UFFDIO_COPY, &copy);
+        stats.read_pages++;
+    } else {
+        struct uffdio_zeropage zero = {
+                .range = { .start = (uintptr_t)guest_mem + gpa, .len = LAZYMEM_PAGE_SIZE },
+        };
+
+        ret = ioctl(uffd, UFFDIO_ZEROPAGE, &zero);
+        stats.zero_pages++;
+    }
+
+    /* EEXIST means it got there some other way, which is just as good, but it won't have woken anyone */
+    if (ret == -1 && errno != EEXIST)
+        err(1, "filling in guest page %#lx", (unsigned long)gpa);
+    if (ret == -1) {
+        struct uffdio_range range = { .start = (uintptr_t)guest_mem + gpa, .len = LAZYMEM_PAGE_SIZE };
+
+        ioctl(uffd, UFFDIO_WAKE, &range);
+    }
+
+    /* A page that was forgotten and filled in again is only in the order once */
+    if (!__atomic_exchange_n(&present[page], 1, __ATOMIC_RELAXED) && nr_filled < nr_pages) {
+        fill_order[nr_filled] = page;
+        __atomic_store_n(&nr_filled, nr_filled + 1, __ATOMIC_RELEASE);
+    }
+}
+
+/* The next hinted page that isn't there yet, if any */
+static void prefetch(void)
+{
+    while (next_hint < nr_hints) {
+        uint32_t page = hints[next_hint++];
+
+        if (page < nr_pages && !__atomic_load_n(&present[page], __ATOMIC_RELAXED)) {
+            fill_page(page);
+            stats.prefetched++;
+            return;
+        }
+    }
+}
+
+static void *fault_thread(void *arg)
+{
+    placement_io_thread();
+
+    for (;;) {
+        struct pollfd pfd = { .fd = uffd, .events = POLLIN };
+        struct uffd_msg msg;
+        size_t page;
+        ssize_t n;
+
+        /* Faults always go first; hinted pages only get filled in while none are waiting */
+        n = poll(&pfd, 1, next_hint < nr_hints ? 0 : -1);
+        if (n == -1 && errno == EINTR)
+            continue;
+        if (n == -1)
+            err(1, "polling userfaultfd");
+        if (n == 0) {
+            prefetch();
+            continue;
+        }
+
+        n = read(uffd, &msg, sizeof(msg));
+        if (n == -1 && (errno == EAGAIN || errno == EINTR))
+            continue;
+        if (n != sizeof(msg))
+            err(1, "reading userfaultfd");
+        if (msg.event != UFFD_EVENT_PAGEFAULT)
+            continue;
+
+        stats.faults++;
+        page = (msg.arg.pagefault.address - (uintptr_t)guest_mem) / LAZYMEM_PAGE_SIZE;
+        /*
+         * Even if it's been filled in, it may have been forgotten since, so
+         * fill it in regardless; if it is there, that just wakes the guest.
+         * */
+        fill_page(page);
+    }
+    return NULL;
+}
+
+/*
+ * Register guest RAM for demand paging if SPARKLER_LAZY_MEM asks for it.
+ * Returns -1 if it doesn't or we can't, in which case the caller loads
+ * the guest the usual way.
+ * */
+int lazymem_init(uint8_t *mem, size_t size)
+{
+    const char *lazy = getenv("SPARKLER_LAZY_MEM");
+    struct uffdio_api api = {
+            .api = UFFD_API,
+            .features = UFFD_FEATURE_MISSING_SHMEM,
+    };
+    struct uffdio_register reg = {
+            .range = { .start = (uintptr_t)mem, .len = size },
+            .mode = UFFDIO_REGISTER_MODE_MISSING,
+    };
+
+    if (!lazy || strcmp(lazy, "1") != 0)
+        return -1;
+    if (placement_prefault()) {
+        warnx("SPARKLER_PREFAULT is set, so guest memory isn't demand paged");
+        return -1;
+    }
+    if (size % LAZYMEM_PAGE_SIZE) {
+        warnx("guest memory isn't a whole number of pages, so it isn't demand paged");
+        return -1;
+    }
+
+    uffd = syscall(SYS_userfaultfd, O_CLOEXEC | O_NONBLOCK);
+    if (uffd == -1) {
+        warn("userfaultfd, so guest memory isn't demand paged");
+        return -1;
+    }
+    if (ioctl(uffd, UFFDIO_API, &api) == -1 || ioctl(uffd, UFFDIO_REGISTER, &reg) == -1) {
+        warn("setting up userfaultfd, so guest memory isn't demand paged");
+        close(uffd);
+        uffd = -1;
+        return -1;
+    }
+
+    guest_mem = mem;
+    nr_pages = size / LAZYMEM_PAGE_SIZE;
+    present = calloc(nr_pages, 1);
+    fill_order = calloc(nr_pages, sizeof(uint32_t));
+    if (!present || !fill_order)
+        err(1, "allocating demand paging state");
+
+    hints_path = getenv("SPARKLER_LAZY_HINTS");
+    if (!hints_path)
+        hints_path = LAZYMEM_HINTS_FILE;
+    return 0;
+}
+
+/* Guest memory from gpa on for len bytes comes from fd at offset, which has to stay open */
+int lazymem_add(uint64_t gpa, int fd, off_t offset, size_t len)
+{
+    if (nr_extents == LAZYMEM_MAX_EXTENTS || gpa + len > nr_pages * LAZYMEM_PAGE_SIZE)
+        return -1;
+    extents[nr_extents++] = (struct extent){ .gpa = gpa, .len = len, .fd = fd, .offset = offset };
+    return 0;
+}
+
+/* Start serving faults. Nothing may touch guest memory between lazymem_init() and this. */
+void lazymem_start(void)
+{
+    sigset_t all, old;
+    pthread_t thread;
+    int ret;
+
+    load_hints();
+    /* We're started before migration blocks SIGUSR1, which is meant for its thread, not ours */
+    sigfillset(&all);
+    pthread_sigmask(SIG_SETMASK, &all, &old);
+    ret = pthread_create(&thread, NULL, fault_thread, NULL);
+    pthread_sigmask(SIG_SETMASK, &old, NULL);
+    if (ret != 0)
+        errx(1, "starting the userfaultfd thread");
+    pthread_detach(thread);
+    atexit(save_hints);
+}
+
+/*
+ * Pages from gpa to gpa + len are about to be dropped, so they'll fault
+ * again and need filling in as if for the first time. Nothing may be
+ * touching them while they're forgotten and dropped.
+ * */
+void lazymem_forget(uint64_t gpa, size_t len)
+{
+    if (!lazymem_enabled())
+        return;
+    for (size_t page = gpa / LAZYMEM_PAGE_SIZE; page < (gpa + len) / LAZYMEM_PAGE_SIZE && page < nr_pages; page++)
+        __atomic_store_n(&present[page], 0, __ATOMIC_RELAXED);
+}
+
+int lazymem_enabled(void)
+{
+    return uffd != -1;
+}
+
+void lazymem_get_stats(struct lazymem_stats *s)
+{
+    *s = stats;
+}
+
+void lazymem_print_stats(FILE *f)
+{
+    struct lazymem_stats s;
+
+    if (!lazymem_enabled())
+        return;
+    lazymem_get_stats(&s);
+    fprintf(f, "lazymem: %lu faults, %lu pages read in, %lu zero pages, %lu prefetched, %lu bytes read\n",
+            s.faults, s.read_pages, s.zero_pages, s.prefetched, s.bytes_read);
+}
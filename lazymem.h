@@ -0,0 +1,58 @@
+#ifndef SPARKLER_LAZYMEM_H
+#define SPARKLER_LAZYMEM_H
+
+#include <stddef.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <sys/types.h>
+
+/*
+ * Demand paged guest RAM, so a guest starts running as soon as its memory
+ * is set up, however big it and its image are. Turned on with
+ * SPARKLER_LAZY_MEM=1, and it needs userfaultfd(2); without it we warn and
+ * read the image in up front as usual.
+ *
+ * Guest RAM is registered with a userfaultfd, and a thread of our own
+ * fills each page in the first time anything touches it, the guest or our
+ * device emulation: from the image if the page has any of it, or with
+ * zeroes if not. Pages nothing touches are never read or allocated.
+ *
+ * The order pages got filled in is kept in a hints file at exit. The next
+ * run fills those pages in ahead of time, in that order, whenever no fault
+ * is waiting, so the guest mostly finds its pages already there.
+ * SPARKLER_LAZY_HINTS names the file, which is sparkler.hints by default.
+ * */
+
+#define LAZYMEM_HINTS_FILE      "sparkler.hints"
+
+#define LAZYMEM_PAGE_SIZE       4096
+#define LAZYMEM_MAX_EXTENTS     8
+
+#define LAZYMEM_HINTS_MAGIC     0x544e4948  /* "HINT" */
+#define LAZYMEM_HINTS_VERSION   1
+
+/* Followed by nr_pages guest page numbers, 32 bits each */
+struct lazymem_hints_header {
+    uint32_t magic;
+    uint32_t version;
+    uint32_t page_size;
+    uint32_t nr_pages;
+};
+
+struct lazymem_stats {
+    unsigned long faults;           /* page faults we were woken for */
+    unsigned long zero_pages;       /* filled in without reading anything */
+    unsigned long read_pages;       /* filled in from the image */
+    unsigned long prefetched;       /* filled in ahead of a fault, off the hints */
+    unsigned long bytes_read;
+};
+
+int lazymem_init(uint8_t *mem, size_t size);
+int lazymem_add(uint64_t gpa, int fd, off_t offset, size_t len);
+void lazymem_start(void);
+void lazymem_forget(uint64_t gpa, size_t len);
+int lazymem_enabled(void);
+void lazymem_get_stats(struct lazymem_stats *stats);
+void lazymem_print_stats(FILE *f);
+
+#endif
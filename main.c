@@ -1,20 +1,43 @@
 #include <err.h>
+#include <errno.h>
 #include <fcntl.h>
 #include <linux/kvm.h>
+#include <linux/kvm_para.h>
+#include <poll.h>
 #include <stdint.h>
 #include <stdio.h>
 #include <string.h>
 #include <sys/ioctl.h>
 #include <sys/mman.h>
 #include <sys/stat.h>
+#include <time.h>
 #include <stdlib.h>
 #include <unistd.h>
 #include <cpuid.h>
-#include <termios.h>
+#include "backend.h"
+#include "balloon.h"
+#include "console.h"
+#include "datapage.h"
+#include "diskcache.h"
 #include "fetchnparse.h"
+#include "ioport.h"
+#include "lazymem.h"
+#include "migrate.h"
+#include "placement.h"
+#include "pool.h"
+#include "replay.h"
+#include "rom.h"
+#include "singleflight.h"
+#include "stats.h"
+#include "timer.h"
+#include "trace.h"
+#include "uart.h"
+#include "virtio_console.h"
 
 /* Port definitions for the devices we emulate */
 #define SERIAL_PORT                     0x3f8
+#define TIMER_PORT                      0x140
+#define BALLOON_PORT                    0x150
 #define TWITTER_DEVICE                  0x100
 #define WEATHER_DEVICE_CHENNAI          0x101
 #define WEATHER_DEVICE_DELHI            0x102
@@ -30,53 +53,575 @@
 #define AIR_QUALITY_DEVICE_NY           0x206
 
 /*
- * There is no getch() under Linux, so we need to roll our own:
- * Credits to:
- * https://stackoverflow.com/questions/7469139/what-is-the-equivalent-to-getch-getche-in-linux
+ * Guest RAM starts at 0 so the guest has somewhere to keep its real mode
+ * interrupt vector table. The monitor is loaded just above it, or rather
+ * mapped there: if it fits, it goes in straight from its file through a
+ * read-only slot of its own, shared with every other guest running it, and
+ * RAM carries on after it in another slot. The monitor keeps everything it
+ * writes out of that page. An image too big for it, or SPARKLER_ROM=0,
+ * gets copied into RAM instead.
  * */
+#define GUEST_MEM_SIZE                  0x9000
+#define MONITOR_LOAD_ADDR               0x1000
+#define MONITOR_ROM_SIZE                0x1000
+#define LOW_RAM_SLOT                    0
+#define MONITOR_ROM_SLOT                2           /* the stats page has slot 1 */
+#define HIGH_RAM_SLOT                   3
 
-static struct termios old, current;
+/*
+ * Two virtio-console devices sit in the unbacked hole at 0xe0000, where a
+ * real mode guest can reach them through a segment register. The first is
+ * a plain console; on the second the guest sends a device's port number
+ * and gets that device's payload back on its receive queue.
+ * */
+#define VIRTIO_CONSOLE_BASE             0xe0000
+#define VIRTIO_DATA_BASE                (VIRTIO_CONSOLE_BASE + VIRTIO_MMIO_SIZE)
+#define VIRTIO_CONSOLE_IRQ              5
+#define VIRTIO_DATA_IRQ                 6
+
+/* Vector an ISA IRQ arrives on, with the master PIC at its BIOS default base */
+#define IRQ_VECTOR(irq)                 (0x08 + (irq))
+
+static struct uart com1;
+static struct timer timer;
+static struct balloon balloon;
+static struct virtio_console vcon;
+static struct virtio_console vdata;
+
+/* A device's payload, read out through its ports a byte at a time, straight from the shared blob */
+struct port_reader {
+    struct blob *payload;
+    int idx;
+};
+
+static struct port_reader tweet_reader;
+static struct port_reader weather_reader;
+static struct port_reader aq_reader;
+
+enum device_kind {
+    DEVICE_TWEET,
+    DEVICE_WEATHER,
+    DEVICE_AIR_QUALITY,
+};
+
+static const char *const device_names[] = { "tweet", "weather", "air quality" };
+
+/* Everything a device port needs to fetch its payload, worked out before the guest ever touches it */
+struct device_port {
+    uint16_t port;
+    enum device_kind kind;
+    const char *city;
+    const char *country;
+    struct port_reader *reader;     /* shared by all of a device's cities */
+};
+
+/* In the order their counters are on the stats page */
+static struct device_port device_ports[] = {
+    { TWITTER_DEVICE, DEVICE_TWEET, NULL, NULL, &tweet_reader },
+    { WEATHER_DEVICE_CHENNAI, DEVICE_WEATHER, "Chennai", NULL, &weather_reader },
+    { WEATHER_DEVICE_DELHI, DEVICE_WEATHER, "New%20Delhi", NULL, &weather_reader },
+    { WEATHER_DEVICE_LONDON, DEVICE_WEATHER, "London", NULL, &weather_reader },
+    { WEATHER_DEVICE_CHICAGO, DEVICE_WEATHER, "Chicago", NULL, &weather_reader },
+    { WEATHER_DEVICE_SFO, DEVICE_WEATHER, "San%20Francisco", NULL, &weather_reader },
+    { WEATHER_DEVICE_NY, DEVICE_WEATHER, "New%20York", NULL, &weather_reader },
+    { AIR_QUALITY_DEVICE_CHENNAI, DEVICE_AIR_QUALITY, "Chennai", "IN", &aq_reader },
+    { AIR_QUALITY_DEVICE_DELHI, DEVICE_AIR_QUALITY, "Delhi", "IN", &aq_reader },
+    { AIR_QUALITY_DEVICE_LONDON, DEVICE_AIR_QUALITY, "London", "GB", &aq_reader },
+    { AIR_QUALITY_DEVICE_CHICAGO, DEVICE_AIR_QUALITY, "Chicago-Naperville-Joliet", "US", &aq_reader },
+    { AIR_QUALITY_DEVICE_SFO, DEVICE_AIR_QUALITY, "San%20Francisco-Oakland-Fremont", "US", &aq_reader },
+    { AIR_QUALITY_DEVICE_NY, DEVICE_AIR_QUALITY, "New%20York-Northern%20New%20Jersey-Long%20Island", "US", &aq_reader },
+};
+
+#define NR_DEVICE_PORTS                 (sizeof(device_ports) / sizeof(device_ports[0]))
+
+static struct device_port *find_device_port(uint16_t port)
+{
+    for (unsigned int i = 0; i < NR_DEVICE_PORTS; i++) {
+        if (device_ports[i].port == port)
+            return &device_ports[i];
+    }
+    return NULL;
+}
+
+static struct blob *fetch_port(const struct device_port *dev)
+{
+    switch (dev->kind) {
+        case DEVICE_TWEET:
+            return fetch_latest_tweet();
+        case DEVICE_WEATHER:
+            return fetch_weather(dev->city);
+        case DEVICE_AIR_QUALITY:
+            return fetch_air_quality(dev->country, dev->city);
+        default:
+            return NULL;
+    }
+}
+
+/* A reference to the payload behind one of our device ports, or NULL if fetching it didn't work */
+static struct blob *device_fetch(const struct device_port *dev)
+{
+    struct timespec start, end;
+    struct blob *payload;
+    uint32_t latency_us;
+    int source;
+
+    /* The guest sees how long fetches took on the stats page, so a recording has that too */
+    if (replay_replaying()) {
+        payload = replay_payload(dev - device_ports, &source, &latency_us);
+    } else {
+        clock_gettime(CLOCK_MONOTONIC, &start);
+        payload = fetch_port(dev);
+        clock_gettime(CLOCK_MONOTONIC, &end);
+
+        source = fetch_last_source();
+        latency_us = (end.tv_sec - start.tv_sec) * 1000000 + (end.tv_nsec - start.tv_nsec) / 1000;
+        replay_note_payload(dev - device_ports, source, latency_us, payload);
+    }
+
+    stats_fetch(dev - device_ports, latency_us,
+                source == FETCH_FROM_MEMORY || source == FETCH_FROM_DISK,
+                !payload || source == FETCH_PLACEHOLDER, payload ? payload->len : 0);
+    return payload;
+}
+
+/* For the data page, which the guest never asked us for, so it isn't counted in the stats or reported on the console */
+static struct blob *fetch_for_datapage(unsigned int device)
+{
+    fetch_quietly();
+    return device < NR_DEVICE_PORTS ? fetch_port(&device_ports[device]) : NULL;
+}
+
+static void vcon_receive(struct virtio_console *vc, const uint8_t *data, size_t len)
+{
+    console_write(data, len);
+}
+
+/*
+ * Each buffer on the data channel is a request: the 16-bit port number of
+ * the device the guest wants to read. The whole payload goes back in one
+ * go, without the terminating NUL the port interface uses.
+ * */
+static void vdata_receive(struct virtio_console *vc, const uint8_t *data, size_t len)
+{
+    uint16_t port;
+    struct device_port *dev;
+    struct blob *payload = NULL;
+
+    if (len != sizeof(port))
+        return;
+    memcpy(&port, data, sizeof(port));
+
+    dev = find_device_port(port);
+    if (dev)
+        payload = device_fetch(dev);
+    if (!payload) {
+        static const char failed[] = "Fetching failed\n";
+        virtio_console_send(vc, failed, sizeof(failed) - 1);
+        return;
+    }
+    virtio_console_send(vc, payload->data, payload->len);
+    blob_put(payload);
+}
+
+/*
+ * Port handlers. Each gets the whole exit, so a rep ins or outs is one
+ * call however many bytes it moves.
+ *
+ * A device port hands out one byte of its payload per access, whatever
+ * the access's size, zero-extended to fill it: guests read it with
+ * in ax, dx and test all of ax for the NUL at the end.
+ * */
+static int device_port_in(void *opaque, uint16_t offset, void *data, unsigned int size, unsigned int count)
+{
+    struct device_port *dev = opaque;
+    struct port_reader *reader = dev->reader;
+    char *p = data;
+
+    stats_port_read(dev - device_ports);
+    memset(p, 0, size * count);
+    for (unsigned int i = 0; i < count; i++) {
+        if (reader->payload == NULL)
+            reader->payload = device_fetch(dev);
+        /* Even the placeholder didn't work out: the guest just gets an empty payload */
+        if (reader->payload == NULL)
+            continue;
+        p[i * size] = reader->payload->data[reader->idx++];
+        if (p[i * size] == '\0') {
+            blob_put(reader->payload);
+            reader->payload = NULL;
+            reader->idx = 0;
+        }
+    }
+    return 0;
+}
+
+static int timer_port_in(void *opaque, uint16_t offset, void *data, unsigned int size, unsigned int count)
+{
+    for (unsigned int i = 0; i < count; i++) {
+        uint32_t value = timer_read(opaque, offset);
+        memcpy((uint8_t *)data + i * size, &value, size);
+    }
+    return 0;
+}
+
+static int timer_port_out(void *opaque, uint16_t offset, const void *data, unsigned int size, unsigned int count)
+{
+    for (unsigned int i = 0; i < count; i++) {
+        uint32_t value = 0;
+        memcpy(&value, (const uint8_t *)data + i * size, size);
+        timer_write(opaque, offset, value);
+    }
+    return 0;
+}
+
+static int balloon_port_in(void *opaque, uint16_t offset, void *data, unsigned int size, unsigned int count)
+{
+    for (unsigned int i = 0; i < count; i++) {
+        uint32_t value = balloon_read(opaque, offset);
+        memcpy((uint8_t *)data + i * size, &value, size);
+    }
+    return 0;
+}
+
+static int balloon_port_out(void *opaque, uint16_t offset, const void *data, unsigned int size, unsigned int count)
+{
+    for (unsigned int i = 0; i < count; i++) {
+        uint32_t value = 0;
+        memcpy(&value, (const uint8_t *)data + i * size, size);
+        balloon_write(opaque, offset, value);
+    }
+    return 0;
+}
+
+/*
+ * The serial port carries most of our exits, so the run loop calls these
+ * directly rather than through the table. Its registers are a byte wide:
+ * each access, whatever its size, is one access to the register, reading
+ * it zero-extended or writing its low byte.
+ * */
+static inline int serial_in(struct uart *uart, uint16_t offset, uint8_t *data, unsigned int size, unsigned int count)
+{
+    memset(data, 0, size * count);
+    for (unsigned int i = 0; i < count; i++) {
+        int value = uart_read(uart, offset);
+        if (value < 0)
+            return value;
+        data[i * size] = value;
+    }
+    return 0;
+}
+
+static inline int serial_out(struct uart *uart, uint16_t offset, const uint8_t *data, unsigned int size, unsigned int count)
+{
+    if (offset == UART_THR && size == 1) {
+        uart_transmit(uart, data, count);
+        return 0;
+    }
+    for (unsigned int i = 0; i < count; i++)
+        uart_write(uart, offset, data[i * size]);
+    return 0;
+}
+
+static int serial_port_in(void *opaque, uint16_t offset, void *data, unsigned int size, unsigned int count)
+{
+    return serial_in(opaque, offset, data, size, count);
+}
+
+static int serial_port_out(void *opaque, uint16_t offset, const void *data, unsigned int size, unsigned int count)
+{
+    return serial_out(opaque, offset, data, size, count);
+}
+
+static void register_ports(void)
+{
+    ioport_register("serial", SERIAL_PORT, UART_NR_REGS, serial_port_in, serial_port_out, &com1);
+    ioport_register("timer", TIMER_PORT, TIMER_NR_REGS, timer_port_in, timer_port_out, &timer);
+    ioport_register("balloon", BALLOON_PORT, BALLOON_NR_REGS, balloon_port_in, balloon_port_out, &balloon);
+    for (unsigned int i = 0; i < NR_DEVICE_PORTS; i++)
+        ioport_register(device_names[device_ports[i].kind], device_ports[i].port, 1, device_port_in, NULL, &device_ports[i]);
+}
+
+/* Which of our IRQ lines are currently asserted, as a bitmap */
+static unsigned int irq_lines(void)
+{
+    unsigned int lines = 0;
+
+    if (timer_irq_pending(&timer))
+        lines |= 1 << TIMER_IRQ;
+    if (uart_irq_pending(&com1))
+        lines |= 1 << UART_IRQ;
+    if (virtio_mmio_irq_pending(&vcon.mmio))
+        lines |= 1 << VIRTIO_CONSOLE_IRQ;
+    if (virtio_mmio_irq_pending(&vdata.mmio))
+        lines |= 1 << VIRTIO_DATA_IRQ;
+    return lines;
+}
+
+/*
+ * We have no in-kernel irqchip (it would swallow the guest's final hlt), so
+ * interrupts are injected from here. Like the 8259's default mode, lines
+ * are edge triggered: an interrupt is delivered when a line goes from low
+ * to high, lowest line first, and guests loop on their device's interrupt
+ * status until it has nothing more to say.
+ * */
+/* What the guest sees at a guest physical address, to read its code by */
+static uint8_t *guest_mem;
+static struct rom *guest_rom;
+
+static int guest_code_byte(uint64_t gpa)
+{
+    if (guest_rom && gpa >= MONITOR_LOAD_ADDR && gpa < MONITOR_LOAD_ADDR + guest_rom->size)
+        return ((uint8_t *)guest_rom->addr)[gpa - MONITOR_LOAD_ADDR];
+    if (guest_rom && gpa >= MONITOR_LOAD_ADDR && gpa < MONITOR_LOAD_ADDR + MONITOR_ROM_SIZE)
+        return -1;
+    return gpa < GUEST_MEM_SIZE ? guest_mem[gpa] : -1;
+}
+
+/*
+ * Have the guest make the in it just exited on again when it next runs.
+ * KVM leaves RIP at the in until it finishes the exit, which is when it
+ * moves it on, and drops the exit instead if it finds RIP somewhere else
+ * by then. So RIP goes elsewhere for a KVM_RUN that doesn't run the guest,
+ * only finishes the exit off, and then comes back. Ports past 0xff can
+ * only be got at through DX, so the in is EC or ED, with a 66 prefix if
+ * it isn't the code segment's default size. Anything else, a string ins
+ * say, we can't take back like this, and return -1 for.
+ * */
+static int restart_in(int vcpufd, struct kvm_run *run)
+{
+    struct kvm_regs regs;
+    struct kvm_sregs sregs;
+    uint64_t ip;
+    int op, prefix = 0, wide;
+
+    if (run->io.port <= 0xff || run->io.count != 1
+        || ioctl(vcpufd, KVM_GET_REGS, &regs) == -1 || ioctl(vcpufd, KVM_GET_SREGS, &sregs) == -1)
+        return -1;
+    ip = sregs.cs.base + regs.rip;
+    op = guest_code_byte(ip);
+    if (op == 0x66) {
+        prefix = 1;
+        op = guest_code_byte(ip + 1);
+    }
+    wide = sregs.cs.db ? !prefix : prefix;
+    if (op == 0xec ? run->io.size != 1 : op != 0xed || run->io.size != (wide ? 4 : 2))
+        return -1;
+
+    /* The migration that got us here wants it set too, and clears it once it's done */
+    run->immediate_exit = 1;
+    regs.rip++;
+    if (ioctl(vcpufd, KVM_SET_REGS, &regs) == -1)
+        err(1, "KVM_SET_REGS");
+    if (ioctl(vcpufd, KVM_RUN, NULL) == -1 && errno != EINTR)
+        err(1, "KVM_RUN");
+    regs.rip--;
+    if (ioctl(vcpufd, KVM_SET_REGS, &regs) == -1)
+        err(1, "KVM_SET_REGS");
+    return 0;
+}
+
+static unsigned int irq_levels;
+static unsigned int irq_raised;
 
-/* Initialize new terminal i/o settings */
-void initTermios(int echo)
+static void update_interrupts(int vcpufd, struct kvm_run *run)
 {
-    tcgetattr(0, &old); /* grab old terminal i/o settings */
-    current = old; /* make new settings same as old settings */
-    current.c_lflag &= ~ICANON; /* disable buffered i/o */
-    if (echo) {
-        current.c_lflag |= ECHO; /* set echo mode */
+    unsigned int lines = irq_lines();
+
+    irq_raised |= lines & ~irq_levels;
+    irq_levels = lines;
+
+    if (!irq_raised) {
+        run->request_interrupt_window = 0;
+        return;
+    }
+
+    if (run->ready_for_interrupt_injection && run->if_flag) {
+        unsigned int line = __builtin_ctz(irq_raised);
+        struct kvm_interrupt irq = { .irq = IRQ_VECTOR(line) };
+        if (ioctl(vcpufd, KVM_INTERRUPT, &irq) == -1)
+            err(1, "KVM_INTERRUPT");
+        stats_interrupt();
+        irq_raised &= ~(1u << line);
+        run->request_interrupt_window = irq_raised != 0;
     } else {
-        current.c_lflag &= ~ECHO; /* set no echo mode */
+        /* Have KVM come back to us as soon as the guest can take it */
+        run->request_interrupt_window = 1;
     }
-    tcsetattr(0, TCSANOW, &current); /* use these new terminal i/o settings now */
 }
 
-/* Restore old terminal i/o settings */
-void resetTermios(void)
+/*
+ * The guest did a hlt with interrupts enabled, so it is idle until one of
+ * our devices has something for it: a key or the timer going off. Returns
+ * 0 if nothing ever will.
+ * */
+static int wait_for_interrupt(void)
 {
-    tcsetattr(0, TCSANOW, &old);
+    /* Played back, whatever woke the guest is in the recording already, or it never comes */
+    if (replay_replaying()) {
+        uart_receive(&com1);
+        if (!irq_lines())
+            return 0;
+    }
+
+    while (!irq_lines()) {
+        int timer_fd = timer_armed(&timer) ? timer.fd : -1;
+
+        /* Kicked to migrate: the guest just goes round its wait loop again, wherever it ends up */
+        if (migrate_pending())
+            return 1;
+        if (uart_rx_irq_enabled(&com1)) {
+            if (!console_wait_fd(timer_fd, -1) && timer_fd == -1)
+                return migrate_pending();
+            uart_receive(&com1);
+        } else if (timer_fd != -1) {
+            struct pollfd pfd = { .fd = timer_fd, .events = POLLIN };
+
+            console_flush();
+            poll(&pfd, 1, -1);
+        } else {
+            return 0;
+        }
+    }
+
+    /* Still high from before the hlt? Deliver it again rather than sleep for ever. */
+    irq_raised |= irq_lines();
+    return 1;
 }
 
-/* Read 1 character - echo defines echo mode */
-char getch_(int echo)
+/* What handling the exit the guest just made was, for the trace */
+static void trace_exit(const struct kvm_run *run, uint64_t start_ns)
 {
-    char ch;
-    initTermios(echo);
-    ch = getchar();
-    resetTermios();
-    return ch;
+    const char *name;
+
+    switch (run->exit_reason) {
+        case KVM_EXIT_IO:
+            name = ioport_name(run->io.port);
+            trace_record("exit", name ? name : "io", start_ns, trace_clock(), "port", run->io.port);
+            break;
+        case KVM_EXIT_MMIO:
+            trace_record("exit", "mmio", start_ns, trace_clock(), "addr", run->mmio.phys_addr);
+            break;
+        case KVM_EXIT_HLT:
+            trace_record("exit", "hlt", start_ns, trace_clock(), NULL, 0);
+            break;
+        default:
+            trace_record("exit", "exit", start_ns, trace_clock(), "reason", run->exit_reason);
+            break;
+    }
 }
 
-/* Read 1 character without echo */
-char getch(void)
+static void print_stats(void)
 {
-    return getch_(0);
+    pool_print_stats(stdout);
+    singleflight_print_stats(stdout);
+    diskcache_print_stats(stdout);
+    backend_print_stats(stdout);
+    migrate_print_stats(stdout);
+    lazymem_print_stats(stdout);
+    placement_print_stats(stdout);
+    rom_print_stats(stdout);
+    balloon_print_stats(&balloon, stdout);
+    replay_print_stats(stdout);
+    trace_print_stats(stdout);
 }
 
-/* Read 1 character with echo */
-char getche(void)
+/*
+ * Device state that goes along with a migrating guest. It's only ever
+ * read back by the same sparkler binary, so the structs go as they are.
+ * Any payload the guest is part way through reading on a device port
+ * follows, then whatever console input it hasn't read yet.
+ * */
+struct saved_devices {
+    struct uart com1;
+    struct timer_state timer;
+    struct balloon_state balloon;
+    struct virtio_mmio_state vcon;
+    struct virtio_mmio_state vdata;
+    uint32_t irq_levels;
+    uint32_t irq_raised;
+    uint32_t tweet_len;         /* what's left of each payload, its NUL included, or 0 */
+    uint32_t weather_len;
+    uint32_t aq_len;
+    uint32_t input_len;
+};
+
+/* What's left of the payload the guest is part way through reading, its NUL included, or 0 */
+static uint32_t payload_left(const struct port_reader *reader)
 {
-    return getch_(1);
+    return reader->payload ? reader->payload->len + 1 - reader->idx : 0;
+}
+
+static uint32_t save_payload(uint8_t **p, struct port_reader *reader)
+{
+    uint32_t len = payload_left(reader);
+
+    if (!len)
+        return 0;
+    memcpy(*p, reader->payload->data + reader->idx, len);
+    *p += len;
+    return len;
+}
+
+static void *save_devices(size_t *len)
+{
+    struct saved_devices *saved;
+    uint8_t *p;
+
+    /* Payloads aren't all report-sized: a tweet is as long as the service made it */
+    saved = pool_zalloc(sizeof(*saved) + payload_left(&tweet_reader) + payload_left(&weather_reader)
+                        + payload_left(&aq_reader) + CONSOLE_RING_SIZE);
+    if (!saved)
+        return NULL;
+    saved->com1 = com1;
+    timer_save(&timer, &saved->timer);
+    balloon_save(&balloon, &saved->balloon);
+    virtio_mmio_save(&vcon.mmio, &saved->vcon);
+    virtio_mmio_save(&vdata.mmio, &saved->vdata);
+    saved->irq_levels = irq_levels;
+    saved->irq_raised = irq_raised;
+
+    p = (uint8_t *)(saved + 1);
+    saved->tweet_len = save_payload(&p, &tweet_reader);
+    saved->weather_len = save_payload(&p, &weather_reader);
+    saved->aq_len = save_payload(&p, &aq_reader);
+    saved->input_len = console_save_input(p, CONSOLE_RING_SIZE);
+    *len = p + saved->input_len - (uint8_t *)saved;
+    return saved;
+}
+
+static int load_payload(const uint8_t **p, uint32_t len, struct port_reader *reader)
+{
+    if (!len)
+        return 0;
+    if ((*p)[len - 1] != '\0' || !(reader->payload = blob_from(*p, len - 1)))
+        return -1;
+    reader->idx = 0;
+    *p += len;
+    return 0;
+}
+
+static int load_devices(const void *data, size_t len)
+{
+    const struct saved_devices *saved = data;
+    const uint8_t *p = (const uint8_t *)(saved + 1);
+
+    if (len < sizeof(*saved) || len != sizeof(*saved) + (size_t)saved->tweet_len + saved->weather_len
+                                      + saved->aq_len + saved->input_len)
+        return -1;
+    com1 = saved->com1;
+    timer_load(&timer, &saved->timer);
+    balloon_load(&balloon, &saved->balloon);
+    virtio_mmio_load(&vcon.mmio, &saved->vcon);
+    virtio_mmio_load(&vdata.mmio, &saved->vdata);
+    irq_levels = saved->irq_levels;
+    irq_raised = saved->irq_raised;
+
+    if (load_payload(&p, saved->tweet_len, &tweet_reader) == -1
+        || load_payload(&p, saved->weather_len, &weather_reader) == -1
+        || load_payload(&p, saved->aq_len, &aq_reader) == -1)
+        return -1;
+    console_load_input(p, saved->input_len);
+    return 0;
 }
 
 int main(void)
@@ -88,6 +633,14 @@ int main(void)
     struct kvm_sregs sregs;
     size_t mmap_size;
     struct kvm_run *run;
+    uint64_t entered, exited;
+
+    /* Pin ourselves, the thread that runs vCPU 0, before guest RAM gets allocated and faulted in */
+    placement_init();
+    placement_pin_vcpu(0);
+    replay_init();
+    trace_init();
+    trace_thread_name("vcpu 0");
 
     kvm = open("/dev/kvm", O_RDWR | O_CLOEXEC);
     if (kvm == -1)
@@ -97,28 +650,70 @@ int main(void)
     if (vmfd == -1)
         err(1, "KVM_CREATE_VM");
 
-    /* Allocate one aligned page of guest memory to hold the code. */
-    mem = mmap(NULL, 0x8000, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+    /* Allocate guest memory for the interrupt vector table, our code, data and stack. */
+    mem = placement_alloc_guest_mem(GUEST_MEM_SIZE);
     if (!mem)
         err(1, "allocating guest memory");
 
-    /* Read our monitor program into RAM */
-    int fd = open("monitor", O_RDONLY);
+    /*
+     * Read our monitor program, or whichever guest we've been asked to run
+     * instead, into RAM. With demand paging it's left where it is until the
+     * guest gets to it, so the image has to stay open.
+     * */
+    const char *guest = getenv("SPARKLER_GUEST");
+    if (!guest)
+        guest = "monitor";
+    int fd = open(guest, O_RDONLY);
     if (fd == -1)
         err(1, "Unable to open stub");
     struct stat st;
     fstat(fd, &st);
-    read(fd, mem, st.st_size);
 
-    struct kvm_userspace_memory_region region = {
-            .slot = 0,
-            .guest_phys_addr = 0x1000,
-            .memory_size = 0x8000,
-            .userspace_addr = (uint64_t)mem,
+    const char *use_rom = getenv("SPARKLER_ROM");
+    struct rom *rom = NULL;
+    if (!(use_rom && strcmp(use_rom, "0") == 0) && st.st_size <= MONITOR_ROM_SIZE) {
+        rom = rom_open(fd);
+        if (!rom || rom_map(rom, vmfd, MONITOR_ROM_SLOT, MONITOR_LOAD_ADDR) == -1) {
+            warn("mapping %s read-only, so it's going in RAM", guest);
+            rom = NULL;
+        }
+    }
+    guest_mem = mem;
+    guest_rom = rom;
+
+    if (lazymem_init(mem, GUEST_MEM_SIZE) == 0) {
+        if (!rom && lazymem_add(MONITOR_LOAD_ADDR, fd, 0, st.st_size) == -1)
+            errx(1, "%s doesn't fit in guest memory", guest);
+        lazymem_start();
+    } else if (!rom) {
+        read(fd, mem + MONITOR_LOAD_ADDR, st.st_size);
+    }
+
+    /* RAM goes around the ROM if there is one. The part of mem behind the ROM is never touched. */
+    struct kvm_userspace_memory_region regions[2] = {
+            {
+                    .slot = LOW_RAM_SLOT,
+                    .guest_phys_addr = 0,
+                    .memory_size = rom ? MONITOR_LOAD_ADDR : GUEST_MEM_SIZE,
+                    .userspace_addr = (uint64_t)mem,
+            },
+            {
+                    .slot = HIGH_RAM_SLOT,
+                    .guest_phys_addr = MONITOR_LOAD_ADDR + MONITOR_ROM_SIZE,
+                    .memory_size = GUEST_MEM_SIZE - (MONITOR_LOAD_ADDR + MONITOR_ROM_SIZE),
+                    .userspace_addr = (uint64_t)mem + MONITOR_LOAD_ADDR + MONITOR_ROM_SIZE,
+            },
     };
-    ret = ioctl(vmfd, KVM_SET_USER_MEMORY_REGION, &region);
-    if (ret == -1)
-        err(1, "KVM_SET_USER_MEMORY_REGION");
+    unsigned int nr_regions = rom ? 2 : 1;
+    for (unsigned int i = 0; i < nr_regions; i++) {
+        ret = ioctl(vmfd, KVM_SET_USER_MEMORY_REGION, &regions[i]);
+        if (ret == -1)
+            err(1, "KVM_SET_USER_MEMORY_REGION");
+    }
+
+    /* Counters and device payloads the guest can read for itself, on pages of their own */
+    stats_init(vmfd);
+    datapage_init(vmfd);
 
     vcpufd = ioctl(vmfd, KVM_CREATE_VCPU, (unsigned long)0);
     if (vcpufd == -1)
@@ -156,6 +751,9 @@ int main(void)
             __get_cpuid(0x80000003, &cpuid->entries[i].eax, &cpuid->entries[i].ebx, &cpuid->entries[i].ecx, &cpuid->entries[i].edx);
         if (cpuid->entries[i].function == 0x80000004)
             __get_cpuid(0x80000004, &cpuid->entries[i].eax, &cpuid->entries[i].ebx, &cpuid->entries[i].ecx, &cpuid->entries[i].edx);
+        /* The guest's clock is the one thing a recording can't play back, so it doesn't get one */
+        if (cpuid->entries[i].function == KVM_CPUID_FEATURES && (replay_recording() || replay_replaying()))
+            cpuid->entries[i].eax &= ~((1 << KVM_FEATURE_CLOCKSOURCE) | (1 << KVM_FEATURE_CLOCKSOURCE2));
     }
 
     ret = ioctl(vcpufd, KVM_SET_CPUID2, cpuid);
@@ -178,139 +776,117 @@ int main(void)
     /* Initialize registers: instruction pointer for our code, addends, and
      * initial flags required by x86 architecture. */
     struct kvm_regs regs = {
-            .rip = 0x1000,
+            .rip = MONITOR_LOAD_ADDR,
             .rflags = 0x2,
     };
     ret = ioctl(vcpufd, KVM_SET_REGS, &regs);
     if (ret == -1)
         err(1, "KVM_SET_REGS");
 
-    char *latest_tweet      = NULL;
-    char *weather_forecast  = NULL;
-    char *aq_report         = NULL;
-    int tweet_str_idx       = 0;
-    int weather_str_idx     = 0;
-    int aq_str_idx          = 0;
+    /* The terminal stays in raw mode from here until we exit */
+    console_init();
+    uart_init(&com1);
+    timer_init(&timer);
+    balloon_init(&balloon, mem, GUEST_MEM_SIZE);
+    register_ports();
+    virtio_console_init(&vcon, VIRTIO_CONSOLE_BASE, VIRTIO_CONSOLE_IRQ,
+                        mem, GUEST_MEM_SIZE, vcon_receive, NULL);
+    virtio_console_init(&vdata, VIRTIO_DATA_BASE, VIRTIO_DATA_IRQ,
+                        mem, GUEST_MEM_SIZE, vdata_receive, NULL);
+    /* Behind the ROM, mem is nothing the guest sees, so the devices mustn't use it */
+    if (rom) {
+        balloon_exclude(&balloon, MONITOR_LOAD_ADDR, MONITOR_ROM_SIZE);
+        virtio_mmio_exclude(&vcon.mmio, MONITOR_LOAD_ADDR, MONITOR_ROM_SIZE);
+        virtio_mmio_exclude(&vdata.mmio, MONITOR_LOAD_ADDR, MONITOR_ROM_SIZE);
+    }
+
+    /* Either pick up a guest that is migrating in, or be ready to send ours elsewhere */
+    struct migrate_vm vm = {
+            .vmfd = vmfd,
+            .vcpufd = vcpufd,
+            .run = run,
+            .nr_regions = nr_regions,
+            .mem_size = GUEST_MEM_SIZE,
+            .mem = mem,
+            .save_devices = save_devices,
+            .load_devices = load_devices,
+    };
+    memcpy(vm.regions, regions, nr_regions * sizeof(regions[0]));
+    migrate_init(&vm);
+    migrate_in();
+
+    /* Whatever the last run fetched can be served before we go to the network; we manage without it */
+    diskcache_open(DISKCACHE_FILE);
+    if (!replay_recording() && !replay_replaying())
+        datapage_start(fetch_for_datapage);
 
     /* Run the VM while handling any exits for device emulation */
     while (1) {
+        if (migrate_pending() && migrate_out() == 0) {
+            puts("\nMigrated");
+            print_stats();
+            return 0;
+        }
+        update_interrupts(vcpufd, run);
+        entered = trace_now();
         ret = ioctl(vcpufd, KVM_RUN, NULL);
+        trace_span("kvm", "KVM_RUN", entered, NULL, 0);
+        if (ret == -1 && errno == EINTR)
+            continue;
         if (ret == -1)
             err(1, "KVM_RUN");
+        stats_exit(run->exit_reason);
+        exited = trace_now();
         switch (run->exit_reason) {
             case KVM_EXIT_HLT:
+                if (run->if_flag && wait_for_interrupt())
+                    break;
                 puts("KVM_EXIT_HLT");
+                print_stats();
                 return 0;
-            case KVM_EXIT_IO:
-                if (run->io.direction == KVM_EXIT_IO_OUT) {
-                    switch (run->io.port) {
-                        case SERIAL_PORT:
-                            putchar(*(((char *)run) + run->io.data_offset));
+            case KVM_EXIT_IRQ_WINDOW_OPEN:
+                /* The pending interrupt goes in at the top of the loop */
+                break;
+            case KVM_EXIT_IO: {
+                uint8_t *data = (uint8_t *)run + run->io.data_offset;
+                uint16_t offset = run->io.port - SERIAL_PORT;
+
+                if (offset < UART_NR_REGS) {
+                    if (run->io.direction == KVM_EXIT_IO_OUT) {
+                        ret = serial_out(&com1, offset, data, run->io.size, run->io.count);
+                    } else {
+                        /*
+                         * A migration got under way while the guest waited for
+                         * a key: it reads again once it's been moved, wherever
+                         * it ends up. A read we can't take back just waits for
+                         * its key, as reads always did.
+                         * */
+                        while ((ret = serial_in(&com1, offset, data, run->io.size, run->io.count)) == CONSOLE_INTERRUPTED
+                               && restart_in(vcpufd, run) == -1)
+                            ;
+                        if (ret == CONSOLE_INTERRUPTED)
                             break;
-                        default:
-                            printf("Port: 0x%x\n", run->io.port);
-                            errx(1, "unhandled KVM_EXIT_IO");
                     }
                 } else {
-                    /* KVM_EXIT_IO_IN */
-                    switch (run->io.port) {
-                        case SERIAL_PORT:
-                            *(((char *)run) + run->io.data_offset) = getche();
-                            break;
-                        case TWITTER_DEVICE:
-                            if (latest_tweet == NULL)
-                                latest_tweet = fetch_latest_tweet();
-                            char tweet_chr = *(latest_tweet + tweet_str_idx);
-                            *(((char *)run) + run->io.data_offset) = tweet_chr;
-                            tweet_str_idx++;
-                            if (tweet_chr == '\0') {
-                                free(latest_tweet);
-                                latest_tweet = NULL;
-                                tweet_str_idx = 0;
-                            }
-                            break;
-                        case WEATHER_DEVICE_CHENNAI:
-                        case WEATHER_DEVICE_DELHI:
-                        case WEATHER_DEVICE_LONDON:
-                        case WEATHER_DEVICE_CHICAGO:
-                        case WEATHER_DEVICE_SFO:
-                        case WEATHER_DEVICE_NY:
-                            if (weather_forecast == NULL) {
-                                char city[64];
-                                if (run->io.port == WEATHER_DEVICE_CHENNAI)
-                                    strncpy(city, "Chennai", sizeof(city));
-                                else if (run->io.port == WEATHER_DEVICE_DELHI)
-                                    strncpy(city, "New%20Delhi", sizeof(city));
-                                else if (run->io.port == WEATHER_DEVICE_LONDON)
-                                    strncpy(city, "London", sizeof(city));
-                                else if (run->io.port == WEATHER_DEVICE_CHICAGO)
-                                    strncpy(city, "Chicago", sizeof(city));
-                                else if (run->io.port == WEATHER_DEVICE_SFO)
-                                    strncpy(city, "San%20Francisco", sizeof(city));
-                                else if (run->io.port == WEATHER_DEVICE_NY)
-                                    strncpy(city, "New%20York", sizeof(city));
-
-                                weather_forecast = fetch_weather(city);
-                            }
-                            char weather_chr = *(weather_forecast + weather_str_idx);
-                            *(((char *)run) + run->io.data_offset) = weather_chr;
-                            weather_str_idx++;
-                            if (weather_chr == '\0') {
-                                free(weather_forecast);
-                                weather_forecast = NULL;
-                                weather_str_idx = 0;
-                            }
-                            break;
-                        case AIR_QUALITY_DEVICE_CHENNAI:
-                        case AIR_QUALITY_DEVICE_DELHI:
-                        case AIR_QUALITY_DEVICE_LONDON:
-                        case AIR_QUALITY_DEVICE_CHICAGO:
-                        case AIR_QUALITY_DEVICE_SFO:
-                        case AIR_QUALITY_DEVICE_NY:
-                            if (aq_report == NULL) {
-                                char city[64];
-                                char country[3];
-                                if (run->io.port == AIR_QUALITY_DEVICE_CHENNAI) {
-                                    strncpy(city, "Chennai", sizeof(city));
-                                    strncpy(country, "IN", sizeof(country));
-                                }
-                                else if (run->io.port == AIR_QUALITY_DEVICE_DELHI) {
-                                    strncpy(city, "Delhi", sizeof(city));
-                                    strncpy(country, "IN", sizeof(country));
-                                }
-                                else if (run->io.port == AIR_QUALITY_DEVICE_LONDON) {
-                                    strncpy(city, "London", sizeof(city));
-                                    strncpy(country, "GB", sizeof(country));
-                                }
-                                else if (run->io.port == AIR_QUALITY_DEVICE_CHICAGO) {
-                                    strncpy(city, "Chicago-Naperville-Joliet", sizeof(city));
-                                    strncpy(country, "US", sizeof(country));
-                                }
-                                else if (run->io.port == AIR_QUALITY_DEVICE_SFO) {
-                                    strncpy(city, "San%20Francisco-Oakland-Fremont", sizeof(city));
-                                    strncpy(country, "US", sizeof(country));
-                                }
-                                else if (run->io.port == AIR_QUALITY_DEVICE_NY) {
-                                    strncpy(city, "New%20York-Northern%20New%20Jersey-Long%20Island", sizeof(city));
-                                    strncpy(country, "US", sizeof(country));
-                                }
-                                aq_report = fetch_air_quality(country, city);
-                            }
-                            char aq_chr = *(aq_report + aq_str_idx);
-                            *(((char *)run) + run->io.data_offset) = aq_chr;
-                            aq_str_idx++;
-                            if (aq_chr == '\0') {
-                                free(aq_report);
-                                aq_report = NULL;
-                                aq_str_idx = 0;
-                            }
-                            break;
-                        default:
-                            printf("Port: 0x%x\n", run->io.port);
-                            errx(1, "unhandled KVM_EXIT_IO");
-                    }
+                    ret = ioport_dispatch(run);
                 }
-
+                if (ret != -1)
+                    replay_exit_io(run);
+                if (ret == -1) {
+                    puts("\nEnd of console input");
+                    print_stats();
+                    return 0;
+                }
+                break;
+            }
+            case KVM_EXIT_MMIO:
+                if (!virtio_mmio_access(&vcon.mmio, run->mmio.phys_addr, run->mmio.data,
+                                        run->mmio.len, run->mmio.is_write)
+                    && !virtio_mmio_access(&vdata.mmio, run->mmio.phys_addr, run->mmio.data,
+                                           run->mmio.len, run->mmio.is_write)
+                    && !stats_mmio(run->mmio.phys_addr)
+                    && !datapage_mmio(run->mmio.phys_addr))
+                    errx(1, "unhandled KVM_EXIT_MMIO at 0x%llx", (unsigned long long)run->mmio.phys_addr);
                 break;
             case KVM_EXIT_FAIL_ENTRY:
                 errx(1, "KVM_EXIT_FAIL_ENTRY: hardware_entry_failure_reason = 0x%llx",
@@ -320,6 +896,8 @@ int main(void)
             default:
                 errx(1, "exit_reason = 0x%x", run->exit_reason);
         }
+        if (trace_on)
+            trace_exit(run, exited);
     }
 }
 
@@ -0,0 +1,642 @@
+#define _GNU_SOURCE
+#include <err.h>
+#include <errno.h>
+#include <netdb.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <pthread.h>
+#include <signal.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/ioctl.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <time.h>
+#include <unistd.h>
+#include "migrate.h"
+#include "placement.h"
+#include "pool.h"
+
+#define MSR_IA32_TSC            0x10
+#define MSR_KVM_SYSTEM_TIME_NEW 0x4b564d01
+
+/* The guest's device state is never anywhere near this big; anything bigger is a broken stream */
+#define MIGRATE_MAX_DEVICES     (1024 * 1024)
+
+#define BITS_PER_LONG           (8 * sizeof(unsigned long))
+
+static struct migrate_vm *vm;
+static const char *dest_addr;
+static pthread_t vcpu_thread;
+
+static uint64_t nr_pages;
+static size_t bitmap_longs;
+static unsigned long *dirty;            /* pages dirtied since we last sent them */
+static unsigned long *kvm_dirty;        /* what KVM_GET_DIRTY_LOG hands back */
+static unsigned long *user_dirty;       /* pages our own device emulation wrote to */
+static int logging;
+
+static int sock = -1;
+static uint8_t out_buf[64 * 1024];
+static size_t out_len;
+
+/*
+ * pending tells the vCPU thread to stop the guest and finish migrating.
+ * The migration thread keeps kicking it until it has stopped, then waits
+ * for it to clear pending again, whichever way the migration went.
+ * */
+static pthread_mutex_t migrate_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t migrate_cond = PTHREAD_COND_INITIALIZER;
+static int pending;
+static int stopped;
+
+static struct migrate_stats stats;
+
+static int write_all(int fd, const void *buf, size_t len)
+{
+    const uint8_t *p = buf;
+
+    while (len) {
+        ssize_t n = write(fd, p, len);
+
+        if (n == -1 && errno == EINTR)
+            continue;
+        if (n <= 0)
+            return -1;
+        p += n;
+        len -= n;
+    }
+    return 0;
+}
+
+static int read_all(int fd, void *buf, size_t len)
+{
+    uint8_t *p = buf;
+
+    while (len) {
+        ssize_t n = read(fd, p, len);
+
+        if (n == -1 && errno == EINTR)
+            continue;
+        if (n <= 0)
+            return -1;
+        p += n;
+        len -= n;
+    }
+    return 0;
+}
+
+static int flush_records(void)
+{
+    int ret = write_all(sock, out_buf, out_len);
+
+    out_len = 0;
+    return ret;
+}
+
+/* Queue up a record, sending what we have first if there's no room for it */
+static int put_record(uint32_t type, uint64_t addr, const void *data, uint32_t len)
+{
+    struct migrate_record rec = { .type = type, .len = len, .addr = addr };
+
+    if (out_len + sizeof(rec) + len > sizeof(out_buf) && flush_records() == -1)
+        return -1;
+    if (sizeof(rec) + len > sizeof(out_buf))
+        return write_all(sock, &rec, sizeof(rec)) || write_all(sock, data, len) ? -1 : 0;
+
+    memcpy(out_buf + out_len, &rec, sizeof(rec));
+    memcpy(out_buf + out_len + sizeof(rec), data, len);
+    out_len += sizeof(rec) + len;
+    return 0;
+}
+
+/* Resolve host:port for TCP, or anything else as a Unix socket path */
+static int resolve(const char *addr, int passive, struct sockaddr_storage *sa, socklen_t *sa_len)
+{
+    const char *colon = strrchr(addr, ':');
+    struct addrinfo hints = { .ai_socktype = SOCK_STREAM, .ai_flags = passive ? AI_PASSIVE : 0 };
+    struct addrinfo *res;
+    char host[256];
+
+    if (!colon || strchr(addr, '/')) {
+        struct sockaddr_un *sun = (struct sockaddr_un *)sa;
+
+        if (strlen(addr) >= sizeof(sun->sun_path))
+            return -1;
+        memset(sun, 0, sizeof(*sun));
+        sun->sun_family = AF_UNIX;
+        strcpy(sun->sun_path, addr);
+        *sa_len = sizeof(*sun);
+        return 0;
+    }
+
+    if ((size_t)(colon - addr) >= sizeof(host))
+        return -1;
+    memcpy(host, addr, colon - addr);
+    host[colon - addr] = '\0';
+    if (getaddrinfo(host[0] ? host : NULL, colon + 1, &hints, &res) != 0)
+        return -1;
+    memcpy(sa, res->ai_addr, res->ai_addrlen);
+    *sa_len = res->ai_addrlen;
+    freeaddrinfo(res);
+    return 0;
+}
+
+static int open_socket(const struct sockaddr_storage *sa)
+{
+    int fd = socket(sa->ss_family, SOCK_STREAM | SOCK_CLOEXEC, 0);
+    int one = 1;
+
+    if (fd != -1 && sa->ss_family != AF_UNIX)
+        setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+    return fd;
+}
+
+static int connect_to(const char *addr)
+{
+    struct sockaddr_storage sa;
+    socklen_t sa_len;
+    int fd;
+
+    if (resolve(addr, 0, &sa, &sa_len) == -1) {
+        errno = EINVAL;
+        return -1;
+    }
+    fd = open_socket(&sa);
+    if (fd == -1)
+        return -1;
+    if (connect(fd, (struct sockaddr *)&sa, sa_len) == -1) {
+        close(fd);
+        return -1;
+    }
+    return fd;
+}
+
+/* Wait for a source to connect to addr, and return that connection */
+static int accept_from(const char *addr)
+{
+    struct sockaddr_storage sa;
+    socklen_t sa_len;
+    int fd, conn, one = 1;
+
+    if (resolve(addr, 1, &sa, &sa_len) == -1)
+        errx(1, "SPARKLER_MIGRATE_FROM: bad address \"%s\"", addr);
+    fd = open_socket(&sa);
+    if (fd == -1)
+        err(1, "socket");
+    if (sa.ss_family == AF_UNIX)
+        unlink(((struct sockaddr_un *)&sa)->sun_path);
+    else
+        setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, &one, sizeof(one));
+    if (bind(fd, (struct sockaddr *)&sa, sa_len) == -1 || listen(fd, 1) == -1)
+        err(1, "listening on %s", addr);
+
+    printf("Waiting for a guest to migrate in on %s\n", addr);
+    fflush(stdout);
+    while ((conn = accept4(fd, NULL, NULL, SOCK_CLOEXEC)) == -1 && errno == EINTR)
+        ;
+    if (conn == -1)
+        err(1, "accept");
+    close(fd);
+    if (sa.ss_family == AF_UNIX)
+        unlink(((struct sockaddr_un *)&sa)->sun_path);
+    return conn;
+}
+
+/*
+ * KVM only sees what the guest writes. Device emulation writes to guest
+ * memory behind its back, so it tells us about that here, and we send
+ * those pages again along with the ones KVM reports.
+ * */
+void migrate_note_dirty(uint64_t gpa, uint64_t len)
+{
+    if (!__atomic_load_n(&logging, __ATOMIC_ACQUIRE) || !len || gpa >= nr_pages * MIGRATE_PAGE_SIZE)
+        return;
+
+    for (uint64_t page = gpa / MIGRATE_PAGE_SIZE;
+         page <= (gpa + len - 1) / MIGRATE_PAGE_SIZE && page < nr_pages; page++)
+        __atomic_fetch_or(&user_dirty[page / BITS_PER_LONG], 1UL << (page % BITS_PER_LONG), __ATOMIC_RELAXED);
+}
+
+static int set_logging(int on)
+{
+    for (unsigned int i = 0; i < vm->nr_regions; i++) {
+        struct kvm_userspace_memory_region region = vm->regions[i];
+
+        region.flags |= on ? KVM_MEM_LOG_DIRTY_PAGES : 0;
+        if (ioctl(vm->vmfd, KVM_SET_USER_MEMORY_REGION, &region) == -1)
+            return -1;
+    }
+    __atomic_store_n(&logging, on, __ATOMIC_RELEASE);
+    return 0;
+}
+
+static void set_dirty(uint64_t page)
+{
+    dirty[page / BITS_PER_LONG] |= 1UL << (page % BITS_PER_LONG);
+}
+
+/* Add the pages dirtied since last time to the dirty bitmap, and return how many it has */
+static int collect_dirty(unsigned long *count)
+{
+    for (unsigned int r = 0; r < vm->nr_regions; r++) {
+        struct kvm_dirty_log log = { .slot = vm->regions[r].slot, .dirty_bitmap = kvm_dirty };
+        uint64_t first = vm->regions[r].guest_phys_addr / MIGRATE_PAGE_SIZE;
+        uint64_t pages = vm->regions[r].memory_size / MIGRATE_PAGE_SIZE;
+
+        if (ioctl(vm->vmfd, KVM_GET_DIRTY_LOG, &log) == -1)
+            return -1;
+
+        /* KVM's bitmap starts at the slot, ours at guest physical 0 */
+        for (uint64_t page = 0; page < pages; page++) {
+            if (kvm_dirty[page / BITS_PER_LONG] & (1UL << (page % BITS_PER_LONG)))
+                set_dirty(first + page);
+        }
+    }
+
+    *count = 0;
+    for (size_t i = 0; i < bitmap_longs; i++) {
+        dirty[i] |= __atomic_exchange_n(&user_dirty[i], 0, __ATOMIC_RELAXED);
+        *count += __builtin_popcountl(dirty[i]);
+    }
+    return 0;
+}
+
+/* Queue up every page in the dirty bitmap, clearing it as we go */
+static int send_dirty(unsigned long *sent)
+{
+    for (size_t i = 0; i < bitmap_longs; i++) {
+        while (dirty[i]) {
+            uint64_t page = i * BITS_PER_LONG + __builtin_ctzl(dirty[i]);
+
+            dirty[i] &= dirty[i] - 1;
+            if (put_record(MIGRATE_PAGE, page * MIGRATE_PAGE_SIZE,
+                           vm->mem + page * MIGRATE_PAGE_SIZE, MIGRATE_PAGE_SIZE) == -1)
+                return -1;
+            (*sent)++;
+        }
+    }
+    return 0;
+}
+
+static void abandon(void)
+{
+    if (logging)
+        set_logging(0);
+    memset(dirty, 0, bitmap_longs * sizeof(unsigned long));
+    memset(user_dirty, 0, bitmap_longs * sizeof(unsigned long));
+    if (sock != -1)
+        close(sock);
+    sock = -1;
+    out_len = 0;
+}
+
+/* Send guest RAM over and over while the guest runs, until what's left is small enough to stop for */
+static int precopy(void)
+{
+    struct migrate_hello hello = {
+            .magic = MIGRATE_MAGIC,
+            .version = MIGRATE_VERSION,
+            .mem_size = vm->mem_size,
+    };
+    unsigned long count;
+
+    sock = connect_to(dest_addr);
+    if (sock == -1) {
+        warn("migrating to %s", dest_addr);
+        return -1;
+    }
+    stats.rounds = 0;
+    stats.pages = 0;
+    if (put_record(MIGRATE_HELLO, 0, &hello, sizeof(hello)) == -1 || set_logging(1) == -1)
+        goto error_exit;
+
+    /* All of RAM is dirty to begin with, and whatever the guest writes from here on gets logged */
+    for (unsigned int r = 0; r < vm->nr_regions; r++) {
+        uint64_t first = vm->regions[r].guest_phys_addr / MIGRATE_PAGE_SIZE;
+
+        for (uint64_t page = 0; page < vm->regions[r].memory_size / MIGRATE_PAGE_SIZE; page++)
+            set_dirty(first + page);
+    }
+
+    while (1) {
+        if (send_dirty(&stats.pages) == -1 || flush_records() == -1)
+            goto error_exit;
+        stats.rounds++;
+        if (collect_dirty(&count) == -1)
+            goto error_exit;
+        if (count <= MIGRATE_MAX_STOP_PAGES || stats.rounds >= MIGRATE_MAX_ROUNDS)
+            return 0;
+    }
+
+error_exit:
+    warn("migrating to %s", dest_addr);
+    abandon();
+    return -1;
+}
+
+static void kick(int sig)
+{
+    /* Nothing to do: being interrupted is the whole point */
+}
+
+static void *migrate_thread(void *arg)
+{
+    sigset_t set;
+    int sig;
+
+    placement_io_thread();
+    sigemptyset(&set);
+    sigaddset(&set, SIGUSR1);
+
+    while (sigwait(&set, &sig) == 0) {
+        if (precopy() == -1)
+            continue;
+
+        /*
+         * Get the vCPU thread to stop the guest and finish up. It may be in
+         * KVM_RUN, which immediate_exit takes care of, or waiting for input,
+         * where only a signal gets its attention; keep at it until it hears.
+         * */
+        pthread_mutex_lock(&migrate_lock);
+        __atomic_store_n(&pending, 1, __ATOMIC_RELEASE);
+        vm->run->immediate_exit = 1;
+        while (pending) {
+            struct timespec deadline;
+
+            if (!stopped)
+                pthread_kill(vcpu_thread, SIGUSR2);
+            clock_gettime(CLOCK_REALTIME, &deadline);
+            deadline.tv_nsec += 10 * 1000 * 1000;
+            if (deadline.tv_nsec >= 1000000000) {
+                deadline.tv_sec++;
+                deadline.tv_nsec -= 1000000000;
+            }
+            pthread_cond_timedwait(&migrate_cond, &migrate_lock, &deadline);
+        }
+        pthread_mutex_unlock(&migrate_lock);
+    }
+    return NULL;
+}
+
+/*
+ * Get ready to migrate vm, in either direction. This has to be called on
+ * the vCPU thread before any other threads are started, so they all leave
+ * SIGUSR1 to the migration thread.
+ * */
+void migrate_init(struct migrate_vm *migrate_vm)
+{
+    struct sigaction sa = { .sa_handler = kick };
+    pthread_t thread;
+    sigset_t set;
+
+    vm = migrate_vm;
+    nr_pages = (vm->mem_size + MIGRATE_PAGE_SIZE - 1) / MIGRATE_PAGE_SIZE;
+    bitmap_longs = (nr_pages + BITS_PER_LONG - 1) / BITS_PER_LONG;
+
+    dest_addr = getenv("SPARKLER_MIGRATE_TO");
+    if (!dest_addr)
+        return;
+
+    dirty = calloc(bitmap_longs, sizeof(unsigned long));
+    kvm_dirty = calloc(bitmap_longs, sizeof(unsigned long));
+    user_dirty = calloc(bitmap_longs, sizeof(unsigned long));
+    if (!dirty || !kvm_dirty || !user_dirty)
+        err(1, "allocating dirty page bitmaps");
+
+    /* No SA_RESTART: a kick has to get the vCPU thread out of whatever it's blocked in */
+    sigemptyset(&sa.sa_mask);
+    if (sigaction(SIGUSR2, &sa, NULL) == -1)
+        err(1, "sigaction");
+
+    sigemptyset(&set);
+    sigaddset(&set, SIGUSR1);
+    pthread_sigmask(SIG_BLOCK, &set, NULL);
+
+    vcpu_thread = pthread_self();
+    if (pthread_create(&thread, NULL, migrate_thread, NULL) != 0)
+        errx(1, "starting the migration thread");
+    pthread_detach(thread);
+}
+
+/* Whether the vCPU thread should stop the guest and call migrate_out() */
+int migrate_pending(void)
+{
+    return __atomic_load_n(&pending, __ATOMIC_ACQUIRE);
+}
+
+static int save_vcpu(struct migrate_vcpu *state)
+{
+    struct {
+        struct kvm_msrs info;
+        struct kvm_msr_entry entries[2];
+    } msrs = {
+            .info.nmsrs = 2,
+            .entries = { { .index = MSR_IA32_TSC }, { .index = MSR_KVM_SYSTEM_TIME_NEW } },
+    };
+
+    if (ioctl(vm->vcpufd, KVM_GET_REGS, &state->regs) == -1
+        || ioctl(vm->vcpufd, KVM_GET_SREGS, &state->sregs) == -1
+        || ioctl(vm->vcpufd, KVM_GET_FPU, &state->fpu) == -1
+        || ioctl(vm->vcpufd, KVM_GET_VCPU_EVENTS, &state->events) == -1
+        || ioctl(vm->vcpufd, KVM_GET_MSRS, &msrs) != 2
+        || ioctl(vm->vmfd, KVM_GET_CLOCK, &state->clock) == -1)
+        return -1;
+    state->tsc = msrs.entries[0].data;
+    state->system_time = msrs.entries[1].data;
+    return 0;
+}
+
+static void load_vcpu(const struct migrate_vcpu *state)
+{
+    struct {
+        struct kvm_msrs info;
+        struct kvm_msr_entry entries[2];
+    } msrs = {
+            .info.nmsrs = 2,
+            .entries = {
+                    { .index = MSR_IA32_TSC, .data = state->tsc },
+                    { .index = MSR_KVM_SYSTEM_TIME_NEW, .data = state->system_time },
+            },
+    };
+    struct kvm_clock_data clock = state->clock;
+
+    /* The clock goes first, so the guest's time page is filled in from it once the MSR is back */
+    if (ioctl(vm->vmfd, KVM_SET_CLOCK, &clock) == -1)
+        err(1, "KVM_SET_CLOCK");
+    if (ioctl(vm->vcpufd, KVM_SET_SREGS, &state->sregs) == -1)
+        err(1, "KVM_SET_SREGS");
+    if (ioctl(vm->vcpufd, KVM_SET_REGS, &state->regs) == -1)
+        err(1, "KVM_SET_REGS");
+    if (ioctl(vm->vcpufd, KVM_SET_FPU, &state->fpu) == -1)
+        err(1, "KVM_SET_FPU");
+    if (ioctl(vm->vcpufd, KVM_SET_VCPU_EVENTS, &state->events) == -1)
+        err(1, "KVM_SET_VCPU_EVENTS");
+    if (ioctl(vm->vcpufd, KVM_SET_MSRS, &msrs) != 2)
+        errx(1, "KVM_SET_MSRS: couldn't restore the TSC and kvmclock");
+}
+
+static double elapsed_ms(const struct timespec *start)
+{
+    struct timespec now;
+
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (now.tv_sec - start->tv_sec) * 1000.0 + (now.tv_nsec - start->tv_nsec) / 1e6;
+}
+
+/*
+ * Stop and copy, on the vCPU thread once migrate_pending() says so.
+ * Returns 0 if the guest is now running at the destination, and we're
+ * done, or -1 if it's still ours to run.
+ * */
+int migrate_out(void)
+{
+    struct migrate_vcpu vcpu;
+    struct migrate_record reply;
+    struct timespec start;
+    unsigned long count;
+    void *devices = NULL;
+    size_t devices_len;
+    int ret = -1;
+
+    pthread_mutex_lock(&migrate_lock);
+    stopped = 1;
+    pthread_mutex_unlock(&migrate_lock);
+    clock_gettime(CLOCK_MONOTONIC, &start);
+
+    /*
+     * With immediate_exit still set, KVM_RUN finishes off any port or MMIO
+     * read the guest is in the middle of and comes straight back without
+     * running it, so the registers we save have the value in them.
+     * */
+    ioctl(vm->vcpufd, KVM_RUN, NULL);
+    vm->run->immediate_exit = 0;
+
+    stats.stop_pages = 0;
+    if (collect_dirty(&count) == -1 || send_dirty(&stats.stop_pages) == -1)
+        goto out;
+    stats.pages += stats.stop_pages;
+
+    if (save_vcpu(&vcpu) == -1)
+        goto out;
+    devices = vm->save_devices(&devices_len);
+    if (!devices)
+        goto out;
+    if (put_record(MIGRATE_VCPU, 0, &vcpu, sizeof(vcpu)) == -1
+        || put_record(MIGRATE_DEVICES, 0, devices, devices_len) == -1
+        || put_record(MIGRATE_END, 0, NULL, 0) == -1
+        || flush_records() == -1)
+        goto out;
+
+    /* Until the destination says it has the guest, it could still fall over and leave it with us */
+    if (read_all(sock, &reply, sizeof(reply)) == -1 || reply.type != MIGRATE_DONE)
+        goto out;
+    ret = 0;
+
+out:
+    stats.downtime_ms = elapsed_ms(&start);
+    pool_free(devices);
+    if (ret == -1) {
+        warnx("migrating to %s failed, carrying on here", dest_addr);
+        abandon();
+    } else {
+        close(sock);
+        sock = -1;
+    }
+
+    pthread_mutex_lock(&migrate_lock);
+    stopped = 0;
+    __atomic_store_n(&pending, 0, __ATOMIC_RELEASE);
+    pthread_cond_signal(&migrate_cond);
+    pthread_mutex_unlock(&migrate_lock);
+    return ret;
+}
+
+/*
+ * If SPARKLER_MIGRATE_FROM is set, wait for a guest to come in over it
+ * and load it into vm. Returns 1 once it's ready to run, or 0 if we're not
+ * expecting one. Anything wrong with the stream is fatal here, which the
+ * source sees as a failed migration and carries on running the guest.
+ * */
+int migrate_in(void)
+{
+    const char *addr = getenv("SPARKLER_MIGRATE_FROM");
+    struct migrate_record rec = { .type = MIGRATE_DONE };
+    struct migrate_hello hello;
+    struct migrate_vcpu vcpu;
+    int have_hello = 0, have_vcpu = 0, have_devices = 0;
+    void *devices;
+
+    if (!addr)
+        return 0;
+
+    sock = accept_from(addr);
+
+    while (1) {
+        if (read_all(sock, &rec, sizeof(rec)) == -1)
+            errx(1, "migration stream from %s ended early", addr);
+        if (!have_hello && rec.type != MIGRATE_HELLO)
+            errx(1, "migration stream doesn't start with a hello");
+
+        switch (rec.type) {
+            case MIGRATE_HELLO:
+                if (rec.len != sizeof(hello) || read_all(sock, &hello, sizeof(hello)) == -1)
+                    errx(1, "bad migration hello");
+                if (hello.magic != MIGRATE_MAGIC || hello.version != MIGRATE_VERSION)
+                    errx(1, "not a sparkler migration stream, or not one we understand");
+                if (hello.mem_size != vm->mem_size)
+                    errx(1, "migrating guest has 0x%llx bytes of RAM, we have 0x%llx",
+                         (unsigned long long)hello.mem_size, (unsigned long long)vm->mem_size);
+                have_hello = 1;
+                break;
+            case MIGRATE_PAGE:
+                if (rec.len != MIGRATE_PAGE_SIZE || rec.addr % MIGRATE_PAGE_SIZE
+                    || rec.addr > vm->mem_size - MIGRATE_PAGE_SIZE)
+                    errx(1, "bad page at 0x%llx in migration stream", (unsigned long long)rec.addr);
+                if (read_all(sock, vm->mem + rec.addr, MIGRATE_PAGE_SIZE) == -1)
+                    errx(1, "migration stream from %s ended early", addr);
+                stats.pages++;
+                break;
+            case MIGRATE_VCPU:
+                if (rec.len != sizeof(vcpu) || read_all(sock, &vcpu, sizeof(vcpu)) == -1)
+                    errx(1, "bad vCPU state in migration stream");
+                load_vcpu(&vcpu);
+                have_vcpu = 1;
+                break;
+            case MIGRATE_DEVICES:
+                if (rec.len > MIGRATE_MAX_DEVICES || !(devices = pool_alloc(rec.len ? rec.len : 1)))
+                    errx(1, "bad device state in migration stream");
+                if (read_all(sock, devices, rec.len) == -1 || vm->load_devices(devices, rec.len) == -1)
+                    errx(1, "bad device state in migration stream");
+                pool_free(devices);
+                have_devices = 1;
+                break;
+            case MIGRATE_END:
+                if (!have_vcpu || !have_devices)
+                    errx(1, "migration stream ended without the guest's state");
+                rec.type = MIGRATE_DONE;
+                rec.len = 0;
+                if (write_all(sock, &rec, sizeof(rec)) == -1)
+                    err(1, "telling %s we have the guest", addr);
+                close(sock);
+                sock = -1;
+                return 1;
+            default:
+                errx(1, "unknown record type %u in migration stream", rec.type);
+        }
+    }
+}
+
+void migrate_get_stats(struct migrate_stats *s)
+{
+    *s = stats;
+}
+
+void migrate_print_stats(FILE *f)
+{
+    struct migrate_stats s;
+
+    migrate_get_stats(&s);
+    fprintf(f, "migration: %u rounds, %lu pages copied, %lu while stopped, stopped for %.3f ms\n",
+            s.rounds, s.pages, s.stop_pages, s.downtime_ms);
+}
@@ -0,0 +1,102 @@
+#ifndef SPARKLER_MIGRATE_H
+#define SPARKLER_MIGRATE_H
+
+#include <linux/kvm.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <stdio.h>
+
+/*
+ * Live migration of a running guest to another sparkler process, on this
+ * host or another one, with the guest only stopped for the last few pages.
+ *
+ * The destination is started with SPARKLER_MIGRATE_FROM=<address> and
+ * waits there for a guest instead of booting its own. The source runs
+ * with SPARKLER_MIGRATE_TO=<address> and starts migrating when it gets a
+ * SIGUSR1. An address is a host:port to use TCP or else a Unix socket path.
+ *
+ * Migration is iterative pre-copy. With dirty page logging turned on for
+ * guest RAM, a migration thread sends all of it while the guest carries on
+ * running, then keeps sending whatever KVM (or our own device emulation,
+ * which KVM can't see) has dirtied since the last round. Once a round is
+ * small enough, or we've given up waiting for it to get there, the vCPU
+ * thread stops the guest, sends the last dirty pages along with the vCPU
+ * and device state, and waits for the destination to say it has taken
+ * over. If anything goes wrong before then, the guest just keeps running
+ * where it was.
+ * */
+
+#define MIGRATE_MAGIC           0x5247494d  /* "MIGR" */
+#define MIGRATE_VERSION         2
+#define MIGRATE_PAGE_SIZE       4096
+
+/* Stop and copy once a round has no more than this many dirty pages, or after this many rounds regardless */
+#define MIGRATE_MAX_STOP_PAGES  16
+#define MIGRATE_MAX_ROUNDS      30
+
+/* Every record in the stream starts with one of these, and its payload follows */
+struct migrate_record {
+    uint32_t type;
+    uint32_t len;
+    uint64_t addr;              /* guest physical address of a MIGRATE_PAGE */
+};
+
+#define MIGRATE_HELLO           1   /* struct migrate_hello */
+#define MIGRATE_PAGE            2   /* MIGRATE_PAGE_SIZE bytes of guest RAM */
+#define MIGRATE_VCPU            3   /* struct migrate_vcpu */
+#define MIGRATE_DEVICES         4   /* whatever save_devices() came up with */
+#define MIGRATE_END             5   /* the guest is all there */
+#define MIGRATE_DONE            6   /* from the destination: it's running the guest now */
+
+struct migrate_hello {
+    uint32_t magic;
+    uint32_t version;
+    uint64_t mem_size;
+};
+
+struct migrate_vcpu {
+    struct kvm_regs regs;
+    struct kvm_sregs sregs;
+    struct kvm_fpu fpu;
+    struct kvm_vcpu_events events;
+    uint64_t tsc;
+    uint64_t system_time;           /* kvmclock's MSR: where the guest wants its time page */
+    struct kvm_clock_data clock;    /* the VM's kvmclock, which there's only one of */
+};
+
+#define MIGRATE_MAX_REGIONS     4
+
+/*
+ * The VM being migrated, and how to save and restore the state of its
+ * devices. Guest RAM is mem_size bytes at mem, and may be split across
+ * several slots, each backed by mem at its own guest physical address.
+ * Whatever isn't in one of them, a ROM for one, isn't sent.
+ * */
+struct migrate_vm {
+    int vmfd;
+    int vcpufd;
+    struct kvm_run *run;
+    struct kvm_userspace_memory_region regions[MIGRATE_MAX_REGIONS];
+    unsigned int nr_regions;
+    uint64_t mem_size;
+    uint8_t *mem;
+    void *(*save_devices)(size_t *len);     /* returns a pool buffer, which we free */
+    int (*load_devices)(const void *data, size_t len);
+};
+
+struct migrate_stats {
+    unsigned int rounds;            /* of pre-copy, the first full copy included */
+    unsigned long pages;            /* sent or received altogether */
+    unsigned long stop_pages;       /* sent while the guest was stopped */
+    double downtime_ms;             /* how long it was stopped for */
+};
+
+void migrate_init(struct migrate_vm *vm);
+int migrate_in(void);
+int migrate_pending(void);
+int migrate_out(void);
+void migrate_note_dirty(uint64_t gpa, uint64_t len);
+void migrate_get_stats(struct migrate_stats *stats);
+void migrate_print_stats(FILE *f);
+
+#endif
@@ -1,13 +1,124 @@
 bits 16
 
 SERIAL_PORT             equ 0x3f8
+SERIAL_IER              equ SERIAL_PORT + 1
+SERIAL_IIR              equ SERIAL_PORT + 2
+SERIAL_FCR              equ SERIAL_PORT + 2
+SERIAL_MCR              equ SERIAL_PORT + 4
+SERIAL_LSR              equ SERIAL_PORT + 5
+SERIAL_IRQ_VECTOR       equ 0x0c            ; IRQ 4
+TIMER_IRQ_VECTOR        equ 0x08            ; IRQ 0
+TIMER_CONTROL           equ 0x140
+TIMER_INTERVAL          equ 0x144
+TIMER_STATUS            equ 0x148
+TIMER_ENABLE            equ 0x01
+TIMER_PERIODIC          equ 0x02
+BALLOON_LIST            equ 0x150           ; where our range list is
+BALLOON_INFLATE         equ 0x154           ; give the host the ranges on it
+BALLOON_DEFLATE         equ 0x158           ; take them back
+REFRESH_INTERVAL_MS     equ 60000           ; how often a report on screen is fetched again
 TWITTER_DEVICE          equ 0x100
 WEATHER_DEVICE_BASE     equ 0x100
 AIR_QUALITY_DEVICE_BASE equ 0x200
 
+; virtio-mmio consoles, reached through ES. The second one is the data channel:
+; we send it a device's port number and it sends back the device's payload.
+VIRTIO_SEG              equ 0xe000
+VIRTIO_CONSOLE          equ 0x000
+VIRTIO_DATA             equ 0x200
+VIRTIO_MAGIC            equ 0x74726976      ; "virt"
+VIRTIO_ID_CONSOLE       equ 3
+
+VIRTIO_MMIO_MAGIC       equ 0x000
+VIRTIO_MMIO_VERSION     equ 0x004
+VIRTIO_MMIO_DEVICE_ID   equ 0x008
+VIRTIO_MMIO_DRV_FEAT    equ 0x020
+VIRTIO_MMIO_DRV_FEAT_SEL equ 0x024
+VIRTIO_MMIO_QUEUE_SEL   equ 0x030
+VIRTIO_MMIO_QUEUE_NUM   equ 0x038
+VIRTIO_MMIO_QUEUE_READY equ 0x044
+VIRTIO_MMIO_QUEUE_NOTIFY equ 0x050
+VIRTIO_MMIO_STATUS      equ 0x070
+VIRTIO_MMIO_QUEUE_DESC  equ 0x080
+VIRTIO_MMIO_QUEUE_AVAIL equ 0x090
+VIRTIO_MMIO_QUEUE_USED  equ 0x0a0
+
+VIRTIO_STATUS_ACK       equ 0x01
+VIRTIO_STATUS_DRIVER    equ 0x02
+VIRTIO_STATUS_DRIVER_OK equ 0x04
+VIRTIO_STATUS_FEAT_OK   equ 0x08
+
+VIRTQ_RX                equ 0               ; virtio-console queue numbers
+VIRTQ_TX                equ 1
+VIRTQ_SIZE              equ 8
+VIRTQ_AVAIL             equ 0x80            ; where the rings sit within a queue's area
+VIRTQ_USED              equ 0x100
+VIRTQ_DESC_F_WRITE      equ 2
+VIRTQ_AVAIL_F_NO_INTERRUPT equ 1           ; we poll, so don't bother interrupting us
+VIRTQ_USED_F_NO_NOTIFY  equ 1
+
+; Counters the host keeps for us on a read-only page, laid out as in stats.h
+STATS_SEG               equ 0xd000
+STATS_MAGIC             equ 0x54535053      ; "SPST"
+STATS_NR_DEVICES        equ 13
+STATS_EXITS             equ 0x08
+STATS_IO_EXITS          equ 0x0c
+STATS_MMIO_EXITS        equ 0x10
+STATS_HLT_EXITS         equ 0x14
+STATS_INTERRUPTS        equ 0x18
+STATS_DEVICES           equ 0x20
+STATS_DEVICE_SIZE       equ 0x20
+STATS_DEV_FETCHES       equ 0x00
+STATS_DEV_HITS          equ 0x04
+STATS_DEV_MISSES        equ 0x08
+STATS_DEV_FAILURES      equ 0x0c
+STATS_DEV_LATENCY       equ 0x10
+STATS_DEV_BYTES         equ 0x14
+STATS_DEV_EXITS         equ 0x18
+
+; Device payloads the host keeps for us on read-only pages, laid out as in
+; datapage.h: a slot per device, in the same order as on the stats page
+DATAPAGE_SEG            equ 0xa000
+DATAPAGE_DEVICE_SIZE    equ 0x3000
+DATAPAGE_NR_DEVICES     equ 13
+DATAPAGE_SEQ            equ 0x00            ; odd while the host is writing the slot, 0 if it never has
+DATAPAGE_LEN            equ 0x04
+DATAPAGE_PAYLOAD        equ 0x08
+
+; kvmclock: once we tell KVM where our time page is, it keeps it up to date
+; and we can tell the time without an exit
+KVM_CPUID_SIGNATURE     equ 0x40000000
+KVM_CPUID_FEATURES      equ 0x40000001
+KVM_SIGNATURE_EBX       equ 0x4b4d564b      ; "KVMK"
+KVM_FEATURE_CLOCKSOURCE2 equ 1 << 3
+MSR_KVM_SYSTEM_TIME_NEW equ 0x4b564d01
+
+; Physical addresses of our virtqueues and buffers. DS_BASE gets us their offsets in DS.
+DS_BASE                 equ 0x1000
+CONSOLE_TXQ             equ 0x3000
+DATA_RXQ                equ 0x3200
+DATA_TXQ                equ 0x3400
+DATA_REQUEST            equ 0x3600
+DATA_BUF                equ 0x4000
+DATA_BUF_SIZE           equ 0x3000
+CLOCK_PAGE              equ 0x3800          ; kvmclock's struct pvclock_vcpu_time_info
+RAM_END                 equ 0x9000          ; nothing past DATA_BUF is ever used
+
+; We're mapped read-only, this one page of us, so whatever we write lives in
+; the page after: our variables at the bottom and the stack coming down from
+; the top.
+VARS                    equ 0x2000
+STACK_SEG               equ 0x200
+cpuid_function          equ VARS - DS_BASE + 0x00   ; dd
+virtio_ready            equ VARS - DS_BASE + 0x04   ; db
+clock_ready             equ VARS - DS_BASE + 0x05   ; db
+timer_ticked            equ VARS - DS_BASE + 0x06   ; db
+refresh_port            equ VARS - DS_BASE + 0x08   ; dw
+timing_start            equ VARS - DS_BASE + 0x0c   ; dd
+BALLOON_RANGE           equ VARS + 0x10             ; the one entry on our balloon list: dd gpa, dd len
+
 start:
-    mov ax, 0x100
-    add ax, 0x20
+    mov ax, STACK_SEG
     mov ss, ax
     mov sp, 0x1000
     cld
@@ -15,6 +126,11 @@ start:
     mov ax, 0x100
     mov ds, ax
 
+    call serial_init
+    call virtio_init
+    call timer_init
+    call balloon_init
+
     mov si, welcome_msg
     call print_str
 
@@ -37,6 +153,8 @@ menu_loop:
     je .air_quality
     cmp al, 0x35
     je .halt
+    cmp al, 0x36
+    je .stats
 
     mov si, illegal_choice
     call print_str
@@ -45,9 +163,14 @@ menu_loop:
     .cpu_details:
         call print_cpu_details
         jmp press_key
+    .stats:
+        call print_stats
+        jmp press_key
     .latest_tweet:
+        call start_timing
         call print_latest_tweet
         call print_new_line
+        call print_timing
         jmp press_key
     .weather:
         mov si, weather_str
@@ -68,9 +191,8 @@ menu_loop:
         jg .illegal_choice
 
         add ax, WEATHER_DEVICE_BASE     ; this gives us the port number for the city
-        mov dx, ax
-        call print_weather
-        jmp press_key
+        mov [refresh_port], ax
+        jmp refresh_device
     .air_quality:
         mov si, air_quality_str
         call print_str
@@ -90,9 +212,8 @@ menu_loop:
         jg .illegal_choice
 
         add ax, AIR_QUALITY_DEVICE_BASE     ; this gives us the port number for the city
-        mov dx, ax
-        call print_weather
-        jmp press_key
+        mov [refresh_port], ax
+        jmp refresh_device
 
         .illegal_choice:
             call print_new_line
@@ -100,6 +221,7 @@ menu_loop:
             call print_str
             jmp press_key
     .halt:
+        cli                             ; with interrupts off, nothing can wake us up
         hlt
 
 data:
@@ -107,10 +229,13 @@ data:
 
     ; Used by the menu system
     main_menu           db  `\nMain menu:\n==========\n`, 0
-    main_menu_items     db  `1. CPU Info\n2. Latest CliMagic Tweet\n3. Get Weather\n4. Get Air Quality\n5. Halt VM\n`, 0
+    main_menu_items     db  `1. CPU Info\n2. Latest CliMagic Tweet\n3. Get Weather\n4. Get Air Quality\n5. Halt VM\n6. Device Stats\n`, 0
     your_choice         db  `Your choice: \n`, 0
     illegal_choice      db  `You entered an illegal choice!\n\n`, 0
     press_any_key       db  `Press any key to continue...\n`, 0
+    refreshing_str      db  `Refreshing every minute, press any key to stop...\n`, 0
+    took_str            db  `(took `, 0
+    ms_str              db  ` ms)\n`, 0
 
     ; Used by our CPU ID routines
     cpu_info_str        db  `\nHere is your CPU information:\n`, 0
@@ -134,13 +259,253 @@ data:
     ; Cities
     cities_str          db  `1. Chennai\n2. New Delhi\n3. London\n4. Chicago\n5. San Francisco\n6. New York`,0
 
-    cpuid_function      dd  0x80000002
+    ; Used by print_stats
+    stats_str           db  `\nVM exits\t: `, 0
+    stats_io_str        db  ` (I/O `, 0
+    stats_mmio_str      db  `, MMIO `, 0
+    stats_hlt_str       db  `, hlt `, 0
+    stats_irq_str       db  `)\nInterrupts\t: `, 0
+    stats_fetches_str   db  `: `, 0
+    stats_hits_str      db  ` fetches, `, 0
+    stats_misses_str    db  ` cached, `, 0
+    stats_failures_str  db  ` from the service, `, 0
+    stats_latency_str   db  ` failed\n\tlast one took `, 0
+    stats_bytes_str     db  ` us, `, 0
+    stats_exits_str     db  ` bytes, `, 0
+    stats_end_str       db  ` port reads\n`, 0
+    no_stats_str        db  `\nThere are no stats to show\n`, 0
+    device_names        db  'Tweet', 0
+                        db  'Weather, Chennai', 0, 'Weather, New Delhi', 0, 'Weather, London', 0
+                        db  'Weather, Chicago', 0, 'Weather, San Francisco', 0, 'Weather, New York', 0
+                        db  'Air quality, Chennai', 0, 'Air quality, New Delhi', 0, 'Air quality, London', 0
+                        db  'Air quality, Chicago', 0, 'Air quality, San Francisco', 0, 'Air quality, New York', 0
 
+; Point the UART's interrupt at serial_isr and have it interrupt us when a key comes in
+serial_init:
+    push es
+    xor ax, ax
+    mov es, ax
+    mov word [es:SERIAL_IRQ_VECTOR * 4], serial_isr
+    mov word [es:SERIAL_IRQ_VECTOR * 4 + 2], 0x100  ; our code segment as seen through DS
+    pop es
+
+    mov dx, SERIAL_FCR
+    mov al, 0x07                ; enable and clear the FIFOs, interrupt on every byte
+    out dx, al
+    mov dx, SERIAL_MCR
+    mov al, 0x0b                ; DTR, RTS and OUT2, which gates the IRQ line
+    out dx, al
+    mov dx, SERIAL_IER
+    mov al, 0x01                ; received data available
+    out dx, al
+    ret
+
+; All the waking up is done by the hlt in wait_key_or_timer, so just acknowledge
+serial_isr:
+    push ax
+    push dx
+    mov dx, SERIAL_IIR
+    in al, dx
+    pop dx
+    pop ax
+    iret
+
+; Sleep until a key arrives instead of making the host block on our behalf
 get_users_choice:
-    mov dx, SERIAL_PORT
-    in ax, dx
+    call wait_key_or_timer
+    jc get_users_choice
+    ret
+
+; Sleep until a key arrives or the timer goes off. Returns the key in AL with
+; CF clear, or CF set if it was the timer.
+wait_key_or_timer:
+    mov dx, SERIAL_LSR
+    .wait:
+        cli
+        cmp byte [timer_ticked], 0
+        jne .timer
+        in al, dx
+        test al, 0x01           ; data ready?
+        jnz .got_key
+        sti                     ; sti holds off interrupts until after the hlt
+        hlt
+        jmp .wait
+
+    .timer:
+        mov byte [timer_ticked], 0
+        sti
+        stc
+        ret
+    .got_key:
+        sti
+        xor ax, ax
+        mov dx, SERIAL_PORT
+        in al, dx
+        clc
+        ret
+
+; Point the timer's interrupt at timer_isr, and turn on kvmclock if KVM has it
+timer_init:
+    push es
+    xor ax, ax
+    mov es, ax
+    mov word [es:TIMER_IRQ_VECTOR * 4], timer_isr
+    mov word [es:TIMER_IRQ_VECTOR * 4 + 2], 0x100
+    pop es
+
+    mov eax, KVM_CPUID_SIGNATURE
+    cpuid
+    cmp ebx, KVM_SIGNATURE_EBX
+    jne .done
+    cmp eax, KVM_CPUID_FEATURES
+    jb .done
+    mov eax, KVM_CPUID_FEATURES
+    cpuid
+    test eax, KVM_FEATURE_CLOCKSOURCE2
+    jz .done
+
+    mov ecx, MSR_KVM_SYSTEM_TIME_NEW
+    mov eax, CLOCK_PAGE | 1     ; bit 0 turns it on
+    xor edx, edx
+    wrmsr
+    mov byte [clock_ready], 1
+    .done:
+        ret
+
+; Tell the host where our balloon list is, and give it DATA_BUF and everything
+; after it. DATA_BUF is only taken back while a payload is in it.
+balloon_init:
+    mov dx, BALLOON_LIST
+    mov eax, BALLOON_RANGE
+    out dx, eax
+    mov dx, BALLOON_INFLATE
+    mov eax, DATA_BUF
+    mov ecx, RAM_END - DATA_BUF
+    call balloon_update
+    ret
+
+; Give the host (DX = BALLOON_INFLATE) or take back (DX = BALLOON_DEFLATE) the
+; ECX bytes of pages at EAX
+balloon_update:
+    mov [BALLOON_RANGE - DS_BASE], eax
+    mov [BALLOON_RANGE - DS_BASE + 4], ecx
+    mov eax, 1
+    out dx, eax
     ret
 
+; Acknowledge the timer and leave a note for wait_key_or_timer
+timer_isr:
+    push eax
+    push dx
+    mov dx, TIMER_STATUS
+    in eax, dx
+    mov byte [timer_ticked], 1
+    pop dx
+    pop eax
+    iret
+
+; Milliseconds since the VM started in EAX, worked out from the kvmclock page
+; the way a pvclock guest does it. Only call it if clock_ready is set.
+clock_ms:
+    push ebx
+    push ecx
+    push edx
+    push esi
+    push edi
+    .retry:
+        mov edi, [CLOCK_PAGE - DS_BASE]         ; version, which is odd while KVM updates the page
+        test edi, 1
+        jnz .retry
+        rdtsc
+        sub eax, [CLOCK_PAGE - DS_BASE + 8]     ; EDX:EAX = TSC - tsc_timestamp
+        sbb edx, [CLOCK_PAGE - DS_BASE + 12]
+        mov cl, [CLOCK_PAGE - DS_BASE + 28]     ; tsc_shift
+        test cl, cl
+        js .shift_right
+        shld edx, eax, cl
+        shl eax, cl
+        jmp .scale
+    .shift_right:
+        neg cl
+        shrd eax, edx, cl
+        shr edx, cl
+    .scale:
+        mov ebx, [CLOCK_PAGE - DS_BASE + 24]    ; nanoseconds = (EDX:EAX * tsc_to_system_mul) >> 32
+        mov esi, edx
+        mul ebx
+        mov ecx, edx
+        mov eax, esi
+        mul ebx
+        add eax, ecx
+        adc edx, 0
+        add eax, [CLOCK_PAGE - DS_BASE + 16]    ; + system_time
+        adc edx, [CLOCK_PAGE - DS_BASE + 20]
+        cmp edi, [CLOCK_PAGE - DS_BASE]
+        jne .retry
+
+    mov ecx, 1000000
+    div ecx
+    pop edi
+    pop esi
+    pop edx
+    pop ecx
+    pop ebx
+    ret
+
+; Remember the time, so print_timing can say how long whatever comes next took
+start_timing:
+    cmp byte [clock_ready], 0
+    je .done
+    push eax
+    call clock_ms
+    mov [timing_start], eax
+    pop eax
+    .done:
+        ret
+
+print_timing:
+    cmp byte [clock_ready], 0
+    je .done
+    push eax
+    push si
+    mov si, took_str
+    call print_str
+    call clock_ms
+    sub eax, [timing_start]
+    call print_dec
+    mov si, ms_str
+    call print_str
+    pop si
+    pop eax
+    .done:
+        ret
+
+; Show the device whose port is in refresh_port, then fetch and show it again
+; every REFRESH_INTERVAL_MS until a key is pressed. The timer wakes us from
+; the same hlt a key would.
+refresh_device:
+    mov dx, TIMER_INTERVAL
+    mov eax, REFRESH_INTERVAL_MS
+    out dx, eax
+    mov dx, TIMER_CONTROL
+    mov eax, TIMER_ENABLE | TIMER_PERIODIC
+    out dx, eax
+
+    .refresh:
+        mov dx, [refresh_port]
+        call start_timing
+        call print_weather
+        call print_timing
+        mov si, refreshing_str
+        call print_str
+        call wait_key_or_timer
+        jc .refresh
+
+    mov dx, TIMER_CONTROL
+    xor eax, eax
+    out dx, eax
+    jmp menu_loop
+
 display_main_menu:
     mov si, main_menu
     call print_str
@@ -151,9 +516,22 @@ display_main_menu:
     ret
 
 print_latest_tweet:
+    mov dx, TWITTER_DEVICE
+    call print_weather
+    ret
+
+; To be called with weather port alreay in DX
+print_weather:
     mov si, fetching_wait
     call print_str
-    mov dx, TWITTER_DEVICE
+    call datapage_print_device
+    jnc .done
+    cmp byte [virtio_ready], 0
+    je .get_next_char
+    call virtio_print_device
+    ret
+
+    ; No virtio, so read it a byte at a time from the device port
     .get_next_char:
         in ax, dx
         cmp ax, 0
@@ -164,20 +542,252 @@ print_latest_tweet:
     .done:
         ret
 
-; To be called with weather port alreay in DX
-print_weather:
-    mov si, fetching_wait
-    call print_str
-    .get_next_char:
-        in ax, dx
-        cmp ax, 0
-        je .done
+; Print the payload of the device whose port is in DX straight off the data
+; page, if the host has put one there yet: getting it takes no exits at all,
+; only printing it does. Carry set if there's nothing there, with DX as it was.
+datapage_print_device:
+    push dx
+    push fs
+    movzx ax, dl                ; the tweet and weather devices are slots 0-6
+    cmp dh, AIR_QUALITY_DEVICE_BASE >> 8
+    jne .find_slot
+    add ax, 6                   ; and air quality devices 7-12
+    .find_slot:
+        cmp ax, DATAPAGE_NR_DEVICES
+        jae .nothing
+        imul ax, ax, DATAPAGE_DEVICE_SIZE >> 4
+        add ax, DATAPAGE_SEG
+        mov fs, ax
+        cmp dword [fs:DATAPAGE_SEQ], 0
+        je .nothing
+
+    mov dx, BALLOON_DEFLATE
+    mov eax, DATA_BUF
+    mov ecx, DATA_BUF_SIZE
+    call balloon_update
+
+    ; Copy it out, and again if the host changed it while we were at it
+    push ds
+    push es
+    mov ax, DATA_BUF >> 4
+    mov es, ax
+    .copy:
+        mov ebx, [fs:DATAPAGE_SEQ]
+        test bl, 1
+        jnz .copy
+        mov ecx, [fs:DATAPAGE_LEN]
+        cmp ecx, DATA_BUF_SIZE
+        ja .copy
+        mov ax, fs
+        mov ds, ax
+        mov si, DATAPAGE_PAYLOAD
+        xor di, di
+        push cx
+        rep movsb
+        pop cx
+        cmp ebx, [fs:DATAPAGE_SEQ]
+        jne .copy
+    pop es
+    pop ds
+
+    cmp byte [virtio_ready], 0
+    je .serial
+    push es
+    mov ax, VIRTIO_SEG
+    mov es, ax
+    mov bx, CONSOLE_TXQ - DS_BASE
+    mov eax, DATA_BUF
+    xor dx, dx
+    call virtq_add_buf
+    mov dword [es:VIRTIO_CONSOLE + VIRTIO_MMIO_QUEUE_NOTIFY], VIRTQ_TX
+    call virtq_wait_used
+    pop es
+    jmp .printed
+
+    .serial:
+        mov si, DATA_BUF - DS_BASE
+        jcxz .printed
+    .next_char:
+        lodsb
         call print_char
-        jmp .get_next_char
+        loop .next_char
+
+    .printed:
+        mov dx, BALLOON_INFLATE
+        mov eax, DATA_BUF
+        mov ecx, DATA_BUF_SIZE
+        call balloon_update
+        pop fs
+        pop dx
+        clc
+        ret
+
+    .nothing:
+        pop fs
+        pop dx
+        stc
+        ret
+
+; Bring up both virtio consoles. Leaves virtio_ready at 0 if either isn't there.
+virtio_init:
+    push es
+    mov ax, VIRTIO_SEG
+    mov es, ax
 
+    mov di, VIRTIO_CONSOLE
+    call virtio_probe
+    jc .done
+    mov ax, VIRTQ_TX
+    mov ebx, CONSOLE_TXQ
+    call virtio_setup_queue
+    or dword [es:di + VIRTIO_MMIO_STATUS], VIRTIO_STATUS_DRIVER_OK
+
+    mov di, VIRTIO_DATA
+    call virtio_probe
+    jc .done
+    mov ax, VIRTQ_RX
+    mov ebx, DATA_RXQ
+    call virtio_setup_queue
+    mov ax, VIRTQ_TX
+    mov ebx, DATA_TXQ
+    call virtio_setup_queue
+    or dword [es:di + VIRTIO_MMIO_STATUS], VIRTIO_STATUS_DRIVER_OK
+
+    mov byte [virtio_ready], 1
     .done:
+        pop es
+        ret
+
+; Reset the virtio-mmio device at ES:DI and negotiate features. Sets CF if it
+; isn't a virtio console we can drive.
+virtio_probe:
+    cmp dword [es:di + VIRTIO_MMIO_MAGIC], VIRTIO_MAGIC
+    jne .fail
+    cmp dword [es:di + VIRTIO_MMIO_VERSION], 2
+    jne .fail
+    cmp dword [es:di + VIRTIO_MMIO_DEVICE_ID], VIRTIO_ID_CONSOLE
+    jne .fail
+
+    mov dword [es:di + VIRTIO_MMIO_STATUS], 0
+    mov dword [es:di + VIRTIO_MMIO_STATUS], VIRTIO_STATUS_ACK | VIRTIO_STATUS_DRIVER
+    mov dword [es:di + VIRTIO_MMIO_DRV_FEAT_SEL], 1
+    mov dword [es:di + VIRTIO_MMIO_DRV_FEAT], 1         ; VIRTIO_F_VERSION_1 and nothing else
+    mov dword [es:di + VIRTIO_MMIO_DRV_FEAT_SEL], 0
+    mov dword [es:di + VIRTIO_MMIO_DRV_FEAT], 0
+    mov dword [es:di + VIRTIO_MMIO_STATUS], VIRTIO_STATUS_ACK | VIRTIO_STATUS_DRIVER | VIRTIO_STATUS_FEAT_OK
+    test dword [es:di + VIRTIO_MMIO_STATUS], VIRTIO_STATUS_FEAT_OK
+    jz .fail
+    clc
+    ret
+
+    .fail:
+        stc
         ret
 
+; Set up queue AX of the device at ES:DI, with its rings in the area at physical EBX
+virtio_setup_queue:
+    movzx eax, ax
+    mov dword [es:di + VIRTIO_MMIO_QUEUE_SEL], eax
+    mov dword [es:di + VIRTIO_MMIO_QUEUE_NUM], VIRTQ_SIZE
+    mov dword [es:di + VIRTIO_MMIO_QUEUE_DESC], ebx
+    mov dword [es:di + VIRTIO_MMIO_QUEUE_DESC + 4], 0
+    add ebx, VIRTQ_AVAIL
+    mov dword [es:di + VIRTIO_MMIO_QUEUE_AVAIL], ebx
+    mov dword [es:di + VIRTIO_MMIO_QUEUE_AVAIL + 4], 0
+    add ebx, VIRTQ_USED - VIRTQ_AVAIL
+    mov dword [es:di + VIRTIO_MMIO_QUEUE_USED], ebx
+    mov dword [es:di + VIRTIO_MMIO_QUEUE_USED + 4], 0
+    sub ebx, VIRTQ_USED + DS_BASE
+    mov word [bx + VIRTQ_AVAIL], VIRTQ_AVAIL_F_NO_INTERRUPT
+    mov dword [es:di + VIRTIO_MMIO_QUEUE_READY], 1
+    ret
+
+; Make a single buffer available on the queue whose area is at DS:BX. EAX is the
+; buffer's physical address, CX its length and DX the descriptor flags. We only
+; ever have one buffer in flight per queue, so it always goes in descriptor 0.
+virtq_add_buf:
+    push si
+    mov dword [bx], eax
+    mov dword [bx + 4], 0
+    mov word [bx + 8], cx
+    mov word [bx + 10], 0
+    mov word [bx + 12], dx
+    mov word [bx + 14], 0
+    mov si, [bx + VIRTQ_AVAIL + 2]
+    and si, VIRTQ_SIZE - 1
+    shl si, 1
+    mov word [bx + si + VIRTQ_AVAIL + 4], 0
+    inc word [bx + VIRTQ_AVAIL + 2]     ; and now the device can see it
+    pop si
+    ret
+
+; Wait for the device to use everything we made available on the queue at DS:BX,
+; and return the length of the last used buffer in CX
+virtq_wait_used:
+    push si
+    .spin:
+        mov si, [bx + VIRTQ_USED + 2]
+        cmp si, [bx + VIRTQ_AVAIL + 2]
+        jne .spin
+    dec si
+    and si, VIRTQ_SIZE - 1
+    shl si, 3
+    mov cx, [bx + si + VIRTQ_USED + 8]
+    pop si
+    ret
+
+; Fetch the payload of the device whose port is in DX over the data channel and
+; print it on the virtio console. The whole thing costs three exits however big
+; it is, and two more to borrow DATA_BUF back from the balloon for it.
+virtio_print_device:
+    push es
+    push dx
+    mov ax, VIRTIO_SEG
+    mov es, ax
+
+    mov dx, BALLOON_DEFLATE
+    mov eax, DATA_BUF
+    mov ecx, DATA_BUF_SIZE
+    call balloon_update
+
+    mov bx, DATA_RXQ - DS_BASE
+    mov eax, DATA_BUF
+    mov cx, DATA_BUF_SIZE
+    mov dx, VIRTQ_DESC_F_WRITE
+    call virtq_add_buf
+    test word [bx + VIRTQ_USED], VIRTQ_USED_F_NO_NOTIFY
+    jnz .send_request
+    mov dword [es:VIRTIO_DATA + VIRTIO_MMIO_QUEUE_NOTIFY], VIRTQ_RX
+
+    .send_request:
+        pop dx
+        mov [DATA_REQUEST - DS_BASE], dx
+        mov bx, DATA_TXQ - DS_BASE
+        mov eax, DATA_REQUEST
+        mov cx, 2
+        xor dx, dx
+        call virtq_add_buf
+        mov dword [es:VIRTIO_DATA + VIRTIO_MMIO_QUEUE_NOTIFY], VIRTQ_TX
+        call virtq_wait_used
+        mov bx, DATA_RXQ - DS_BASE
+        call virtq_wait_used
+
+    ; Hand the buffer we got straight to the console
+    mov bx, CONSOLE_TXQ - DS_BASE
+    mov eax, DATA_BUF
+    xor dx, dx
+    call virtq_add_buf
+    mov dword [es:VIRTIO_CONSOLE + VIRTIO_MMIO_QUEUE_NOTIFY], VIRTQ_TX
+    call virtq_wait_used
+
+    mov dx, BALLOON_INFLATE
+    mov eax, DATA_BUF
+    mov ecx, DATA_BUF_SIZE
+    call balloon_update
+
+    pop es
+    ret
+
 print_cpu_details:
     mov si, cpu_info_str
     call print_str
@@ -219,6 +829,7 @@ print_cpuid:
 print_cpu_brand_string:
     mov al, '"'
     call print_char
+    mov dword [cpuid_function], 0x80000002
     .next_function:
         mov eax, [cpuid_function]
         cpuid
@@ -336,6 +947,112 @@ print_cpu_info:
 
     ret
 
+; Show what the host has counted for us: exits, and for every device we've
+; read, how its fetches went. It's all plain memory reads off the stats page.
+print_stats:
+    push es
+    mov ax, STATS_SEG
+    mov es, ax
+    cmp dword [es:0], STATS_MAGIC
+    jne .no_stats
+
+    mov si, stats_str
+    mov eax, [es:STATS_EXITS]
+    call print_labelled
+    mov si, stats_io_str
+    mov eax, [es:STATS_IO_EXITS]
+    call print_labelled
+    mov si, stats_mmio_str
+    mov eax, [es:STATS_MMIO_EXITS]
+    call print_labelled
+    mov si, stats_hlt_str
+    mov eax, [es:STATS_HLT_EXITS]
+    call print_labelled
+    mov si, stats_irq_str
+    mov eax, [es:STATS_INTERRUPTS]
+    call print_labelled
+    call print_new_line
+
+    mov bx, STATS_DEVICES
+    mov di, device_names
+    .next_device:
+        cmp dword [es:bx + STATS_DEV_FETCHES], 0
+        je .skip_name
+        mov si, di
+        call print_str
+        mov si, stats_fetches_str
+        mov eax, [es:bx + STATS_DEV_FETCHES]
+        call print_labelled
+        mov si, stats_hits_str
+        mov eax, [es:bx + STATS_DEV_HITS]
+        call print_labelled
+        mov si, stats_misses_str
+        mov eax, [es:bx + STATS_DEV_MISSES]
+        call print_labelled
+        mov si, stats_failures_str
+        mov eax, [es:bx + STATS_DEV_FAILURES]
+        call print_labelled
+        mov si, stats_latency_str
+        mov eax, [es:bx + STATS_DEV_LATENCY]
+        call print_labelled
+        mov si, stats_bytes_str
+        mov eax, [es:bx + STATS_DEV_BYTES]
+        call print_labelled
+        mov si, stats_exits_str
+        mov eax, [es:bx + STATS_DEV_EXITS]
+        call print_labelled
+        mov si, stats_end_str
+        call print_str
+        .skip_name:
+            inc di
+            cmp byte [di - 1], 0
+            jne .skip_name
+        add bx, STATS_DEVICE_SIZE
+        cmp bx, STATS_DEVICES + STATS_NR_DEVICES * STATS_DEVICE_SIZE
+        jb .next_device
+
+    pop es
+    ret
+
+    .no_stats:
+        mov si, no_stats_str
+        call print_str
+        pop es
+        ret
+
+; Print the string at SI, then the number in EAX
+print_labelled:
+    call print_str
+    call print_dec
+    ret
+
+; Print the unsigned number in EAX in decimal
+print_dec:
+    push eax
+    push ecx
+    push edx
+    push bx
+    mov ecx, 10
+    xor bx, bx
+    .next_digit:
+        xor edx, edx
+        div ecx
+        push dx
+        inc bx
+        test eax, eax
+        jnz .next_digit
+    .print_digit:
+        pop ax
+        add al, '0'
+        call print_char
+        dec bx
+        jnz .print_digit
+    pop bx
+    pop edx
+    pop ecx
+    pop eax
+    ret
+
 print_new_line:
     push dx
     push ax
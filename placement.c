@@ -0,0 +1,234 @@
+#define _GNU_SOURCE
+#include <err.h>
+#include <linux/mempolicy.h>
+#include <pthread.h>
+#include <sched.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+#include "placement.h"
+
+#ifndef MADV_POPULATE_WRITE
+#define MADV_POPULATE_WRITE     23
+#endif
+
+/* Enough bits for the nodemask we hand mbind(); the kernel is told about one less, as it expects */
+#define MAX_NUMA_NODES          1024
+
+static cpu_set_t vcpu_cpus_set;
+static int vcpu_cpus[CPU_SETSIZE];
+static unsigned int nr_vcpu_cpus;
+static cpu_set_t io_cpus;
+static int io_cpus_configured;
+static int numa_node = -1;
+static int prefault;
+static int ksm;
+static void *guest_mem;
+static size_t guest_mem_size;
+
+/*
+ * Parse a CPU list such as "0-3,6" into set, and in order into list if
+ * we're given one. A CPU named again is only listed the first time, so
+ * list never needs room for more than CPU_SETSIZE.
+ * */
+static void parse_cpu_list(const char *var, const char *text, cpu_set_t *set, int *list, unsigned int *nr)
+{
+    const char *p = text;
+
+    CPU_ZERO(set);
+    while (*p) {
+        char *end;
+        long first = strtol(p, &end, 10), last;
+
+        if (end == p || first < 0 || first >= CPU_SETSIZE)
+            errx(1, "%s: bad CPU list \"%s\"", var, text);
+        last = first;
+        if (*end == '-') {
+            p = end + 1;
+            last = strtol(p, &end, 10);
+            if (end == p || last < first || last >= CPU_SETSIZE)
+                errx(1, "%s: bad CPU list \"%s\"", var, text);
+        }
+        for (long cpu = first; cpu <= last; cpu++) {
+            if (CPU_ISSET(cpu, set))
+                continue;
+            CPU_SET(cpu, set);
+            if (list)
+                list[(*nr)++] = cpu;
+        }
+        if (*end == ',')
+            end++;
+        else if (*end)
+            errx(1, "%s: bad CPU list \"%s\"", var, text);
+        p = end;
+    }
+}
+
+void placement_init(void)
+{
+    const char *value;
+
+    value = getenv("SPARKLER_VCPU_CPUS");
+    if (value)
+        parse_cpu_list("SPARKLER_VCPU_CPUS", value, &vcpu_cpus_set, vcpu_cpus, &nr_vcpu_cpus);
+
+    value = getenv("SPARKLER_IO_CPUS");
+    if (value) {
+        parse_cpu_list("SPARKLER_IO_CPUS", value, &io_cpus, NULL, NULL);
+        io_cpus_configured = 1;
+    } else if (nr_vcpu_cpus) {
+        /* Everything we're allowed to run on, bar the vCPUs' CPUs */
+        if (sched_getaffinity(0, sizeof(io_cpus), &io_cpus) == -1)
+            err(1, "sched_getaffinity");
+        for (unsigned int i = 0; i < nr_vcpu_cpus; i++)
+            CPU_CLR(vcpu_cpus[i], &io_cpus);
+        io_cpus_configured = CPU_COUNT(&io_cpus) > 0;
+    }
+
+    value = getenv("SPARKLER_NUMA_NODE");
+    if (value) {
+        char *end;
+
+        numa_node = strtol(value, &end, 10);
+        if (end == value || *end || numa_node < 0 || numa_node >= MAX_NUMA_NODES - 1)
+            errx(1, "SPARKLER_NUMA_NODE: bad node \"%s\"", value);
+    }
+
+    value = getenv("SPARKLER_PREFAULT");
+    prefault = value && strcmp(value, "1") == 0;
+
+    value = getenv("SPARKLER_KSM");
+    ksm = value && strcmp(value, "1") == 0;
+}
+
+/* Whether SPARKLER_PREFAULT asked for guest memory to be faulted in up front */
+int placement_prefault(void)
+{
+    return prefault;
+}
+
+/* Pin the calling thread, which is about to run vCPU number vcpu, to that vCPU's host CPU */
+void placement_pin_vcpu(unsigned int vcpu)
+{
+    cpu_set_t set;
+
+    if (vcpu >= nr_vcpu_cpus)
+        return;
+    CPU_ZERO(&set);
+    CPU_SET(vcpu_cpus[vcpu], &set);
+    if (sched_setaffinity(0, sizeof(set), &set) == -1)
+        err(1, "pinning vCPU %u to CPU %d", vcpu, vcpu_cpus[vcpu]);
+}
+
+/*
+ * Keep the calling thread, which does fetches or other I/O, off the vCPUs'
+ * CPUs. New threads inherit the affinity of whoever created them, which is
+ * usually a pinned vCPU thread, so they need to call this first thing.
+ * */
+void placement_io_thread(void)
+{
+    if (io_cpus_configured)
+        pthread_setaffinity_np(pthread_self(), sizeof(io_cpus), &io_cpus);
+}
+
+/*
+ * Map guest RAM, bound to the configured NUMA node and faulted in up front
+ * if we were asked to. The binding has to be in place before anything
+ * touches the memory, so prefaulting a bound mapping happens after mbind()
+ * rather than through MAP_POPULATE. KSM only merges private anonymous
+ * memory, so opting in to it gets a private mapping.
+ * */
+void *placement_alloc_guest_mem(size_t size)
+{
+    int flags = (ksm ? MAP_PRIVATE : MAP_SHARED) | MAP_ANONYMOUS;
+    uint8_t *mem;
+
+    if (prefault && numa_node < 0)
+        flags |= MAP_POPULATE;
+    mem = mmap(NULL, size, PROT_READ | PROT_WRITE, flags, -1, 0);
+    if (mem == MAP_FAILED)
+        return NULL;
+    guest_mem = mem;
+    guest_mem_size = size;
+
+    if (ksm && madvise(mem, size, MADV_MERGEABLE) == -1)
+        warn("MADV_MERGEABLE, so guest memory won't be merged");
+
+    if (numa_node >= 0) {
+        unsigned long nodemask[MAX_NUMA_NODES / (8 * sizeof(unsigned long))] = { 0 };
+
+        nodemask[numa_node / (8 * sizeof(unsigned long))] |= 1UL << (numa_node % (8 * sizeof(unsigned long)));
+        if (syscall(SYS_mbind, mem, size, MPOL_BIND, nodemask, MAX_NUMA_NODES, 0) == -1)
+            err(1, "binding guest memory to NUMA node %d", numa_node);
+
+        if (prefault && madvise(mem, size, MADV_POPULATE_WRITE) == -1) {
+            /* Older kernels: touch every page ourselves */
+            long page_size = sysconf(_SC_PAGESIZE);
+
+            for (size_t off = 0; off < size; off += page_size)
+                ((volatile uint8_t *)mem)[off] = 0;
+        }
+    }
+    return mem;
+}
+
+/*
+ * Give the pages of guest RAM from addr to addr + len back to the host,
+ * leaving them to read as zeroes. A shared mapping's pages belong to its
+ * shmem file, so they have to be punched out of that; unmapping them
+ * alone wouldn't free anything.
+ * */
+int placement_discard(void *addr, size_t len)
+{
+    return madvise(addr, len, ksm ? MADV_DONTNEED : MADV_REMOVE);
+}
+
+/* Add up what /proc/self/smaps says about the mappings that make up addr to addr + len */
+int placement_usage(const void *addr, size_t len, struct placement_usage *usage)
+{
+    uintptr_t first = (uintptr_t)addr, last = first + len;
+    int in_range = 0;
+    char line[512];
+    FILE *f;
+
+    memset(usage, 0, sizeof(*usage));
+    f = fopen("/proc/self/smaps", "r");
+    if (!f)
+        return -1;
+    while (fgets(line, sizeof(line), f)) {
+        unsigned long start, end, kb;
+        char field[64];
+
+        if (sscanf(line, "%lx-%lx ", &start, &end) == 2) {
+            in_range = start < last && end > first;
+            continue;
+        }
+        if (!in_range || sscanf(line, "%63[^:]: %lu kB", field, &kb) != 2)
+            continue;
+        if (strcmp(field, "Rss") == 0)
+            usage->resident += kb * 1024;
+        else if (strcmp(field, "Pss") == 0)
+            usage->proportional += kb * 1024;
+        else if (strcmp(field, "Private_Clean") == 0 || strcmp(field, "Private_Dirty") == 0)
+            usage->unique += kb * 1024;
+        else if (strcmp(field, "KSM") == 0)
+            usage->merged += kb * 1024;
+    }
+    fclose(f);
+    return 0;
+}
+
+/* What guest RAM costs the host, and how much of that is this VM's alone */
+void placement_print_stats(FILE *f)
+{
+    struct placement_usage u;
+
+    if (!guest_mem || placement_usage(guest_mem, guest_mem_size, &u) == -1)
+        return;
+    fprintf(f, "guest memory: %zu KB, %zu KB resident, %zu KB unique to this VM, %zu KB proportional, %zu KB merged by KSM\n",
+            guest_mem_size / 1024, u.resident / 1024, u.unique / 1024, u.proportional / 1024, u.merged / 1024);
+}
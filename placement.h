@@ -0,0 +1,41 @@
+#ifndef SPARKLER_PLACEMENT_H
+#define SPARKLER_PLACEMENT_H
+
+#include <stddef.h>
+#include <stdio.h>
+
+/*
+ * Where our threads run and where guest RAM lives. All of it is optional
+ * and comes from the environment, in the same way SPARKLER_SERVICE does:
+ *
+ *   SPARKLER_VCPU_CPUS   host CPUs to pin vCPU threads to, one per vCPU in
+ *                        vCPU order, as a list like "2,3" or "2-3"
+ *   SPARKLER_IO_CPUS     host CPUs for fetch and other I/O threads, as a
+ *                        list. Defaults to every CPU not given to a vCPU,
+ *                        so background work never lands on a pinned vCPU.
+ *   SPARKLER_NUMA_NODE   NUMA node to bind guest RAM to
+ *   SPARKLER_PREFAULT    set to 1 to fault in all of guest RAM up front
+ *                        rather than on the guest's first touch
+ *   SPARKLER_KSM         set to 1 to let KSM merge guest RAM with identical
+ *                        pages elsewhere, ours or other guests'. The host
+ *                        has to have KSM running for it to do anything.
+ * */
+
+/* What a range of our address space costs the host, in bytes */
+struct placement_usage {
+    size_t resident;
+    size_t unique;              /* resident pages nothing else maps */
+    size_t proportional;        /* resident, shared pages split between whoever maps them */
+    size_t merged;              /* pages KSM has merged */
+};
+
+void placement_init(void);
+int placement_prefault(void);
+void placement_pin_vcpu(unsigned int vcpu);
+void placement_io_thread(void);
+void *placement_alloc_guest_mem(size_t size);
+int placement_discard(void *addr, size_t len);
+int placement_usage(const void *addr, size_t len, struct placement_usage *usage);
+void placement_print_stats(FILE *f);
+
+#endif
@@ -0,0 +1,187 @@
+#include <pthread.h>
+#include <stdlib.h>
+#include <string.h>
+#include "pool.h"
+
+#define POOL_LARGE      0xffffffffu
+#define POOL_MAGIC      0x5ba7c1e5u
+
+/* Every block carries this header just in front of the memory we hand out */
+struct pool_block {
+    union {
+        struct pool_block *next;    /* while sitting on a free list */
+        size_t size;                /* usable size of large blocks */
+    } u;
+    unsigned int cls;
+    unsigned int magic;
+};
+
+static struct pool_block *free_lists[POOL_NR_CLASSES];
+static unsigned int nr_free[POOL_NR_CLASSES];
+static struct pool_stats stats;
+
+/* Fetches can run on several threads at once, so the free lists and stats are shared under this */
+static pthread_mutex_t pool_lock = PTHREAD_MUTEX_INITIALIZER;
+
+static unsigned int size_to_class(size_t size)
+{
+    unsigned int shift;
+
+    if (size <= (1UL << POOL_MIN_SHIFT))
+        return 0;
+    shift = 64 - __builtin_clzl(size - 1);
+    if (shift > POOL_MAX_SHIFT)
+        return POOL_LARGE;
+    return shift - POOL_MIN_SHIFT;
+}
+
+static size_t class_size(unsigned int cls)
+{
+    return 1UL << (cls + POOL_MIN_SHIFT);
+}
+
+static struct pool_block *to_block(void *ptr)
+{
+    struct pool_block *block = (struct pool_block *)ptr - 1;
+
+    if (block->magic != POOL_MAGIC)
+        abort();    /* not ours, or a double free */
+    return block;
+}
+
+void *pool_alloc(size_t size)
+{
+    unsigned int cls = size_to_class(size);
+    struct pool_block *block;
+
+    pthread_mutex_lock(&pool_lock);
+    if (cls != POOL_LARGE && free_lists[cls]) {
+        block = free_lists[cls];
+        free_lists[cls] = block->u.next;
+        nr_free[cls]--;
+        stats.recycled++;
+        stats.bytes_cached -= class_size(cls);
+        size = class_size(cls);
+    } else {
+        /* Nothing cached; don't hold everyone else up while malloc runs */
+        pthread_mutex_unlock(&pool_lock);
+        if (cls != POOL_LARGE)
+            size = class_size(cls);
+        block = malloc(sizeof(*block) + size);
+        if (!block)
+            return NULL;
+        if (cls == POOL_LARGE)
+            block->u.size = size;
+        pthread_mutex_lock(&pool_lock);
+        stats.heap_allocs++;
+    }
+
+    stats.allocs++;
+    stats.bytes_in_use += size;
+    pthread_mutex_unlock(&pool_lock);
+
+    block->cls = cls;
+    block->magic = POOL_MAGIC;
+    return block + 1;
+}
+
+void *pool_zalloc(size_t size)
+{
+    void *ptr = pool_alloc(size);
+
+    if (ptr)
+        memset(ptr, 0, size);
+    return ptr;
+}
+
+size_t pool_capacity(void *ptr)
+{
+    struct pool_block *block = to_block(ptr);
+
+    if (block->cls == POOL_LARGE)
+        return block->u.size;
+    return class_size(block->cls);
+}
+
+/*
+ * Growing is geometric for free since classes are powers of two: a block
+ * only moves when the new size crosses into the next class up.
+ * */
+void *pool_realloc(void *ptr, size_t size)
+{
+    void *new_ptr;
+    size_t capacity;
+
+    if (!ptr)
+        return pool_alloc(size);
+
+    capacity = pool_capacity(ptr);
+    if (size <= capacity)
+        return ptr;
+
+    new_ptr = pool_alloc(size);
+    if (!new_ptr)
+        return NULL;
+    memcpy(new_ptr, ptr, capacity);
+    pool_free(ptr);
+    pthread_mutex_lock(&pool_lock);
+    stats.grows++;
+    pthread_mutex_unlock(&pool_lock);
+    return new_ptr;
+}
+
+void pool_free(void *ptr)
+{
+    struct pool_block *block;
+    unsigned int cls;
+
+    if (!ptr)
+        return;
+
+    block = to_block(ptr);
+    cls = block->cls;
+    block->magic = 0;
+
+    pthread_mutex_lock(&pool_lock);
+    stats.frees++;
+
+    if (cls == POOL_LARGE) {
+        stats.bytes_in_use -= block->u.size;
+        stats.heap_frees++;
+        pthread_mutex_unlock(&pool_lock);
+        free(block);
+        return;
+    }
+
+    stats.bytes_in_use -= class_size(cls);
+    if (nr_free[cls] * class_size(cls) >= POOL_CLASS_CACHE_BYTES) {
+        stats.heap_frees++;
+        pthread_mutex_unlock(&pool_lock);
+        free(block);
+        return;
+    }
+
+    block->u.next = free_lists[cls];
+    free_lists[cls] = block;
+    nr_free[cls]++;
+    stats.bytes_cached += class_size(cls);
+    pthread_mutex_unlock(&pool_lock);
+}
+
+void pool_get_stats(struct pool_stats *out)
+{
+    pthread_mutex_lock(&pool_lock);
+    *out = stats;
+    pthread_mutex_unlock(&pool_lock);
+}
+
+void pool_print_stats(FILE *f)
+{
+    struct pool_stats s;
+
+    pool_get_stats(&s);
+    fprintf(f, "pool: %lu allocs, %lu frees, %lu recycled, %lu grows, "
+               "%lu heap allocs, %lu heap frees, %zu bytes in use, %zu bytes cached\n",
+            s.allocs, s.frees, s.recycled, s.grows,
+            s.heap_allocs, s.heap_frees, s.bytes_in_use, s.bytes_cached);
+}
@@ -0,0 +1,42 @@
+#ifndef SPARKLER_POOL_H
+#define SPARKLER_POOL_H
+
+#include <stddef.h>
+#include <stdio.h>
+
+/*
+ * A small size-class allocator for device payload buffers. Every block is
+ * rounded up to a power of two between 2^POOL_MIN_SHIFT and 2^POOL_MAX_SHIFT
+ * bytes and goes back onto a per-class free list when released, so once the
+ * free lists are warm, fetching and serving device data makes no heap calls.
+ * Anything bigger than the largest class goes straight to malloc/free.
+ * All of it is safe to call from any thread.
+ * */
+
+#define POOL_MIN_SHIFT          4
+#define POOL_MAX_SHIFT          16
+#define POOL_NR_CLASSES         (POOL_MAX_SHIFT - POOL_MIN_SHIFT + 1)
+
+/* How many bytes worth of free blocks we keep around per size class */
+#define POOL_CLASS_CACHE_BYTES  (256 * 1024)
+
+struct pool_stats {
+    unsigned long allocs;       /* blocks handed out */
+    unsigned long frees;        /* blocks given back */
+    unsigned long recycled;     /* allocations served from a free list */
+    unsigned long grows;        /* reallocations that had to move a block */
+    unsigned long heap_allocs;  /* calls we made to malloc() */
+    unsigned long heap_frees;   /* calls we made to free() */
+    size_t bytes_in_use;
+    size_t bytes_cached;
+};
+
+void *pool_alloc(size_t size);
+void *pool_zalloc(size_t size);
+void *pool_realloc(void *ptr, size_t size);
+void pool_free(void *ptr);
+size_t pool_capacity(void *ptr);
+void pool_get_stats(struct pool_stats *stats);
+void pool_print_stats(FILE *f);
+
+#endif
@@ -0,0 +1,268 @@
+#include <err.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include "replay.h"
+
+#define RECORD_BUFFER_SIZE      (1 << 20)
+
+static FILE *out;
+
+static uint8_t *trace;
+static size_t trace_len;
+static size_t cursor;                   /* where the records before the next exit start */
+static size_t input_used;               /* of the input record we're part way through */
+static struct replay_stats stats;
+static struct timespec started;
+
+static void close_recording(void)
+{
+    if (out && fclose(out) == EOF)
+        warn("writing the recording");
+    out = NULL;
+}
+
+static void start_recording(const char *path)
+{
+    struct replay_header hdr = { .magic = REPLAY_MAGIC, .version = REPLAY_VERSION };
+
+    out = fopen(path, "w");
+    if (!out)
+        err(1, "opening %s to record to", path);
+    setvbuf(out, NULL, _IOFBF, RECORD_BUFFER_SIZE);
+    if (fwrite(&hdr, sizeof(hdr), 1, out) != 1)
+        err(1, "writing %s", path);
+    atexit(close_recording);
+}
+
+/* The whole recording goes into memory up front, so playing it back never waits on the disk */
+static void start_replay(const char *path)
+{
+    struct replay_header hdr;
+    FILE *f = fopen(path, "r");
+    long len;
+
+    if (!f)
+        err(1, "opening %s to replay", path);
+    if (fseek(f, 0, SEEK_END) == -1 || (len = ftell(f)) == -1 || fseek(f, 0, SEEK_SET) == -1)
+        err(1, "reading %s", path);
+    if (fread(&hdr, sizeof(hdr), 1, f) != 1 || hdr.magic != REPLAY_MAGIC || hdr.version != REPLAY_VERSION)
+        errx(1, "%s isn't a recording we can replay", path);
+
+    trace_len = len - sizeof(hdr);
+    trace = malloc(trace_len ? trace_len : 1);
+    if (!trace)
+        err(1, "allocating the recording");
+    if (fread(trace, 1, trace_len, f) != trace_len)
+        err(1, "reading %s", path);
+    fclose(f);
+}
+
+void replay_init(void)
+{
+    const char *record = getenv("SPARKLER_RECORD");
+    const char *replay = getenv("SPARKLER_REPLAY");
+
+    if (record && replay)
+        errx(1, "SPARKLER_RECORD and SPARKLER_REPLAY can't both be set");
+    if (record)
+        start_recording(record);
+    else if (replay)
+        start_replay(replay);
+    clock_gettime(CLOCK_MONOTONIC, &started);
+}
+
+int replay_recording(void)
+{
+    return out != NULL;
+}
+
+int replay_replaying(void)
+{
+    return trace != NULL;
+}
+
+static void write_record(uint8_t type, uint8_t arg8, uint16_t arg16, uint32_t len, const void *data, size_t data_len)
+{
+    struct replay_record r = { .type = type, .arg8 = arg8, .arg16 = arg16, .len = len };
+
+    if (fwrite(&r, sizeof(r), 1, out) != 1 || (data_len && fwrite(data, 1, data_len, out) != data_len))
+        err(1, "writing the recording");
+    stats.bytes += sizeof(r) + data_len;
+}
+
+/* The record at off, or NULL past the end or if what's left of the recording is cut short */
+static struct replay_record *record_at(size_t off)
+{
+    struct replay_record *r = (struct replay_record *)(trace + off);
+
+    if (off + sizeof(*r) > trace_len || r->len > trace_len - off - sizeof(*r))
+        return NULL;
+    return r;
+}
+
+static size_t record_size(const struct replay_record *r)
+{
+    return sizeof(*r) + r->len;
+}
+
+/* The first record of type a device hasn't taken before the next exit, or NULL */
+static struct replay_record *find(uint8_t type, int device)
+{
+    struct replay_record *r;
+
+    for (size_t off = cursor; (r = record_at(off)); off += record_size(r)) {
+        if (r->type == REPLAY_EXIT_IO)
+            return NULL;
+        if (r->type == type && (device == -1 || r->arg16 == device))
+            return r;
+    }
+    return NULL;
+}
+
+/* Whether nothing's left that hasn't been played back */
+static int finished(void)
+{
+    struct replay_record *r;
+
+    for (size_t off = cursor; (r = record_at(off)); off += record_size(r)) {
+        if (!(r->type & REPLAY_CONSUMED))
+            return 0;
+    }
+    return 1;
+}
+
+/*
+ * The guest's I/O exit has been handled. Recording, it goes down as it
+ * is; playing back, it's checked against the exit recorded next, and
+ * everything before that had better have been used up by now.
+ * */
+void replay_exit_io(const struct kvm_run *run)
+{
+    const uint8_t *data = (const uint8_t *)run + run->io.data_offset;
+    size_t len = run->io.size * run->io.count;
+    uint8_t arg8 = run->io.size | (run->io.direction == KVM_EXIT_IO_OUT ? REPLAY_OUT : 0);
+    struct replay_record *r;
+    size_t off;
+
+    stats.exits++;
+    if (out) {
+        write_record(REPLAY_EXIT_IO, arg8, run->io.port, len, data, len);
+        return;
+    }
+    if (!trace)
+        return;
+
+    for (off = cursor; (r = record_at(off)) && r->type != REPLAY_EXIT_IO; off += record_size(r)) {
+        if (!(r->type & REPLAY_CONSUMED))
+            stats.unused++;
+    }
+    if (!r) {
+        cursor = trace_len;
+        return;
+    }
+    cursor = off + record_size(r);
+    input_used = 0;
+
+    if (r->arg16 != run->io.port || r->arg8 != arg8 || r->len != len || memcmp(r + 1, data, len) != 0) {
+        if (!stats.mismatched++)
+            warnx("replay: exit %lu to port %#x isn't the one recorded, to port %#x", stats.exits, run->io.port, r->arg16);
+    }
+}
+
+void replay_note_input(const void *buf, size_t len)
+{
+    if (out)
+        write_record(REPLAY_INPUT, 0, 0, len, buf, len);
+}
+
+/* Up to len bytes of recorded console input, 0 if there's none until the next exit, or -1 at the end */
+int replay_input(void *buf, size_t len)
+{
+    struct replay_record *r = find(REPLAY_INPUT, -1);
+
+    if (!r)
+        return finished() ? -1 : 0;
+    if (len > r->len - input_used)
+        len = r->len - input_used;
+    memcpy(buf, (uint8_t *)(r + 1) + input_used, len);
+    input_used += len;
+    if (input_used == r->len) {
+        r->type |= REPLAY_CONSUMED;
+        input_used = 0;
+    }
+    stats.bytes += len;
+    return len;
+}
+
+void replay_note_timer(uint32_t count)
+{
+    if (out && count)
+        write_record(REPLAY_TIMER, 0, 0, sizeof(count), &count, sizeof(count));
+}
+
+/* How many times the timer went off at this point when it was recorded */
+uint32_t replay_timer(void)
+{
+    struct replay_record *r = find(REPLAY_TIMER, -1);
+    uint32_t count;
+
+    if (!r || r->len != sizeof(count))
+        return 0;
+    r->type |= REPLAY_CONSUMED;
+    memcpy(&count, r + 1, sizeof(count));
+    return count;
+}
+
+void replay_note_payload(unsigned int device, int source, uint32_t latency_us, const struct blob *payload)
+{
+    size_t len = payload ? payload->len : 0;
+
+    if (!out)
+        return;
+    write_record(REPLAY_PAYLOAD, payload ? source : REPLAY_NO_PAYLOAD, device, sizeof(latency_us) + len,
+                 &latency_us, sizeof(latency_us));
+    if (len && fwrite(payload->data, 1, len, out) != len)
+        err(1, "writing the recording");
+    stats.bytes += len;
+}
+
+/*
+ * The payload device got at this point when it was recorded, with where
+ * it came from and how long it took, or NULL if it didn't get one.
+ * */
+struct blob *replay_payload(unsigned int device, int *source, uint32_t *latency_us)
+{
+    struct replay_record *r = find(REPLAY_PAYLOAD, device);
+
+    *source = REPLAY_NO_PAYLOAD;
+    *latency_us = 0;
+    if (!r || r->len < sizeof(*latency_us))
+        return NULL;
+    r->type |= REPLAY_CONSUMED;
+    stats.bytes += r->len;
+    *source = r->arg8;
+    memcpy(latency_us, r + 1, sizeof(*latency_us));
+    if (r->arg8 == REPLAY_NO_PAYLOAD)
+        return NULL;
+    return blob_from((uint8_t *)(r + 1) + sizeof(*latency_us), r->len - sizeof(*latency_us));
+}
+
+void replay_print_stats(FILE *f)
+{
+    struct timespec now;
+    double secs;
+
+    if (!out && !trace)
+        return;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    secs = (now.tv_sec - started.tv_sec) + (now.tv_nsec - started.tv_nsec) / 1e9;
+
+    if (out) {
+        fprintf(f, "record: %lu exits, %lu bytes\n", stats.exits, stats.bytes);
+        return;
+    }
+    fprintf(f, "replay: %lu exits in %.3f s, %.0f exits/s, %lu bytes, %lu exits not as recorded, %lu records unused%s\n",
+            stats.exits, secs, secs > 0 ? stats.exits / secs : 0.0, stats.bytes, stats.mismatched, stats.unused,
+            finished() ? "" : ", not all of it played back");
+}
@@ -0,0 +1,77 @@
+#ifndef SPARKLER_REPLAY_H
+#define SPARKLER_REPLAY_H
+
+#include <linux/kvm.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <stdio.h>
+#include "blob.h"
+
+/*
+ * Record a run and play it back, so performance runs are repeatable.
+ * SPARKLER_RECORD=file logs everything from outside that the guest's run
+ * depends on: console input, timer expiries and device payloads, along
+ * with every port I/O exit. SPARKLER_REPLAY=file runs the guest again on
+ * the same input and payloads, straight from the recording: no terminal,
+ * no network, and the timer goes off as soon as the guest waits for it,
+ * so the run goes as fast as we can handle its exits.
+ *
+ * The recording is a header followed by records, each a struct
+ * replay_record and len bytes of data. Everything a device took in while
+ * handling the guest up to an I/O exit comes before that exit's record,
+ * in whatever order it happened. On the way back, the devices take what
+ * they're after from the records before the next exit, and each exit is
+ * checked against its record: its port, direction, size and data.
+ *
+ * Two things would have the guest do something different every time, so
+ * neither is there while recording or playing back: kvmclock, which the
+ * guest reads for itself and times its fetches with, and the data pages,
+ * where payloads turn up whenever our thread gets round to them.
+ * */
+
+#define REPLAY_MAGIC            0x52525053  /* "SPRR" */
+#define REPLAY_VERSION          1
+
+enum replay_type {
+    REPLAY_EXIT_IO = 1,         /* data is what went in or out */
+    REPLAY_INPUT,               /* console input */
+    REPLAY_TIMER,               /* data is how many times it went off, 32 bits */
+    REPLAY_PAYLOAD,             /* how long the fetch took, 32 bits of microseconds, then the payload */
+};
+
+#define REPLAY_CONSUMED         0x80    /* in type, once a device has taken it on replay */
+#define REPLAY_OUT              0x80    /* in arg8 of an exit, along with its size */
+#define REPLAY_NO_PAYLOAD       0xff    /* in arg8 of a payload, for a fetch that failed */
+
+struct replay_header {
+    uint32_t magic;
+    uint32_t version;
+};
+
+struct replay_record {
+    uint8_t type;
+    uint8_t arg8;               /* an exit's size and direction, or where a payload came from */
+    uint16_t arg16;             /* an exit's port, or a payload's device */
+    uint32_t len;
+};
+
+struct replay_stats {
+    unsigned long exits;
+    unsigned long mismatched;   /* exits that weren't what was recorded */
+    unsigned long unused;       /* records nothing took before the exit they came before */
+    unsigned long bytes;        /* written or read */
+};
+
+void replay_init(void);
+int replay_recording(void);
+int replay_replaying(void);
+void replay_exit_io(const struct kvm_run *run);
+void replay_note_input(const void *buf, size_t len);
+int replay_input(void *buf, size_t len);
+void replay_note_timer(uint32_t count);
+uint32_t replay_timer(void);
+void replay_note_payload(unsigned int device, int source, uint32_t latency_us, const struct blob *payload);
+struct blob *replay_payload(unsigned int device, int *source, uint32_t *latency_us);
+void replay_print_stats(FILE *f);
+
+#endif
@@ -0,0 +1,89 @@
+#include <err.h>
+#include <linux/kvm.h>
+#include <pthread.h>
+#include <sys/ioctl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#include "placement.h"
+#include "rom.h"
+
+static pthread_mutex_t rom_lock = PTHREAD_MUTEX_INITIALIZER;
+static struct rom roms[ROM_MAX_IMAGES];
+static unsigned int nr_roms;
+
+/*
+ * The image open on fd, mapped read-only, or NULL if it can't be. Anyone
+ * who has already opened the same file gets the same mapping. A file can
+ * change under a mapping of it, so it had better not be written to while
+ * guests are running it.
+ * */
+struct rom *rom_open(int fd)
+{
+    long page_size = sysconf(_SC_PAGESIZE);
+    struct rom *rom = NULL;
+    struct stat st;
+    size_t size;
+    void *addr;
+
+    if (fstat(fd, &st) == -1 || st.st_size == 0)
+        return NULL;
+
+    pthread_mutex_lock(&rom_lock);
+    for (unsigned int i = 0; i < nr_roms; i++) {
+        if (roms[i].dev == st.st_dev && roms[i].ino == st.st_ino) {
+            rom = &roms[i];
+            rom->users++;
+            goto out;
+        }
+    }
+    if (nr_roms == ROM_MAX_IMAGES)
+        goto out;
+
+    /* The last page only goes as far as the file does; the rest of it reads as zeroes */
+    size = (st.st_size + page_size - 1) & ~(size_t)(page_size - 1);
+    addr = mmap(NULL, size, PROT_READ, MAP_SHARED, fd, 0);
+    if (addr == MAP_FAILED)
+        goto out;
+
+    rom = &roms[nr_roms++];
+    rom->dev = st.st_dev;
+    rom->ino = st.st_ino;
+    rom->addr = addr;
+    rom->size = size;
+    rom->users = 1;
+
+out:
+    pthread_mutex_unlock(&rom_lock);
+    return rom;
+}
+
+/* Map the image into a VM at gpa, through a slot of its own that the guest can only read */
+int rom_map(struct rom *rom, int vmfd, uint32_t slot, uint64_t gpa)
+{
+    struct kvm_userspace_memory_region region = {
+            .slot = slot,
+            .flags = KVM_MEM_READONLY,
+            .guest_phys_addr = gpa,
+            .memory_size = rom->size,
+            .userspace_addr = (uint64_t)rom->addr,
+    };
+
+    if (ioctl(vmfd, KVM_CHECK_EXTENSION, KVM_CAP_READONLY_MEM) <= 0)
+        return -1;
+    return ioctl(vmfd, KVM_SET_USER_MEMORY_REGION, &region);
+}
+
+void rom_print_stats(FILE *f)
+{
+    pthread_mutex_lock(&rom_lock);
+    for (unsigned int i = 0; i < nr_roms; i++) {
+        struct placement_usage u;
+
+        if (placement_usage(roms[i].addr, roms[i].size, &u) == -1)
+            continue;
+        fprintf(f, "rom %u: %zu KB, %u VMs here, %zu KB resident, %zu KB unique to this process, %zu KB proportional\n",
+                i, roms[i].size / 1024, roms[i].users, u.resident / 1024, u.unique / 1024, u.proportional / 1024);
+    }
+    pthread_mutex_unlock(&rom_lock);
+}
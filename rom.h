@@ -0,0 +1,32 @@
+#ifndef SPARKLER_ROM_H
+#define SPARKLER_ROM_H
+
+#include <stddef.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <sys/types.h>
+
+/*
+ * Guest images handed to KVM as read-only memory, mapped straight from
+ * their files, rather than copied into every guest's RAM. Every VM in a
+ * process running the same image gets the same mapping, and the page cache
+ * shares its pages with every other process that maps the file, so the
+ * host holds one copy of the image however many guests are running it.
+ * A guest writing to it gets an MMIO exit rather than its own copy.
+ * */
+
+#define ROM_MAX_IMAGES          8
+
+struct rom {
+    dev_t dev;
+    ino_t ino;
+    void *addr;
+    size_t size;                /* of the mapping, a whole number of pages */
+    unsigned int users;
+};
+
+struct rom *rom_open(int fd);
+int rom_map(struct rom *rom, int vmfd, uint32_t slot, uint64_t gpa);
+void rom_print_stats(FILE *f);
+
+#endif
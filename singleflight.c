@@ -0,0 +1,130 @@
+#include <pthread.h>
+#include <string.h>
+#include "pool.h"
+#include "singleflight.h"
+
+struct flight {
+    struct flight *next;
+    char *key;
+    pthread_cond_t done;
+    int finished;
+    unsigned int waiters;
+    struct blob *result;    /* the waiters' reference, which the last of them drops */
+};
+
+static pthread_mutex_t flights_lock = PTHREAD_MUTEX_INITIALIZER;
+static struct flight *flights;
+static struct singleflight_stats stats;
+
+static char *pool_strdup(const char *s)
+{
+    size_t len = strlen(s) + 1;
+    char *copy = pool_alloc(len);
+
+    if (copy)
+        memcpy(copy, s, len);
+    return copy;
+}
+
+static struct flight *find_flight(const char *key)
+{
+    for (struct flight *f = flights; f; f = f->next) {
+        if (strcmp(f->key, key) == 0)
+            return f;
+    }
+    return NULL;
+}
+
+static void unlink_flight(struct flight *f)
+{
+    struct flight **pp = &flights;
+
+    while (*pp != f)
+        pp = &(*pp)->next;
+    *pp = f->next;
+}
+
+static void free_flight(struct flight *f)
+{
+    pthread_cond_destroy(&f->done);
+    blob_put(f->result);
+    pool_free(f->key);
+    pool_free(f);
+}
+
+/* Wait for someone else's fetch of the same key. Called, and returns, with flights_lock held. */
+static struct blob *join_flight(struct flight *f)
+{
+    struct blob *result;
+
+    f->waiters++;
+    stats.shared++;
+    while (!f->finished)
+        pthread_cond_wait(&f->done, &flights_lock);
+
+    result = blob_get(f->result);
+    if (--f->waiters == 0)
+        free_flight(f);
+    return result;
+}
+
+struct blob *singleflight_do(const char *key, singleflight_fn fn)
+{
+    struct flight *f;
+    struct blob *result;
+
+    pthread_mutex_lock(&flights_lock);
+    f = find_flight(key);
+    if (f) {
+        result = join_flight(f);
+        pthread_mutex_unlock(&flights_lock);
+        return result;
+    }
+
+    f = pool_zalloc(sizeof(*f));
+    if (f)
+        f->key = pool_strdup(key);
+    if (!f || !f->key) {
+        /* Can't track it, so don't; just go and fetch */
+        pool_free(f);
+        stats.flights++;
+        pthread_mutex_unlock(&flights_lock);
+        return fn(key);
+    }
+    pthread_cond_init(&f->done, NULL);
+    f->next = flights;
+    flights = f;
+    stats.flights++;
+    pthread_mutex_unlock(&flights_lock);
+
+    result = fn(key);
+
+    pthread_mutex_lock(&flights_lock);
+    unlink_flight(f);
+    f->finished = 1;
+    if (f->waiters) {
+        f->result = blob_get(result);
+        pthread_cond_broadcast(&f->done);
+    } else {
+        free_flight(f);
+    }
+    pthread_mutex_unlock(&flights_lock);
+
+    return result;
+}
+
+void singleflight_get_stats(struct singleflight_stats *out)
+{
+    pthread_mutex_lock(&flights_lock);
+    *out = stats;
+    pthread_mutex_unlock(&flights_lock);
+}
+
+void singleflight_print_stats(FILE *f)
+{
+    struct singleflight_stats s;
+
+    singleflight_get_stats(&s);
+    fprintf(f, "singleflight: %lu fetches, %lu callers shared an in-flight fetch\n",
+            s.flights, s.shared);
+}
@@ -0,0 +1,27 @@
+#ifndef SPARKLER_SINGLEFLIGHT_H
+#define SPARKLER_SINGLEFLIGHT_H
+
+#include <stdio.h>
+#include "blob.h"
+
+/*
+ * Collapses concurrent fetches of the same thing into one. The first
+ * caller for a key runs the fetch; anybody who asks for that key while
+ * it's still in flight waits for it instead of going to the service
+ * themselves, and gets a reference to the same result. Once a fetch finishes
+ * the key is forgotten, so the next caller fetches afresh.
+ * */
+
+/* Fetch whatever `key` names, returning a reference to the result or NULL */
+typedef struct blob *(*singleflight_fn)(const char *key);
+
+struct singleflight_stats {
+    unsigned long flights;      /* fetches we actually made */
+    unsigned long shared;       /* callers who piggybacked on someone else's fetch */
+};
+
+struct blob *singleflight_do(const char *key, singleflight_fn fn);
+void singleflight_get_stats(struct singleflight_stats *stats);
+void singleflight_print_stats(FILE *f);
+
+#endif
@@ -0,0 +1,510 @@
+/*
+ * A local stand-in for the sparkler service. It serves made-up but
+ * plausible tweets, weather forecasts and air quality readings on the same
+ * paths as the real thing, as JSON or, for clients that ask for it in
+ * their Accept header, in the binary wire format from wire.h.
+ *
+ * Like the real service, it compresses larger responses for clients that
+ * accept gzip, and labels each response with an ETag and Last-Modified
+ * date so that a client polling for something that hasn't changed gets a
+ * bodiless 304 back.
+ *
+ * It can also be made to misbehave, to see how sparkler copes with a
+ * service that's slow or failing. STANDIN_DELAY_MS holds up every
+ * response; STANDIN_SLOW_PERCENT of them are held up for STANDIN_SLOW_MS
+ * more on top, making for a long tail; and STANDIN_ERROR_PERCENT of them
+ * get a 503 instead.
+ *
+ * Usage: ./standin [port]
+ * then run sparkler with SPARKLER_SERVICE=http://127.0.0.1:<port>
+ * */
+#include <err.h>
+#include <netinet/in.h>
+#include <pthread.h>
+#include <signal.h>
+#include <stdarg.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <sys/socket.h>
+#include <time.h>
+#include <unistd.h>
+#include <zlib.h>
+#include "pool.h"
+#include "wire.h"
+
+#define STANDIN_PORT        8080
+#define REQUEST_MAX         8192
+#define JSON_MAX            16384
+#define FORECAST_DAYS       6
+
+/* Bodies smaller than this aren't worth compressing */
+#define GZIP_MIN_SIZE       256
+
+static const char *const weather_states[] = {
+    "Clear", "Light Cloud", "Heavy Cloud", "Showers", "Light Rain", "Thunderstorm",
+};
+
+static const char latest_tweet[] = "echo \"Hello, $USER\" | tr 'a-z' 'A-Z'  # Shout at whoever is logged in";
+
+struct request {
+    char path[256];
+    char city[128];
+    char country[8];
+    int wants_wire;
+    int accepts_gzip;
+    char if_none_match[128];
+    char if_modified_since[64];
+};
+
+struct response {
+    const char *content_type;
+    char *body;             /* pool memory */
+    size_t len;
+};
+
+/* Every city gets its own weather, but the same weather every time it asks */
+static unsigned int city_seed(const char *city)
+{
+    unsigned int h = 5381;
+
+    while (*city)
+        h = h * 33 + (unsigned char)*city++;
+    return h;
+}
+
+static void url_decode(char *dst, size_t size, const char *src, size_t len)
+{
+    size_t n = 0;
+
+    for (size_t i = 0; i < len && n + 1 < size; i++) {
+        if (src[i] == '%' && i + 2 < len) {
+            char hex[3] = { src[i + 1], src[i + 2], 0 };
+
+            dst[n++] = strtol(hex, NULL, 16);
+            i += 2;
+        } else {
+            dst[n++] = src[i] == '+' ? ' ' : src[i];
+        }
+    }
+    dst[n] = '\0';
+}
+
+/* Copy a header's value, sans leading blanks, if hdr is that header */
+static void header_value(const char *hdr, const char *name, char *out, size_t size)
+{
+    size_t name_len = strlen(name);
+
+    if (strncasecmp(hdr, name, name_len) != 0 || hdr[name_len] != ':')
+        return;
+    hdr += name_len + 1;
+    hdr += strspn(hdr, " \t");
+    snprintf(out, size, "%s", hdr);
+}
+
+static void query_param(const char *query, const char *name, char *out, size_t size)
+{
+    size_t name_len = strlen(name);
+
+    out[0] = '\0';
+    while (query && *query) {
+        const char *end = strchr(query, '&');
+        size_t len = end ? (size_t)(end - query) : strlen(query);
+
+        if (len > name_len && strncmp(query, name, name_len) == 0 && query[name_len] == '=') {
+            url_decode(out, size, query + name_len + 1, len - name_len - 1);
+            return;
+        }
+        query = end ? end + 1 : NULL;
+    }
+}
+
+/* Parse the request line and the headers we care about. Returns -1 on anything we can't serve. */
+static int parse_request(char *text, struct request *req)
+{
+    char *line_end = strstr(text, "\r\n");
+    char *target, *query, *hdr;
+
+    memset(req, 0, sizeof(*req));
+    if (!line_end || strncmp(text, "GET ", 4) != 0)
+        return -1;
+    *line_end = '\0';
+    target = text + 4;
+    target[strcspn(target, " ")] = '\0';
+
+    query = strchr(target, '?');
+    if (query)
+        *query++ = '\0';
+    snprintf(req->path, sizeof(req->path), "%s", target);
+    query_param(query, "city", req->city, sizeof(req->city));
+    query_param(query, "country", req->country, sizeof(req->country));
+
+    for (hdr = line_end + 2; *hdr && strncmp(hdr, "\r\n", 2) != 0; ) {
+        char *next = strstr(hdr, "\r\n");
+
+        if (!next)
+            break;
+        *next = '\0';
+        if (strncasecmp(hdr, "Accept:", 7) == 0 && strstr(hdr, WIRE_CONTENT_TYPE))
+            req->wants_wire = 1;
+        if (strncasecmp(hdr, "Accept-Encoding:", 16) == 0 && strstr(hdr, "gzip"))
+            req->accepts_gzip = 1;
+        header_value(hdr, "If-None-Match", req->if_none_match, sizeof(req->if_none_match));
+        header_value(hdr, "If-Modified-Since", req->if_modified_since, sizeof(req->if_modified_since));
+        hdr = next + 2;
+    }
+    return 0;
+}
+
+static size_t json_append(char *buf, size_t len, const char *fmt, ...)
+{
+    va_list ap;
+    int n;
+
+    va_start(ap, fmt);
+    n = vsnprintf(buf + len, JSON_MAX - len, fmt, ap);
+    va_end(ap);
+    if (n < 0 || len + n >= JSON_MAX)
+        return JSON_MAX - 1;
+    return len + n;
+}
+
+static size_t json_append_string(char *buf, size_t len, const char *s)
+{
+    len = json_append(buf, len, "\"");
+    for (; *s; s++) {
+        if (*s == '"' || *s == '\\')
+            len = json_append(buf, len, "\\%c", *s);
+        else if ((unsigned char)*s < 0x20)
+            len = json_append(buf, len, "\\u%04x", *s);
+        else
+            len = json_append(buf, len, "%c", *s);
+    }
+    return json_append(buf, len, "\"");
+}
+
+static void forecast_day(const char *city, int day, char *date, size_t date_size,
+                         const char **state, double *min_temp, double *max_temp, int *humidity)
+{
+    unsigned int seed = city_seed(city) + day * 7919;
+    time_t when = time(NULL) + day * 86400;
+    struct tm tm;
+
+    gmtime_r(&when, &tm);
+    strftime(date, date_size, "%Y-%m-%d", &tm);
+    *state = weather_states[seed % (sizeof(weather_states) / sizeof(weather_states[0]))];
+    *min_temp = 5 + (seed % 2000) / 100.0;
+    *max_temp = *min_temp + 3 + (seed % 700) / 100.0;
+    *humidity = 30 + seed % 65;
+}
+
+static void air_quality_station(const char *city, int station, char *location, size_t location_size,
+                                 char *reading, size_t reading_size)
+{
+    static const char *const areas[] = { "Central", "North", "Airport" };
+
+    snprintf(location, location_size, "%s %s", city, areas[station]);
+    snprintf(reading, reading_size, "pm25: %u", 20 + (city_seed(city) + station * 31) % 150);
+}
+
+static int build_wire(const struct request *req, struct response *resp)
+{
+    struct wire_writer w;
+
+    if (strcmp(req->path, "/tweet") == 0) {
+        wire_begin(&w, WIRE_KIND_TWEET, WIRE_STATUS_SUCCESS);
+        wire_put_tweet(&w, latest_tweet);
+    } else if (strcmp(req->path, "/weather") == 0) {
+        wire_begin(&w, WIRE_KIND_WEATHER, WIRE_STATUS_SUCCESS);
+        for (int day = 0; day < FORECAST_DAYS; day++) {
+            char date[16];
+            const char *state;
+            double min_temp, max_temp;
+            int humidity;
+
+            forecast_day(req->city, day, date, sizeof(date), &state, &min_temp, &max_temp, &humidity);
+            wire_put_weather(&w, date, state, min_temp, max_temp, humidity);
+        }
+    } else if (strcmp(req->path, "/air_quality") == 0) {
+        wire_begin(&w, WIRE_KIND_AIR_QUALITY, WIRE_STATUS_SUCCESS);
+        for (int station = 0; station < 3; station++) {
+            char location[160], reading[32];
+
+            air_quality_station(req->city, station, location, sizeof(location), reading, sizeof(reading));
+            wire_put_air_quality(&w, location, reading);
+        }
+    } else {
+        return -1;
+    }
+
+    if (wire_end(&w) == -1)
+        return -1;
+    resp->content_type = WIRE_CONTENT_TYPE;
+    resp->body = (char *)w.buf;
+    resp->len = w.len;
+    return 0;
+}
+
+static int build_json(const struct request *req, struct response *resp)
+{
+    char *buf = pool_alloc(JSON_MAX);
+    size_t len = 0;
+
+    if (!buf)
+        return -1;
+
+    if (strcmp(req->path, "/tweet") == 0) {
+        len = json_append(buf, len, "{\"status\":\"success\",\"tweet\":{\"text\":");
+        len = json_append_string(buf, len, latest_tweet);
+        len = json_append(buf, len, "}}");
+    } else if (strcmp(req->path, "/weather") == 0) {
+        len = json_append(buf, len, "{\"status\":\"success\",\"data\":{\"title\":");
+        len = json_append_string(buf, len, req->city);
+        len = json_append(buf, len, ",\"consolidated_weather\":[");
+        for (int day = 0; day < FORECAST_DAYS; day++) {
+            char date[16];
+            const char *state;
+            double min_temp, max_temp;
+            int humidity;
+
+            forecast_day(req->city, day, date, sizeof(date), &state, &min_temp, &max_temp, &humidity);
+            len = json_append(buf, len, "%s{\"applicable_date\":\"%s\",\"weather_state_name\":\"%s\","
+                                        "\"min_temp\":%.3f,\"max_temp\":%.3f,\"humidity\":%d}",
+                              day ? "," : "", date, state, min_temp, max_temp, humidity);
+        }
+        len = json_append(buf, len, "]}}");
+    } else if (strcmp(req->path, "/air_quality") == 0) {
+        len = json_append(buf, len, "{\"status\":\"success\",\"data\":[");
+        for (int station = 0; station < 3; station++) {
+            char location[160], reading[32];
+
+            air_quality_station(req->city, station, location, sizeof(location), reading, sizeof(reading));
+            len = json_append(buf, len, "%s{", station ? "," : "");
+            len = json_append_string(buf, len, location);
+            len = json_append(buf, len, ":\"%s\"}", reading);
+        }
+        len = json_append(buf, len, "]}");
+    } else {
+        pool_free(buf);
+        return -1;
+    }
+
+    resp->content_type = "application/json";
+    resp->body = buf;
+    resp->len = len;
+    return 0;
+}
+
+static int write_all(int fd, const void *buf, size_t len)
+{
+    const char *p = buf;
+
+    while (len) {
+        ssize_t n = write(fd, p, len);
+
+        if (n <= 0)
+            return -1;
+        p += n;
+        len -= n;
+    }
+    return 0;
+}
+
+/* Replace the body with its gzip encoding. Leaves it alone and returns -1 if that fails. */
+static int gzip_body(struct response *resp)
+{
+    z_stream zs = { 0 };
+    uLong bound;
+    char *out;
+
+    if (deflateInit2(&zs, Z_DEFAULT_COMPRESSION, Z_DEFLATED, 15 + 16, 8, Z_DEFAULT_STRATEGY) != Z_OK)
+        return -1;
+    bound = deflateBound(&zs, resp->len);
+    out = pool_alloc(bound);
+    if (!out) {
+        deflateEnd(&zs);
+        return -1;
+    }
+
+    zs.next_in = (Bytef *)resp->body;
+    zs.avail_in = resp->len;
+    zs.next_out = (Bytef *)out;
+    zs.avail_out = bound;
+    if (deflate(&zs, Z_FINISH) != Z_STREAM_END) {
+        deflateEnd(&zs);
+        pool_free(out);
+        return -1;
+    }
+
+    pool_free(resp->body);
+    resp->body = out;
+    resp->len = zs.total_out;
+    deflateEnd(&zs);
+    return 0;
+}
+
+/*
+ * Everything we serve is regenerated from the date and the request, so
+ * an entity tag is just a hash of the body, and nothing changes before
+ * midnight UTC.
+ * */
+static void make_validators(const struct response *resp, char *etag, size_t etag_size,
+                            char *last_modified, size_t last_modified_size)
+{
+    uint32_t h = 2166136261u;
+    time_t midnight = time(NULL) / 86400 * 86400;
+    struct tm tm;
+
+    for (size_t i = 0; i < resp->len; i++)
+        h = (h ^ (uint8_t)resp->body[i]) * 16777619u;
+    snprintf(etag, etag_size, "\"%08x\"", h);
+
+    gmtime_r(&midnight, &tm);
+    strftime(last_modified, last_modified_size, "%a, %d %b %Y %H:%M:%S GMT", &tm);
+}
+
+static int not_modified(const struct request *req, const char *etag, const char *last_modified)
+{
+    /* If-None-Match wins when it's there, as RFC 7232 has it */
+    if (req->if_none_match[0])
+        return strcmp(req->if_none_match, "*") == 0 || strstr(req->if_none_match, etag) != NULL;
+    return req->if_modified_since[0] && strcmp(req->if_modified_since, last_modified) == 0;
+}
+
+static int env_int(const char *name)
+{
+    const char *value = getenv(name);
+
+    return value ? atoi(value) : 0;
+}
+
+/* Hold up the response, or tell the caller to fail it, as the STANDIN_* settings say */
+static int misbehave(void)
+{
+    static __thread unsigned int seed;
+    int delay_ms = env_int("STANDIN_DELAY_MS");
+
+    if (!seed)
+        seed = time(NULL) ^ (unsigned int)pthread_self();
+    if ((int)(rand_r(&seed) % 100) < env_int("STANDIN_SLOW_PERCENT"))
+        delay_ms += env_int("STANDIN_SLOW_MS");
+    if (delay_ms > 0)
+        usleep(delay_ms * 1000);
+    return (int)(rand_r(&seed) % 100) < env_int("STANDIN_ERROR_PERCENT") ? -1 : 0;
+}
+
+static int send_response(int fd, const struct request *req)
+{
+    struct response resp;
+    char head[512], etag[16], last_modified[64];
+    int n, ret, gzipped = 0;
+
+    if (misbehave() == -1) {
+        static const char unavailable[] = "HTTP/1.1 503 Service Unavailable\r\nContent-Length: 0\r\n\r\n";
+
+        return write_all(fd, unavailable, sizeof(unavailable) - 1);
+    }
+
+    if ((req->wants_wire ? build_wire(req, &resp) : build_json(req, &resp)) == -1) {
+        static const char not_found[] = "HTTP/1.1 404 Not Found\r\nContent-Length: 0\r\n\r\n";
+
+        return write_all(fd, not_found, sizeof(not_found) - 1);
+    }
+
+    make_validators(&resp, etag, sizeof(etag), last_modified, sizeof(last_modified));
+    if (not_modified(req, etag, last_modified)) {
+        pool_free(resp.body);
+        n = snprintf(head, sizeof(head), "HTTP/1.1 304 Not Modified\r\nETag: %s\r\n"
+                                         "Last-Modified: %s\r\nVary: Accept, Accept-Encoding\r\n\r\n",
+                     etag, last_modified);
+        return write_all(fd, head, n);
+    }
+
+    if (req->accepts_gzip && resp.len >= GZIP_MIN_SIZE)
+        gzipped = gzip_body(&resp) == 0;
+
+    n = snprintf(head, sizeof(head), "HTTP/1.1 200 OK\r\nContent-Type: %s\r\nContent-Length: %zu\r\n"
+                                     "%sETag: %s\r\nLast-Modified: %s\r\nVary: Accept, Accept-Encoding\r\n\r\n",
+                 resp.content_type, resp.len, gzipped ? "Content-Encoding: gzip\r\n" : "",
+                 etag, last_modified);
+    ret = write_all(fd, head, n);
+    if (ret == 0)
+        ret = write_all(fd, resp.body, resp.len);
+    pool_free(resp.body);
+    return ret;
+}
+
+/* Serve one keep-alive connection until the client goes away */
+static void *serve_connection(void *arg)
+{
+    int fd = (int)(long)arg;
+    char buf[REQUEST_MAX + 1];
+    size_t used = 0;
+
+    while (1) {
+        char *end;
+        ssize_t n;
+
+        n = read(fd, buf + used, REQUEST_MAX - used);
+        if (n <= 0)
+            break;
+        used += n;
+        buf[used] = '\0';
+
+        while ((end = strstr(buf, "\r\n\r\n"))) {
+            size_t request_len = end + 4 - buf;
+            struct request req;
+
+            end[2] = '\0';
+            if (parse_request(buf, &req) == -1 || send_response(fd, &req) == -1)
+                goto out;
+            memmove(buf, buf + request_len, used - request_len + 1);
+            used -= request_len;
+        }
+        if (used == REQUEST_MAX)
+            break;      /* headers too big for us */
+    }
+
+out:
+    close(fd);
+    return NULL;
+}
+
+int main(int argc, char *argv[])
+{
+    int port = argc > 1 ? atoi(argv[1]) : STANDIN_PORT;
+    struct sockaddr_in addr = {
+            .sin_family = AF_INET,
+            .sin_addr.s_addr = htonl(INADDR_LOOPBACK),
+            .sin_port = htons(port),
+    };
+    int one = 1;
+    int sock;
+
+    signal(SIGPIPE, SIG_IGN);
+
+    sock = socket(AF_INET, SOCK_STREAM, 0);
+    if (sock == -1)
+        err(1, "socket");
+    setsockopt(sock, SOL_SOCKET, SO_REUSEADDR, &one, sizeof(one));
+    if (bind(sock, (struct sockaddr *)&addr, sizeof(addr)) == -1)
+        err(1, "bind to port %d", port);
+    if (listen(sock, 64) == -1)
+        err(1, "listen");
+    printf("sparkler stand-in service listening on http://127.0.0.1:%d\n", port);
+    fflush(stdout);
+
+    while (1) {
+        pthread_t thread;
+        int fd = accept(sock, NULL, NULL);
+
+        if (fd == -1)
+            continue;
+        if (pthread_create(&thread, NULL, serve_connection, (void *)(long)fd) != 0) {
+            close(fd);
+            continue;
+        }
+        pthread_detach(thread);
+    }
+}
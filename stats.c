@@ -0,0 +1,80 @@
+#include <err.h>
+#include <linux/kvm.h>
+#include <sys/ioctl.h>
+#include <sys/mman.h>
+#include "stats.h"
+
+static struct stats_page *stats;
+
+/* Map the stats page into the guest, read-only, at STATS_PAGE_ADDR */
+void stats_init(int vmfd)
+{
+    struct kvm_userspace_memory_region region = {
+            .slot = STATS_SLOT,
+            .flags = KVM_MEM_READONLY,
+            .guest_phys_addr = STATS_PAGE_ADDR,
+            .memory_size = STATS_PAGE_SIZE,
+    };
+
+    if (ioctl(vmfd, KVM_CHECK_EXTENSION, KVM_CAP_READONLY_MEM) <= 0)
+        errx(1, "KVM can't map memory read-only into the guest");
+
+    stats = mmap(NULL, STATS_PAGE_SIZE, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (stats == MAP_FAILED)
+        err(1, "allocating the stats page");
+    stats->magic = STATS_MAGIC;
+    stats->version = STATS_VERSION;
+    stats->nr_devices = STATS_NR_DEVICES;
+
+    region.userspace_addr = (uint64_t)stats;
+    if (ioctl(vmfd, KVM_SET_USER_MEMORY_REGION, &region) == -1)
+        err(1, "KVM_SET_USER_MEMORY_REGION for the stats page");
+}
+
+void stats_exit(uint32_t exit_reason)
+{
+    stats->exits++;
+    switch (exit_reason) {
+        case KVM_EXIT_IO:
+            stats->io_exits++;
+            break;
+        case KVM_EXIT_MMIO:
+            stats->mmio_exits++;
+            break;
+        case KVM_EXIT_HLT:
+            stats->hlt_exits++;
+            break;
+    }
+}
+
+void stats_interrupt(void)
+{
+    stats->interrupts++;
+}
+
+/* A device payload was fetched for the guest, or we tried */
+void stats_fetch(unsigned int device, uint32_t latency_us, int hit, int failed, size_t bytes)
+{
+    struct stats_device *dev = &stats->devices[device];
+
+    dev->fetches++;
+    dev->last_latency_us = latency_us;
+    if (failed)
+        dev->failures++;
+    else if (hit)
+        dev->hits++;
+    else
+        dev->misses++;
+    dev->bytes += bytes;
+}
+
+void stats_port_read(unsigned int device)
+{
+    stats->devices[device].exits++;
+}
+
+/* Whether an MMIO exit at addr was the guest writing to the stats page, which we just ignore */
+int stats_mmio(uint64_t addr)
+{
+    return addr >= STATS_PAGE_ADDR && addr < STATS_PAGE_ADDR + STATS_PAGE_SIZE;
+}
@@ -0,0 +1,56 @@
+#ifndef SPARKLER_STATS_H
+#define SPARKLER_STATS_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+/*
+ * Counters the guest can read for itself. They live in a page of their
+ * own, mapped into the guest read-only through a KVM_MEM_READONLY slot,
+ * so looking at them costs the guest nothing and it can't scribble on
+ * them. We update them in place as exits come in and devices get read.
+ * Everything is 32 bits, which a 16-bit guest can at least print, and
+ * simply wraps.
+ * */
+
+#define STATS_PAGE_ADDR         0xd0000
+#define STATS_PAGE_SIZE         0x1000
+#define STATS_SLOT              1
+#define STATS_MAGIC             0x54535053  /* "SPST" */
+#define STATS_VERSION           1
+
+/* The tweet device, then the six weather devices, then the six air quality ones */
+#define STATS_NR_DEVICES        13
+
+struct stats_device {
+    uint32_t fetches;           /* payloads handed to the guest, successful or not */
+    uint32_t hits;              /* served from memory or the disk cache */
+    uint32_t misses;            /* had to wait for the service */
+    uint32_t failures;
+    uint32_t last_latency_us;   /* how long the last fetch took us */
+    uint32_t bytes;             /* payload bytes handed over */
+    uint32_t exits;             /* reads of the device's own port */
+    uint32_t reserved;
+};
+
+struct stats_page {
+    uint32_t magic;
+    uint16_t version;
+    uint16_t nr_devices;
+    uint32_t exits;             /* every exit from KVM_RUN */
+    uint32_t io_exits;
+    uint32_t mmio_exits;
+    uint32_t hlt_exits;
+    uint32_t interrupts;        /* injected into the guest */
+    uint32_t reserved;
+    struct stats_device devices[STATS_NR_DEVICES];
+};
+
+void stats_init(int vmfd);
+void stats_exit(uint32_t exit_reason);
+void stats_interrupt(void);
+void stats_fetch(unsigned int device, uint32_t latency_us, int hit, int failed, size_t bytes);
+void stats_port_read(unsigned int device);
+int stats_mmio(uint64_t addr);
+
+#endif
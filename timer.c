@@ -0,0 +1,151 @@
+#include <err.h>
+#include <string.h>
+#include <sys/timerfd.h>
+#include <time.h>
+#include <unistd.h>
+#include "replay.h"
+#include "timer.h"
+
+void timer_init(struct timer *timer)
+{
+    memset(timer, 0, sizeof(*timer));
+    timer->fd = timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK | TFD_CLOEXEC);
+    if (timer->fd == -1)
+        err(1, "timerfd_create");
+}
+
+static uint64_t now_ns(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+static void ms_to_timespec(uint64_t ms, struct timespec *ts)
+{
+    ts->tv_sec = ms / 1000;
+    ts->tv_nsec = (ms % 1000) * 1000000;
+}
+
+/* First expiry in first_ns, then every interval if it's periodic. A zero first_ns disarms it. */
+static void arm(struct timer *timer, uint64_t first_ns)
+{
+    struct itimerspec its = { 0 };
+
+    its.it_value.tv_sec = first_ns / 1000000000;
+    its.it_value.tv_nsec = first_ns % 1000000000;
+    if (first_ns && (timer->control & TIMER_PERIODIC))
+        ms_to_timespec(timer->interval, &its.it_interval);
+    /* Never later than the timerfd's own idea of it, or we'd ignore it for a moment after it fires */
+    timer->deadline = now_ns() + first_ns;
+    if (timerfd_settime(timer->fd, 0, &its, NULL) == -1)
+        err(1, "timerfd_settime");
+}
+
+/*
+ * Fold in whatever the timerfd has counted since we last asked. This is
+ * called on every exit while the timer is armed, so it doesn't bother the
+ * kernel until the next expiry is due.
+ * */
+static void collect(struct timer *timer)
+{
+    struct itimerspec its;
+    uint64_t count, now = now_ns();
+
+    if (!(timer->control & TIMER_ENABLE))
+        return;
+    if (replay_replaying()) {
+        /* Played back, it goes off exactly where it did before, however long that took */
+        count = replay_timer();
+        if (!count)
+            return;
+    } else {
+        if (now < timer->deadline || read(timer->fd, &count, sizeof(count)) != sizeof(count))
+            return;
+        replay_note_timer(count);
+    }
+
+    timer->expired += count;
+    if (!(timer->control & TIMER_PERIODIC))
+        timer->control &= ~TIMER_ENABLE;    /* a one-shot is done once it has gone off */
+    else if (timerfd_gettime(timer->fd, &its) == 0)
+        timer->deadline = now + its.it_value.tv_sec * 1000000000ULL + its.it_value.tv_nsec;
+}
+
+uint32_t timer_read(struct timer *timer, unsigned int reg)
+{
+    uint32_t value;
+
+    switch (reg) {
+        case TIMER_CONTROL:
+            collect(timer);
+            return timer->control;
+        case TIMER_INTERVAL:
+            return timer->interval;
+        case TIMER_STATUS:
+            collect(timer);
+            value = timer->expired;
+            timer->expired = 0;
+            return value;
+        default:
+            return 0xffffffff;
+    }
+}
+
+void timer_write(struct timer *timer, unsigned int reg, uint32_t value)
+{
+    switch (reg) {
+        case TIMER_CONTROL:
+            /* (Re)arming starts a fresh interval and forgets anything not yet acknowledged */
+            timer->control = value & (TIMER_ENABLE | TIMER_PERIODIC);
+            timer->expired = 0;
+            if (!timer->interval)
+                timer->control &= ~TIMER_ENABLE;
+            arm(timer, (timer->control & TIMER_ENABLE) ? timer->interval * 1000000ULL : 0);
+            break;
+        case TIMER_INTERVAL:
+            /* Takes effect the next time the timer is armed */
+            timer->interval = value;
+            break;
+        default:
+            /* STATUS is read-only */
+            break;
+    }
+}
+
+int timer_irq_pending(struct timer *timer)
+{
+    collect(timer);
+    return timer->expired != 0;
+}
+
+/* Whether the timer is going to go off, so there's a point in waiting for it */
+int timer_armed(struct timer *timer)
+{
+    return (timer->control & TIMER_ENABLE) != 0;
+}
+
+void timer_save(struct timer *timer, struct timer_state *state)
+{
+    struct itimerspec its;
+
+    collect(timer);
+    memset(state, 0, sizeof(*state));
+    state->control = timer->control;
+    state->interval = timer->interval;
+    state->expired = timer->expired;
+    if ((timer->control & TIMER_ENABLE) && timerfd_gettime(timer->fd, &its) == 0)
+        state->remaining_ns = its.it_value.tv_sec * 1000000000ULL + its.it_value.tv_nsec;
+}
+
+void timer_load(struct timer *timer, const struct timer_state *state)
+{
+    timer->control = state->control & (TIMER_ENABLE | TIMER_PERIODIC);
+    timer->interval = state->interval;
+    timer->expired = state->expired;
+    if (!(timer->control & TIMER_ENABLE))
+        arm(timer, 0);
+    else
+        arm(timer, state->remaining_ns ? state->remaining_ns : 1);
+}
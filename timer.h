@@ -0,0 +1,54 @@
+#ifndef SPARKLER_TIMER_H
+#define SPARKLER_TIMER_H
+
+#include <stdint.h>
+
+/*
+ * A programmable interval timer for the guest, on ports, backed by a
+ * timerfd. The guest sets an interval in milliseconds and arms it as a
+ * one-shot or periodic timer, and IRQ 0 stays raised until it has read
+ * how many times the timer has gone off since it last looked. Expiries
+ * are noticed when the guest next exits to us, or straight away while it
+ * sits in hlt, which is where a guest with nothing better to do waits.
+ *
+ * Telling the time doesn't need us at all: the guest points kvmclock's
+ * MSR at a page of its own, and KVM keeps that up to date.
+ * */
+
+#define TIMER_NR_REGS       12
+#define TIMER_IRQ           0
+
+/* Register offsets from the base port, 32 bits each */
+#define TIMER_CONTROL       0
+#define TIMER_INTERVAL      4       /* in milliseconds */
+#define TIMER_STATUS        8       /* in: expiries since the last read, which acknowledges them */
+
+#define TIMER_ENABLE        0x01
+#define TIMER_PERIODIC      0x02
+
+struct timer {
+    int fd;
+    uint32_t control;
+    uint32_t interval;
+    uint32_t expired;
+    uint64_t deadline;          /* CLOCK_MONOTONIC ns of the next expiry, so we only read the timerfd once it's due */
+};
+
+/* What the timer was up to, for carrying on in another process */
+struct timer_state {
+    uint32_t control;
+    uint32_t interval;
+    uint32_t expired;
+    uint32_t reserved;
+    uint64_t remaining_ns;      /* until it next goes off, or 0 if it won't */
+};
+
+void timer_init(struct timer *timer);
+uint32_t timer_read(struct timer *timer, unsigned int reg);
+void timer_write(struct timer *timer, unsigned int reg, uint32_t value);
+int timer_irq_pending(struct timer *timer);
+int timer_armed(struct timer *timer);
+void timer_save(struct timer *timer, struct timer_state *state);
+void timer_load(struct timer *timer, const struct timer_state *state);
+
+#endif
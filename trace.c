@@ -0,0 +1,204 @@
+#include <err.h>
+#include <pthread.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/syscall.h>
+#include <time.h>
+#include <unistd.h>
+#include "trace.h"
+
+#define TRACE_MAX_THREADS       1024    /* named in the output; any more just show up by number */
+
+struct trace_ring {
+    struct trace_ring *next;
+    int in_use;                 /* by a thread, which is the only one that writes to it */
+    pid_t tid;
+    const char *thread;
+    uint64_t head;              /* events ever written; the next one goes at head % TRACE_RING_EVENTS */
+    struct trace_event events[TRACE_RING_EVENTS];
+};
+
+int trace_on;
+
+static const char *path;
+static struct trace_ring *rings;
+static __thread struct trace_ring *ring;
+static pthread_key_t ring_key;
+static uint64_t started;
+static unsigned long nr_rings;
+
+uint64_t trace_clock(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+/* A thread that's done gives its ring up, events and all, for the next one to carry on in */
+static void release_ring(void *arg)
+{
+    struct trace_ring *r = arg;
+
+    __atomic_store_n(&r->in_use, 0, __ATOMIC_RELEASE);
+}
+
+/* A ring for the calling thread: one some thread has finished with, or a new one */
+static struct trace_ring *claim_ring(void)
+{
+    struct trace_ring *r;
+
+    for (r = __atomic_load_n(&rings, __ATOMIC_ACQUIRE); r; r = r->next) {
+        int unused = 0;
+
+        if (__atomic_compare_exchange_n(&r->in_use, &unused, 1, 0, __ATOMIC_ACQUIRE, __ATOMIC_RELAXED))
+            break;
+    }
+    if (!r) {
+        r = calloc(1, sizeof(*r));
+        if (!r)
+            return NULL;
+        r->in_use = 1;
+        r->next = __atomic_load_n(&rings, __ATOMIC_RELAXED);
+        while (!__atomic_compare_exchange_n(&rings, &r->next, r, 0, __ATOMIC_RELEASE, __ATOMIC_RELAXED))
+            ;
+        __atomic_add_fetch(&nr_rings, 1, __ATOMIC_RELAXED);
+    }
+
+    r->tid = syscall(SYS_gettid);
+    r->thread = NULL;
+    pthread_setspecific(ring_key, r);
+    ring = r;
+    return r;
+}
+
+void trace_record(const char *cat, const char *name, uint64_t start_ns, uint64_t end_ns, const char *arg_name, int64_t arg)
+{
+    struct trace_ring *r = ring ? ring : claim_ring();
+    struct trace_event *e;
+    uint64_t head;
+
+    if (!r)
+        return;
+    head = r->head;
+    e = &r->events[head % TRACE_RING_EVENTS];
+    e->cat = cat;
+    e->name = name;
+    e->arg_name = arg_name;
+    e->thread = r->thread;
+    e->start_ns = start_ns;
+    e->dur_ns = end_ns > start_ns ? end_ns - start_ns : 0;
+    e->arg = arg;
+    e->tid = r->tid;
+    __atomic_store_n(&r->head, head + 1, __ATOMIC_RELEASE);
+}
+
+/* What the calling thread shows up as from now on */
+void trace_thread_name(const char *name)
+{
+    struct trace_ring *r;
+
+    if (!trace_on)
+        return;
+    r = ring ? ring : claim_ring();
+    if (r)
+        r->thread = name;
+}
+
+static void write_event(FILE *f, const struct trace_event *e, pid_t pid, int *first)
+{
+    fprintf(f, "%s\n{\"ph\":\"X\",\"cat\":\"%s\",\"name\":\"%s\",\"pid\":%d,\"tid\":%d,\"ts\":%.3f,\"dur\":%.3f",
+            *first ? "" : ",", e->cat, e->name, pid, e->tid,
+            (e->start_ns - started) / 1000.0, e->dur_ns / 1000.0);
+    if (e->arg_name)
+        fprintf(f, ",\"args\":{\"%s\":%lld}", e->arg_name, (long long)e->arg);
+    fputc('}', f);
+    *first = 0;
+}
+
+/*
+ * Each ring from its oldest event on. Threads still going can carry on
+ * writing while we do, so every event is checked after it's been written
+ * out, and dropped if its slot had been gone round to again by then.
+ * */
+static void write_trace(void)
+{
+    struct { pid_t tid; const char *name; } threads[TRACE_MAX_THREADS];
+    unsigned int nr_threads = 0;
+    pid_t pid = getpid();
+    int first = 1;
+    FILE *f;
+
+    f = fopen(path, "w");
+    if (!f) {
+        warn("writing the trace to %s", path);
+        return;
+    }
+    fputs("{\"traceEvents\":[", f);
+
+    for (struct trace_ring *r = __atomic_load_n(&rings, __ATOMIC_ACQUIRE); r; r = r->next) {
+        uint64_t head = __atomic_load_n(&r->head, __ATOMIC_ACQUIRE);
+        uint64_t i = head > TRACE_RING_EVENTS ? head - TRACE_RING_EVENTS : 0;
+
+        for (; i < head; i++) {
+            struct trace_event e = r->events[i % TRACE_RING_EVENTS];
+            unsigned int t;
+
+            __atomic_thread_fence(__ATOMIC_ACQUIRE);
+            if (__atomic_load_n(&r->head, __ATOMIC_ACQUIRE) >= i + TRACE_RING_EVENTS)
+                continue;
+            write_event(f, &e, pid, &first);
+
+            for (t = 0; t < nr_threads && threads[t].tid != e.tid; t++)
+                ;
+            if (t == nr_threads && t < TRACE_MAX_THREADS) {
+                threads[t].tid = e.tid;
+                threads[t].name = NULL;
+                nr_threads++;
+            }
+            if (t < nr_threads && e.thread)
+                threads[t].name = e.thread;
+        }
+    }
+
+    for (unsigned int t = 0; t < nr_threads; t++) {
+        if (!threads[t].name)
+            continue;
+        fprintf(f, "%s\n{\"ph\":\"M\",\"name\":\"thread_name\",\"pid\":%d,\"tid\":%d,\"args\":{\"name\":\"%s\"}}",
+                first ? "" : ",", pid, threads[t].tid, threads[t].name);
+        first = 0;
+    }
+    fputs("\n],\"displayTimeUnit\":\"ns\"}\n", f);
+    if (fclose(f) == EOF)
+        warn("writing the trace to %s", path);
+}
+
+void trace_init(void)
+{
+    path = getenv("SPARKLER_TRACE");
+    if (!path || !*path)
+        return;
+    if (pthread_key_create(&ring_key, release_ring) != 0)
+        errx(1, "setting up tracing");
+    started = trace_clock();
+    trace_on = 1;
+    atexit(write_trace);
+}
+
+void trace_print_stats(FILE *f)
+{
+    struct trace_stats stats = { 0 };
+
+    if (!trace_on)
+        return;
+    for (struct trace_ring *r = __atomic_load_n(&rings, __ATOMIC_ACQUIRE); r; r = r->next) {
+        uint64_t head = __atomic_load_n(&r->head, __ATOMIC_ACQUIRE);
+
+        stats.events += head;
+        if (head > TRACE_RING_EVENTS)
+            stats.overwritten += head - TRACE_RING_EVENTS;
+    }
+    stats.rings = __atomic_load_n(&nr_rings, __ATOMIC_RELAXED);
+    fprintf(f, "trace: %lu events from %lu rings, %lu written over, to %s at exit\n",
+            stats.events, stats.rings, stats.overwritten, path);
+}
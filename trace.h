@@ -0,0 +1,65 @@
+#ifndef SPARKLER_TRACE_H
+#define SPARKLER_TRACE_H
+
+#include <stdint.h>
+#include <stdio.h>
+#include <sys/types.h>
+
+/*
+ * Spans of what we spend our time on, for looking at in a trace viewer.
+ * SPARKLER_TRACE=file.json has every thread that does anything traced
+ * note a span at a time into a ring of its own: each trip into the guest
+ * and the handling of the exit that brought us back, the phases of every
+ * fetch as curl timed them, and the parsing of what came back. At exit
+ * the rings are written out as Chrome trace event JSON, which Perfetto's
+ * UI and chrome://tracing both open as it is.
+ *
+ * Noting a span takes no lock: only the thread that owns a ring writes to
+ * it, and it publishes each event by moving the ring's head on past it.
+ * A ring that fills up starts over at its oldest events, so a long run
+ * keeps its last TRACE_RING_EVENTS spans a thread. Threads that finish
+ * hand their ring on to the next one to start. Without SPARKLER_TRACE,
+ * each span costs a test of trace_on.
+ * */
+
+#define TRACE_RING_EVENTS       16384   /* a thread, a power of two */
+
+/* Names are kept as pointers, so they have to be string literals or otherwise live for good */
+struct trace_event {
+    const char *cat;
+    const char *name;
+    const char *arg_name;       /* NULL if the span has no argument */
+    const char *thread;         /* what its thread was called at the time */
+    uint64_t start_ns;
+    uint64_t dur_ns;
+    int64_t arg;
+    pid_t tid;
+};
+
+struct trace_stats {
+    unsigned long events;
+    unsigned long rings;
+    unsigned long overwritten;  /* written over before we got to write them out */
+};
+
+extern int trace_on;
+
+void trace_init(void);
+uint64_t trace_clock(void);
+void trace_record(const char *cat, const char *name, uint64_t start_ns, uint64_t end_ns, const char *arg_name, int64_t arg);
+void trace_thread_name(const char *name);
+void trace_print_stats(FILE *f);
+
+/* When something starts, or 0 if we aren't tracing */
+static inline uint64_t trace_now(void)
+{
+    return trace_on ? trace_clock() : 0;
+}
+
+static inline void trace_span(const char *cat, const char *name, uint64_t start_ns, const char *arg_name, int64_t arg)
+{
+    if (trace_on)
+        trace_record(cat, name, start_ns, trace_clock(), arg_name, arg);
+}
+
+#endif
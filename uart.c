@@ -0,0 +1,237 @@
+#include <string.h>
+#include "console.h"
+#include "uart.h"
+
+void uart_init(struct uart *uart)
+{
+    memset(uart, 0, sizeof(*uart));
+}
+
+static unsigned int rx_capacity(struct uart *uart)
+{
+    /* With the FIFOs off, the receiver is a single holding register */
+    return (uart->fcr & UART_FCR_ENABLE) ? UART_FIFO_SIZE : 1;
+}
+
+static unsigned int rx_trigger(struct uart *uart)
+{
+    static const unsigned int levels[] = { 1, 4, 8, 14 };
+
+    if (!(uart->fcr & UART_FCR_ENABLE))
+        return 1;
+    return levels[uart->fcr >> 6];
+}
+
+static void rx_push(struct uart *uart, uint8_t c)
+{
+    if (uart->rx_count == rx_capacity(uart)) {
+        uart->lsr |= UART_LSR_OE;
+        return;
+    }
+    uart->rx_fifo[(uart->rx_head + uart->rx_count) % UART_FIFO_SIZE] = c;
+    uart->rx_count++;
+}
+
+static uint8_t rx_pop(struct uart *uart)
+{
+    uint8_t c = uart->rx_fifo[uart->rx_head];
+
+    uart->rx_head = (uart->rx_head + 1) % UART_FIFO_SIZE;
+    uart->rx_count--;
+    return c;
+}
+
+static void rx_clear(struct uart *uart)
+{
+    uart->rx_head = uart->rx_count = 0;
+}
+
+/*
+ * Move whatever the console has buffered into the RX FIFO. Anything that
+ * doesn't fit stays in the console's ring, which acts as flow control, so
+ * a fast paste never overruns the guest.
+ * */
+void uart_receive(struct uart *uart)
+{
+    int c;
+
+    if (uart->mcr & UART_MCR_LOOP)
+        return;     /* the line is disconnected in loopback mode */
+
+    while (uart->rx_count < rx_capacity(uart) && (c = console_trygetc()) != -1)
+        rx_push(uart, c);
+}
+
+/* The highest priority interrupt the guest has enabled and we have pending */
+static uint8_t uart_iir(struct uart *uart)
+{
+    if ((uart->ier & UART_IER_RLSI) && (uart->lsr & UART_LSR_OE))
+        return UART_IIR_RLSI;
+
+    if ((uart->ier & UART_IER_RDI) && uart->rx_count) {
+        if (uart->rx_count >= rx_trigger(uart))
+            return UART_IIR_RDI;
+        /* Nothing more is on its way from the console, so time out right away */
+        return UART_IIR_CTI;
+    }
+
+    if ((uart->ier & UART_IER_THRI) && uart->thri_pending)
+        return UART_IIR_THRI;
+
+    return UART_IIR_NO_INT;
+}
+
+/* Level of the IRQ line, which like on a PC only reaches the PIC with OUT2 set */
+int uart_irq_pending(struct uart *uart)
+{
+    if (!(uart->mcr & UART_MCR_OUT2))
+        return 0;
+    return uart_iir(uart) != UART_IIR_NO_INT;
+}
+
+/* Could anything coming in on the line ever raise an interrupt? */
+int uart_rx_irq_enabled(struct uart *uart)
+{
+    return (uart->mcr & UART_MCR_OUT2) && (uart->ier & UART_IER_RDI)
+           && !(uart->mcr & UART_MCR_LOOP);
+}
+
+static uint8_t uart_msr(struct uart *uart)
+{
+    uint8_t msr = 0;
+
+    if (!(uart->mcr & UART_MCR_LOOP))
+        return UART_MSR_DCD | UART_MSR_DSR | UART_MSR_CTS;
+
+    /* In loopback, the modem control outputs are wired to the status inputs */
+    if (uart->mcr & UART_MCR_RTS)
+        msr |= UART_MSR_CTS;
+    if (uart->mcr & UART_MCR_DTR)
+        msr |= UART_MSR_DSR;
+    if (uart->mcr & UART_MCR_OUT1)
+        msr |= UART_MSR_RI;
+    if (uart->mcr & UART_MCR_OUT2)
+        msr |= UART_MSR_DCD;
+    return msr;
+}
+
+/*
+ * Returns the register's value, -1 if the guest is waiting on input that
+ * will never come, or CONSOLE_INTERRUPTED if a migration cut its wait for
+ * input short and the read never happened.
+ * */
+int uart_read(struct uart *uart, unsigned int reg)
+{
+    uint8_t value;
+    int c;
+
+    switch (reg) {
+        case UART_RBR:
+            if (uart->lcr & UART_LCR_DLAB)
+                return uart->dll;
+            if (!uart->rx_count)
+                uart_receive(uart);
+            if (uart->rx_count) {
+                c = rx_pop(uart);
+            } else if (uart->mcr & UART_MCR_LOOP) {
+                return 0;
+            } else {
+                /*
+                 * Sparkler's serial port has always made a read wait for a key.
+                 * Guests that never look at LSR depend on that, so keep doing it
+                 * rather than hand them a stale byte.
+                 * */
+                c = console_getc();
+                if (c < 0)
+                    return c;
+            }
+            if (!(uart->mcr & UART_MCR_LOOP))
+                console_echo(c);
+            return c;
+        case UART_IER:
+            if (uart->lcr & UART_LCR_DLAB)
+                return uart->dlm;
+            return uart->ier;
+        case UART_IIR:
+            value = uart_iir(uart);
+            if (value == UART_IIR_THRI)
+                uart->thri_pending = 0;
+            if (uart->fcr & UART_FCR_ENABLE)
+                value |= UART_IIR_FIFO;
+            return value;
+        case UART_LCR:
+            return uart->lcr;
+        case UART_MCR:
+            return uart->mcr;
+        case UART_LSR:
+            uart_receive(uart);
+            value = uart->lsr | UART_LSR_THRE | UART_LSR_TEMT;
+            if (uart->rx_count)
+                value |= UART_LSR_DR;
+            uart->lsr &= ~UART_LSR_OE;  /* error bits clear on read */
+            return value;
+        case UART_MSR:
+            return uart_msr(uart);
+        case UART_SCR:
+            return uart->scr;
+        default:
+            return 0xff;
+    }
+}
+
+void uart_write(struct uart *uart, unsigned int reg, uint8_t value)
+{
+    switch (reg) {
+        case UART_THR:
+            if (uart->lcr & UART_LCR_DLAB) {
+                uart->dll = value;
+                break;
+            }
+            if (uart->mcr & UART_MCR_LOOP)
+                rx_push(uart, value);
+            else
+                console_putc(value);
+            /* The byte is on the wire already, so THR is empty again */
+            uart->thri_pending = 1;
+            break;
+        case UART_IER:
+            if (uart->lcr & UART_LCR_DLAB) {
+                uart->dlm = value;
+                break;
+            }
+            /* Enabling the THR empty interrupt while THR is empty fires it straight away */
+            if (!(uart->ier & UART_IER_THRI) && (value & UART_IER_THRI))
+                uart->thri_pending = 1;
+            uart->ier = value & 0x0f;
+            break;
+        case UART_FCR:
+            if ((value & UART_FCR_CLEAR_RX) || ((value ^ uart->fcr) & UART_FCR_ENABLE))
+                rx_clear(uart);
+            uart->fcr = value & (UART_FCR_ENABLE | UART_FCR_TRIGGER);
+            break;
+        case UART_LCR:
+            uart->lcr = value;
+            break;
+        case UART_MCR:
+            uart->mcr = value & 0x1f;
+            break;
+        case UART_SCR:
+            uart->scr = value;
+            break;
+        default:
+            /* LSR and MSR are read-only */
+            break;
+    }
+}
+
+/* A rep outsb to THR: the whole string goes out to the console in one go */
+void uart_transmit(struct uart *uart, const uint8_t *buf, unsigned int len)
+{
+    if ((uart->lcr & UART_LCR_DLAB) || (uart->mcr & UART_MCR_LOOP)) {
+        for (unsigned int i = 0; i < len; i++)
+            uart_write(uart, UART_THR, buf[i]);
+        return;
+    }
+    console_write(buf, len);
+    uart->thri_pending = 1;
+}
@@ -0,0 +1,84 @@
+#ifndef SPARKLER_UART_H
+#define SPARKLER_UART_H
+
+#include <stdint.h>
+
+/*
+ * A 16550A UART wired to the host console. Transmitted bytes go straight
+ * out to the console, which is an infinitely fast line as far as the guest
+ * can tell, so THR is always empty. Received bytes move from the console's
+ * ring into a 16 byte RX FIFO with the usual trigger levels, and the
+ * received-data, character-timeout and THR-empty interrupts are raised on
+ * IRQ 4 when the guest enables them and sets OUT2.
+ * */
+
+#define UART_NR_REGS        8
+#define UART_FIFO_SIZE      16
+#define UART_IRQ            4
+
+/* Register offsets from the base port */
+#define UART_RBR            0       /* in, DLAB=0 */
+#define UART_THR            0       /* out, DLAB=0 */
+#define UART_DLL            0       /* DLAB=1 */
+#define UART_IER            1       /* DLAB=0 */
+#define UART_DLM            1       /* DLAB=1 */
+#define UART_IIR            2       /* in */
+#define UART_FCR            2       /* out */
+#define UART_LCR            3
+#define UART_MCR            4
+#define UART_LSR            5
+#define UART_MSR            6
+#define UART_SCR            7
+
+#define UART_IER_RDI        0x01    /* received data available */
+#define UART_IER_THRI       0x02    /* THR empty */
+#define UART_IER_RLSI       0x04    /* receiver line status */
+#define UART_IER_MSI        0x08    /* modem status */
+
+#define UART_IIR_NO_INT     0x01
+#define UART_IIR_MSI        0x00
+#define UART_IIR_THRI       0x02
+#define UART_IIR_RDI        0x04
+#define UART_IIR_RLSI       0x06
+#define UART_IIR_CTI        0x0c
+#define UART_IIR_FIFO       0xc0
+
+#define UART_FCR_ENABLE     0x01
+#define UART_FCR_CLEAR_RX   0x02
+#define UART_FCR_CLEAR_TX   0x04
+#define UART_FCR_TRIGGER    0xc0
+
+#define UART_LCR_DLAB       0x80
+
+#define UART_MCR_DTR        0x01
+#define UART_MCR_RTS        0x02
+#define UART_MCR_OUT1       0x04
+#define UART_MCR_OUT2       0x08
+#define UART_MCR_LOOP       0x10
+
+#define UART_LSR_DR         0x01
+#define UART_LSR_OE         0x02
+#define UART_LSR_THRE       0x20
+#define UART_LSR_TEMT       0x40
+
+#define UART_MSR_CTS        0x10
+#define UART_MSR_DSR        0x20
+#define UART_MSR_RI         0x40
+#define UART_MSR_DCD        0x80
+
+struct uart {
+    uint8_t ier, fcr, lcr, mcr, lsr, msr, scr, dll, dlm;
+    uint8_t rx_fifo[UART_FIFO_SIZE];
+    unsigned int rx_head, rx_count;
+    int thri_pending;   /* THR empty interrupt, cleared by reading IIR or writing THR */
+};
+
+void uart_init(struct uart *uart);
+int uart_read(struct uart *uart, unsigned int reg);
+void uart_write(struct uart *uart, unsigned int reg, uint8_t value);
+void uart_transmit(struct uart *uart, const uint8_t *buf, unsigned int len);
+int uart_irq_pending(struct uart *uart);
+int uart_rx_irq_enabled(struct uart *uart);
+void uart_receive(struct uart *uart);
+
+#endif
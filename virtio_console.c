@@ -0,0 +1,91 @@
+#include <stddef.h>
+#include <string.h>
+#include "virtio_console.h"
+
+static void virtio_console_notify(struct virtio_mmio_dev *dev, unsigned int queue)
+{
+    struct virtio_console *vc = dev->opaque;
+    struct virtq_elem elem;
+    int used = 0;
+
+    /* Receive buffers are only ever consumed by virtio_console_send() */
+    if (queue != VIRTIO_CONSOLE_TX)
+        return;
+
+    /* Drain everything the guest queued up before kicking us, then interrupt once */
+    while (virtq_pop(dev, VIRTIO_CONSOLE_TX, &elem)) {
+        for (unsigned int i = 0; i < elem.nr_bufs; i++) {
+            if (!elem.bufs[i].writable && elem.bufs[i].len)
+                vc->receive(vc, elem.bufs[i].addr, elem.bufs[i].len);
+        }
+        virtq_push(dev, VIRTIO_CONSOLE_TX, &elem, 0);
+        used = 1;
+    }
+
+    if (used)
+        virtq_interrupt(dev, VIRTIO_CONSOLE_TX);
+}
+
+static void virtio_console_config_write(struct virtio_mmio_dev *dev, unsigned int offset,
+                                        const uint8_t *data, unsigned int len)
+{
+    struct virtio_console *vc = dev->opaque;
+
+    /* An emergency write is a single byte of output that needs no queues at all */
+    if (offset == offsetof(struct virtio_console_config, emerg_wr))
+        vc->receive(vc, data, 1);
+}
+
+static const struct virtio_device_ops virtio_console_ops = {
+        .device_id = VIRTIO_ID_CONSOLE,
+        .features = VIRTIO_CONSOLE_F_EMERG_WRITE,
+        .nr_queues = 2,
+        .notify = virtio_console_notify,
+        .config_write = virtio_console_config_write,
+};
+
+void virtio_console_init(struct virtio_console *vc, uint64_t base, int irq,
+                         uint8_t *mem, uint64_t mem_size,
+                         virtio_console_receive_t receive, void *opaque)
+{
+    memset(&vc->config, 0, sizeof(vc->config));
+    vc->config.max_nr_ports = 1;
+    vc->receive = receive;
+    vc->opaque = opaque;
+    virtio_mmio_init(&vc->mmio, base, irq, &virtio_console_ops, vc,
+                     mem, mem_size, &vc->config, sizeof(vc->config));
+    virtq_set_used_flags(&vc->mmio, VIRTIO_CONSOLE_RX, VIRTQ_USED_F_NO_NOTIFY);
+}
+
+/*
+ * Copy data into as many of the guest's receive buffers as it takes.
+ * Returns how much got through, which is less than len if the guest
+ * didn't give us enough room.
+ * */
+size_t virtio_console_send(struct virtio_console *vc, const void *data, size_t len)
+{
+    const uint8_t *p = data;
+    size_t sent = 0;
+    struct virtq_elem elem;
+
+    while (sent < len && virtq_pop(&vc->mmio, VIRTIO_CONSOLE_RX, &elem)) {
+        uint32_t written = 0;
+
+        for (unsigned int i = 0; i < elem.nr_bufs && sent < len; i++) {
+            size_t n = len - sent;
+
+            if (!elem.bufs[i].writable)
+                continue;
+            if (n > elem.bufs[i].len)
+                n = elem.bufs[i].len;
+            memcpy(elem.bufs[i].addr, p + sent, n);
+            sent += n;
+            written += n;
+        }
+        virtq_push(&vc->mmio, VIRTIO_CONSOLE_RX, &elem, written);
+    }
+
+    if (sent)
+        virtq_interrupt(&vc->mmio, VIRTIO_CONSOLE_RX);
+    return sent;
+}
@@ -0,0 +1,44 @@
+#ifndef SPARKLER_VIRTIO_CONSOLE_H
+#define SPARKLER_VIRTIO_CONSOLE_H
+
+#include <stddef.h>
+#include <stdint.h>
+#include "virtio_mmio.h"
+
+/*
+ * A single-port virtio-console. Whatever the guest puts on the transmit
+ * queue is handed to the receive callback a buffer at a time, and the
+ * host sends bytes the other way with virtio_console_send(), which fills
+ * receive buffers the guest has made available. We never need to be
+ * kicked about new receive buffers, and say so with VIRTQ_USED_F_NO_NOTIFY.
+ * */
+
+#define VIRTIO_ID_CONSOLE                   3
+#define VIRTIO_CONSOLE_F_EMERG_WRITE        (1ULL << 2)
+
+#define VIRTIO_CONSOLE_RX                   0   /* receiveq, host to guest */
+#define VIRTIO_CONSOLE_TX                   1   /* transmitq, guest to host */
+
+struct virtio_console_config {
+    uint16_t cols;
+    uint16_t rows;
+    uint32_t max_nr_ports;
+    uint32_t emerg_wr;
+} __attribute__((packed));
+
+struct virtio_console;
+typedef void (*virtio_console_receive_t)(struct virtio_console *vc, const uint8_t *data, size_t len);
+
+struct virtio_console {
+    struct virtio_mmio_dev mmio;
+    struct virtio_console_config config;
+    virtio_console_receive_t receive;
+    void *opaque;
+};
+
+void virtio_console_init(struct virtio_console *vc, uint64_t base, int irq,
+                         uint8_t *mem, uint64_t mem_size,
+                         virtio_console_receive_t receive, void *opaque);
+size_t virtio_console_send(struct virtio_console *vc, const void *data, size_t len);
+
+#endif
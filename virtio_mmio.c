@@ -0,0 +1,366 @@
+#include <stdio.h>
+#include <string.h>
+#include "migrate.h"
+#include "virtio_mmio.h"
+
+#define VIRTIO_STATUS_NEEDS_RESET           0x40
+
+void virtio_mmio_init(struct virtio_mmio_dev *dev, uint64_t base, int irq,
+                      const struct virtio_device_ops *ops, void *opaque,
+                      uint8_t *mem, uint64_t mem_size,
+                      void *config, unsigned int config_size)
+{
+    memset(dev, 0, sizeof(*dev));
+    dev->base = base;
+    dev->irq = irq;
+    dev->ops = ops;
+    dev->opaque = opaque;
+    dev->mem = mem;
+    dev->mem_size = mem_size;
+    dev->config = config;
+    dev->config_size = config_size;
+}
+
+/*
+ * Leave gpa up to gpa + len out of the RAM the driver can hand us: the
+ * guest has something else there, such as the ROM, and what's in mem
+ * behind it is nothing it ever sees.
+ * */
+void virtio_mmio_exclude(struct virtio_mmio_dev *dev, uint64_t gpa, uint64_t len)
+{
+    dev->hole = gpa;
+    dev->hole_size = len;
+}
+
+/* Translate a guest physical range to a host pointer, or NULL if any of it lies outside RAM */
+static void *guest_ptr(struct virtio_mmio_dev *dev, uint64_t gpa, uint64_t len)
+{
+    if (gpa > dev->mem_size || len > dev->mem_size - gpa)
+        return NULL;
+    if (dev->hole_size && gpa < dev->hole + dev->hole_size && gpa + len > dev->hole)
+        return NULL;
+    return dev->mem + gpa;
+}
+
+static struct virtq_desc *vq_desc(struct virtio_mmio_dev *dev, struct virtq *vq)
+{
+    return guest_ptr(dev, vq->desc_addr, sizeof(struct virtq_desc) * vq->num);
+}
+
+static struct virtq_avail *vq_avail(struct virtio_mmio_dev *dev, struct virtq *vq)
+{
+    return guest_ptr(dev, vq->avail_addr, sizeof(struct virtq_avail) + sizeof(uint16_t) * (vq->num + 1));
+}
+
+static struct virtq_used *vq_used(struct virtio_mmio_dev *dev, struct virtq *vq)
+{
+    return guest_ptr(dev, vq->used_addr, sizeof(struct virtq_used) + sizeof(struct virtq_used_elem) * vq->num
+                                         + sizeof(uint16_t));
+}
+
+static void device_failed(struct virtio_mmio_dev *dev, const char *why)
+{
+    fprintf(stderr, "virtio device %u at 0x%llx: %s\n", dev->ops->device_id,
+            (unsigned long long)dev->base, why);
+    dev->status |= VIRTIO_STATUS_NEEDS_RESET;
+}
+
+static void device_reset(struct virtio_mmio_dev *dev)
+{
+    dev->status = 0;
+    dev->device_features_sel = 0;
+    dev->driver_features_sel = 0;
+    dev->driver_features = 0;
+    dev->queue_sel = 0;
+    dev->interrupt_status = 0;
+    for (unsigned int i = 0; i < VIRTIO_MAX_QUEUES; i++) {
+        uint16_t used_flags = dev->vqs[i].used_flags;
+
+        memset(&dev->vqs[i], 0, sizeof(dev->vqs[i]));
+        dev->vqs[i].used_flags = used_flags;    /* a property of the device, not the driver */
+    }
+}
+
+static int queue_enable(struct virtio_mmio_dev *dev, struct virtq *vq)
+{
+    struct virtq_used *used;
+
+    if (!vq->num || vq->num > VIRTQ_MAX_SIZE || (vq->num & (vq->num - 1))
+        || !vq_desc(dev, vq) || !vq_avail(dev, vq) || !(used = vq_used(dev, vq))) {
+        device_failed(dev, "bad virtqueue configuration");
+        return 0;
+    }
+
+    vq->last_avail_idx = 0;
+    used->flags = vq->used_flags;
+    migrate_note_dirty(vq->used_addr, sizeof(used->flags));
+    return 1;
+}
+
+static struct virtq *selected_queue(struct virtio_mmio_dev *dev)
+{
+    if (dev->queue_sel >= dev->ops->nr_queues)
+        return NULL;
+    return &dev->vqs[dev->queue_sel];
+}
+
+static uint32_t register_read(struct virtio_mmio_dev *dev, unsigned int offset)
+{
+    struct virtq *vq = selected_queue(dev);
+
+    switch (offset) {
+        case VIRTIO_MMIO_MAGIC_VALUE:
+            return VIRTIO_MMIO_MAGIC;
+        case VIRTIO_MMIO_VERSION_REG:
+            return VIRTIO_MMIO_VERSION;
+        case VIRTIO_MMIO_DEVICE_ID:
+            return dev->ops->device_id;
+        case VIRTIO_MMIO_VENDOR_ID:
+            return VIRTIO_MMIO_VENDOR;
+        case VIRTIO_MMIO_DEVICE_FEATURES:
+            if (dev->device_features_sel > 1)
+                return 0;
+            return (dev->ops->features | VIRTIO_F_VERSION_1) >> (32 * dev->device_features_sel);
+        case VIRTIO_MMIO_QUEUE_NUM_MAX:
+            return vq ? VIRTQ_MAX_SIZE : 0;
+        case VIRTIO_MMIO_QUEUE_READY:
+            return vq ? vq->ready : 0;
+        case VIRTIO_MMIO_INTERRUPT_STATUS:
+            return dev->interrupt_status;
+        case VIRTIO_MMIO_STATUS:
+            return dev->status;
+        case VIRTIO_MMIO_CONFIG_GENERATION:
+            return 0;   /* our config space never changes under the driver */
+        default:
+            return 0;
+    }
+}
+
+static void set_half(uint64_t *value, int high, uint32_t half)
+{
+    if (high)
+        *value = (*value & 0xffffffffULL) | ((uint64_t)half << 32);
+    else
+        *value = (*value & ~0xffffffffULL) | half;
+}
+
+static void register_write(struct virtio_mmio_dev *dev, unsigned int offset, uint32_t value)
+{
+    struct virtq *vq = selected_queue(dev);
+
+    switch (offset) {
+        case VIRTIO_MMIO_DEVICE_FEATURES_SEL:
+            dev->device_features_sel = value;
+            break;
+        case VIRTIO_MMIO_DRIVER_FEATURES:
+            if (dev->driver_features_sel <= 1)
+                set_half(&dev->driver_features, dev->driver_features_sel, value);
+            break;
+        case VIRTIO_MMIO_DRIVER_FEATURES_SEL:
+            dev->driver_features_sel = value;
+            break;
+        case VIRTIO_MMIO_QUEUE_SEL:
+            dev->queue_sel = value;
+            break;
+        case VIRTIO_MMIO_QUEUE_NUM:
+            if (vq)
+                vq->num = value;
+            break;
+        case VIRTIO_MMIO_QUEUE_READY:
+            if (vq)
+                vq->ready = (value & 1) && queue_enable(dev, vq);
+            break;
+        case VIRTIO_MMIO_QUEUE_NOTIFY:
+            if (value < dev->ops->nr_queues && dev->vqs[value].ready
+                && (dev->status & VIRTIO_STATUS_DRIVER_OK))
+                dev->ops->notify(dev, value);
+            break;
+        case VIRTIO_MMIO_INTERRUPT_ACK:
+            dev->interrupt_status &= ~value;
+            break;
+        case VIRTIO_MMIO_STATUS:
+            if (value == 0) {
+                device_reset(dev);
+                break;
+            }
+            /* We can't drive anything the device didn't offer */
+            if ((value & VIRTIO_STATUS_FEATURES_OK)
+                && (dev->driver_features & ~(dev->ops->features | VIRTIO_F_VERSION_1)))
+                value &= ~VIRTIO_STATUS_FEATURES_OK;
+            dev->status = value;
+            break;
+        case VIRTIO_MMIO_QUEUE_DESC_LOW:
+        case VIRTIO_MMIO_QUEUE_DESC_HIGH:
+            if (vq)
+                set_half(&vq->desc_addr, offset == VIRTIO_MMIO_QUEUE_DESC_HIGH, value);
+            break;
+        case VIRTIO_MMIO_QUEUE_DRIVER_LOW:
+        case VIRTIO_MMIO_QUEUE_DRIVER_HIGH:
+            if (vq)
+                set_half(&vq->avail_addr, offset == VIRTIO_MMIO_QUEUE_DRIVER_HIGH, value);
+            break;
+        case VIRTIO_MMIO_QUEUE_DEVICE_LOW:
+        case VIRTIO_MMIO_QUEUE_DEVICE_HIGH:
+            if (vq)
+                set_half(&vq->used_addr, offset == VIRTIO_MMIO_QUEUE_DEVICE_HIGH, value);
+            break;
+        default:
+            break;
+    }
+}
+
+/* Handle a guest access to our register window. Returns 0 if addr isn't ours. */
+int virtio_mmio_access(struct virtio_mmio_dev *dev, uint64_t addr,
+                       uint8_t *data, uint32_t len, int is_write)
+{
+    unsigned int offset;
+    uint32_t value = 0;
+
+    if (addr < dev->base || addr >= dev->base + VIRTIO_MMIO_SIZE)
+        return 0;
+    offset = addr - dev->base;
+
+    if (offset >= VIRTIO_MMIO_CONFIG) {
+        offset -= VIRTIO_MMIO_CONFIG;
+        if (offset >= dev->config_size || len > dev->config_size - offset) {
+            if (!is_write)
+                memset(data, 0, len);
+            return 1;
+        }
+        if (!is_write)
+            memcpy(data, (uint8_t *)dev->config + offset, len);
+        else if (dev->ops->config_write)
+            dev->ops->config_write(dev, offset, data, len);
+        return 1;
+    }
+
+    /* Registers are 32 bits wide and naturally aligned; narrower access is undefined, we're lenient */
+    if (len > sizeof(value))
+        len = sizeof(value);
+    if (is_write) {
+        memcpy(&value, data, len);
+        register_write(dev, offset & ~3u, value);
+    } else {
+        value = register_read(dev, offset & ~3u);
+        memcpy(data, &value, len);
+    }
+    return 1;
+}
+
+int virtio_mmio_irq_pending(struct virtio_mmio_dev *dev)
+{
+    return dev->interrupt_status != 0;
+}
+
+/*
+ * Take the next available descriptor chain off a queue. Returns 1 with
+ * elem filled in, or 0 if the driver hasn't made anything available.
+ * */
+int virtq_pop(struct virtio_mmio_dev *dev, unsigned int queue, struct virtq_elem *elem)
+{
+    struct virtq *vq = &dev->vqs[queue];
+    struct virtq_desc *desc;
+    struct virtq_avail *avail;
+    uint16_t idx;
+
+    if (!vq->ready || (dev->status & VIRTIO_STATUS_NEEDS_RESET))
+        return 0;
+
+    desc = vq_desc(dev, vq);
+    avail = vq_avail(dev, vq);
+    if (*(volatile uint16_t *)&avail->idx == vq->last_avail_idx)
+        return 0;
+    __sync_synchronize();   /* don't read the ring entry before we've seen the index */
+
+    idx = avail->ring[vq->last_avail_idx % vq->num];
+    elem->head = idx;
+    elem->nr_bufs = 0;
+    vq->last_avail_idx++;
+
+    while (1) {
+        struct virtq_buf *buf;
+
+        if (idx >= vq->num || elem->nr_bufs == VIRTQ_MAX_CHAIN) {
+            device_failed(dev, "bad descriptor chain");
+            return 0;
+        }
+
+        buf = &elem->bufs[elem->nr_bufs++];
+        buf->addr = guest_ptr(dev, desc[idx].addr, desc[idx].len);
+        buf->len = desc[idx].len;
+        buf->writable = desc[idx].flags & VIRTQ_DESC_F_WRITE;
+        if (!buf->addr) {
+            device_failed(dev, "descriptor points outside guest memory");
+            return 0;
+        }
+        /* The device may fill in any writable buffer it's handed, so count it as written already */
+        if (buf->writable)
+            migrate_note_dirty(desc[idx].addr, desc[idx].len);
+
+        if (!(desc[idx].flags & VIRTQ_DESC_F_NEXT))
+            break;
+        idx = desc[idx].next;
+    }
+
+    return 1;
+}
+
+/* Hand a chain back to the driver, having written `written` bytes into it */
+void virtq_push(struct virtio_mmio_dev *dev, unsigned int queue, struct virtq_elem *elem, uint32_t written)
+{
+    struct virtq *vq = &dev->vqs[queue];
+    struct virtq_used *used = vq_used(dev, vq);
+    struct virtq_used_elem *ue = &used->ring[used->idx % vq->num];
+
+    ue->id = elem->head;
+    ue->len = written;
+    __sync_synchronize();   /* the element has to be visible before the index moves */
+    used->idx++;
+    migrate_note_dirty(vq->used_addr, (uint8_t *)(ue + 1) - (uint8_t *)used);
+}
+
+/* Tell the driver we've used buffers, unless it asked us not to bother */
+void virtq_interrupt(struct virtio_mmio_dev *dev, unsigned int queue)
+{
+    struct virtq *vq = &dev->vqs[queue];
+
+    if (!vq->ready || (vq_avail(dev, vq)->flags & VIRTQ_AVAIL_F_NO_INTERRUPT))
+        return;
+    dev->interrupt_status |= VIRTIO_MMIO_INT_VRING;
+}
+
+/* Devices that never need to be kicked about a queue say so with VIRTQ_USED_F_NO_NOTIFY */
+void virtq_set_used_flags(struct virtio_mmio_dev *dev, unsigned int queue, uint16_t flags)
+{
+    struct virtq *vq = &dev->vqs[queue];
+
+    vq->used_flags = flags;
+    if (vq->ready) {
+        vq_used(dev, vq)->flags = flags;
+        migrate_note_dirty(vq->used_addr, sizeof(flags));
+    }
+}
+
+void virtio_mmio_save(struct virtio_mmio_dev *dev, struct virtio_mmio_state *state)
+{
+    memset(state, 0, sizeof(*state));
+    state->status = dev->status;
+    state->device_features_sel = dev->device_features_sel;
+    state->driver_features_sel = dev->driver_features_sel;
+    state->queue_sel = dev->queue_sel;
+    state->interrupt_status = dev->interrupt_status;
+    state->driver_features = dev->driver_features;
+    memcpy(state->vqs, dev->vqs, sizeof(state->vqs));
+}
+
+/* The rings themselves come along with guest memory, so this is all it takes to pick up where we were */
+void virtio_mmio_load(struct virtio_mmio_dev *dev, const struct virtio_mmio_state *state)
+{
+    dev->status = state->status;
+    dev->device_features_sel = state->device_features_sel;
+    dev->driver_features_sel = state->driver_features_sel;
+    dev->queue_sel = state->queue_sel;
+    dev->interrupt_status = state->interrupt_status;
+    dev->driver_features = state->driver_features;
+    memcpy(dev->vqs, state->vqs, sizeof(dev->vqs));
+}
@@ -0,0 +1,172 @@
+#ifndef SPARKLER_VIRTIO_MMIO_H
+#define SPARKLER_VIRTIO_MMIO_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+/*
+ * The virtio-mmio transport (version 2, as in the virtio 1.x spec) with
+ * split virtqueues that live in guest memory. Devices plug in through a
+ * struct virtio_device_ops and get their queues kicked via ops->notify.
+ * Each device occupies VIRTIO_MMIO_SIZE bytes of guest physical address
+ * space, which we leave unbacked so that accesses exit to us as MMIO.
+ * */
+
+#define VIRTIO_MMIO_SIZE                    0x200
+#define VIRTIO_MMIO_MAGIC                   0x74726976  /* "virt" */
+#define VIRTIO_MMIO_VERSION                 2
+#define VIRTIO_MMIO_VENDOR                  0x4b525053  /* "SPRK" */
+
+/* Register offsets */
+#define VIRTIO_MMIO_MAGIC_VALUE             0x000
+#define VIRTIO_MMIO_VERSION_REG             0x004
+#define VIRTIO_MMIO_DEVICE_ID               0x008
+#define VIRTIO_MMIO_VENDOR_ID               0x00c
+#define VIRTIO_MMIO_DEVICE_FEATURES         0x010
+#define VIRTIO_MMIO_DEVICE_FEATURES_SEL     0x014
+#define VIRTIO_MMIO_DRIVER_FEATURES         0x020
+#define VIRTIO_MMIO_DRIVER_FEATURES_SEL     0x024
+#define VIRTIO_MMIO_QUEUE_SEL               0x030
+#define VIRTIO_MMIO_QUEUE_NUM_MAX           0x034
+#define VIRTIO_MMIO_QUEUE_NUM               0x038
+#define VIRTIO_MMIO_QUEUE_READY             0x044
+#define VIRTIO_MMIO_QUEUE_NOTIFY            0x050
+#define VIRTIO_MMIO_INTERRUPT_STATUS        0x060
+#define VIRTIO_MMIO_INTERRUPT_ACK           0x064
+#define VIRTIO_MMIO_STATUS                  0x070
+#define VIRTIO_MMIO_QUEUE_DESC_LOW          0x080
+#define VIRTIO_MMIO_QUEUE_DESC_HIGH         0x084
+#define VIRTIO_MMIO_QUEUE_DRIVER_LOW        0x090
+#define VIRTIO_MMIO_QUEUE_DRIVER_HIGH       0x094
+#define VIRTIO_MMIO_QUEUE_DEVICE_LOW        0x0a0
+#define VIRTIO_MMIO_QUEUE_DEVICE_HIGH       0x0a4
+#define VIRTIO_MMIO_CONFIG_GENERATION       0x0fc
+#define VIRTIO_MMIO_CONFIG                  0x100
+
+#define VIRTIO_MMIO_INT_VRING               0x01
+#define VIRTIO_MMIO_INT_CONFIG              0x02
+
+#define VIRTIO_STATUS_ACKNOWLEDGE           0x01
+#define VIRTIO_STATUS_DRIVER                0x02
+#define VIRTIO_STATUS_DRIVER_OK             0x04
+#define VIRTIO_STATUS_FEATURES_OK           0x08
+#define VIRTIO_STATUS_FAILED                0x80
+
+#define VIRTIO_F_VERSION_1                  (1ULL << 32)
+
+#define VIRTQ_DESC_F_NEXT                   1
+#define VIRTQ_DESC_F_WRITE                  2
+#define VIRTQ_AVAIL_F_NO_INTERRUPT          1
+#define VIRTQ_USED_F_NO_NOTIFY              1
+
+#define VIRTQ_MAX_SIZE                      256
+#define VIRTQ_MAX_CHAIN                     16
+#define VIRTIO_MAX_QUEUES                   2
+
+struct virtq_desc {
+    uint64_t addr;
+    uint32_t len;
+    uint16_t flags;
+    uint16_t next;
+};
+
+struct virtq_avail {
+    uint16_t flags;
+    uint16_t idx;
+    uint16_t ring[];
+};
+
+struct virtq_used_elem {
+    uint32_t id;
+    uint32_t len;
+};
+
+struct virtq_used {
+    uint16_t flags;
+    uint16_t idx;
+    struct virtq_used_elem ring[];
+};
+
+struct virtq {
+    uint32_t num;
+    uint32_t ready;
+    uint64_t desc_addr, avail_addr, used_addr;
+    uint16_t last_avail_idx;
+    uint16_t used_flags;        /* what we want in used->flags once the queue is up */
+};
+
+/* One buffer of a descriptor chain, already translated to a host pointer */
+struct virtq_buf {
+    uint8_t *addr;
+    uint32_t len;
+    int writable;
+};
+
+struct virtq_elem {
+    uint16_t head;
+    unsigned int nr_bufs;
+    struct virtq_buf bufs[VIRTQ_MAX_CHAIN];
+};
+
+struct virtio_mmio_dev;
+
+struct virtio_device_ops {
+    uint32_t device_id;
+    uint64_t features;
+    unsigned int nr_queues;
+    void (*notify)(struct virtio_mmio_dev *dev, unsigned int queue);
+    void (*config_write)(struct virtio_mmio_dev *dev, unsigned int offset, const uint8_t *data, unsigned int len);
+};
+
+struct virtio_mmio_dev {
+    uint64_t base;
+    int irq;
+    const struct virtio_device_ops *ops;
+    void *opaque;
+
+    uint8_t *mem;               /* guest RAM, starting at guest physical 0 */
+    uint64_t mem_size;
+    uint64_t hole;              /* where in it the guest sees something else instead, hole_size long */
+    uint64_t hole_size;
+
+    void *config;
+    unsigned int config_size;
+
+    uint32_t status;
+    uint32_t device_features_sel;
+    uint32_t driver_features_sel;
+    uint64_t driver_features;
+    uint32_t queue_sel;
+    uint32_t interrupt_status;
+    struct virtq vqs[VIRTIO_MAX_QUEUES];
+};
+
+/* Where the transport has got to with the driver, for carrying on in another process */
+struct virtio_mmio_state {
+    uint32_t status;
+    uint32_t device_features_sel;
+    uint32_t driver_features_sel;
+    uint32_t queue_sel;
+    uint32_t interrupt_status;
+    uint32_t reserved;
+    uint64_t driver_features;
+    struct virtq vqs[VIRTIO_MAX_QUEUES];
+};
+
+void virtio_mmio_init(struct virtio_mmio_dev *dev, uint64_t base, int irq,
+                      const struct virtio_device_ops *ops, void *opaque,
+                      uint8_t *mem, uint64_t mem_size,
+                      void *config, unsigned int config_size);
+void virtio_mmio_exclude(struct virtio_mmio_dev *dev, uint64_t gpa, uint64_t len);
+int virtio_mmio_access(struct virtio_mmio_dev *dev, uint64_t addr,
+                       uint8_t *data, uint32_t len, int is_write);
+int virtio_mmio_irq_pending(struct virtio_mmio_dev *dev);
+void virtio_mmio_save(struct virtio_mmio_dev *dev, struct virtio_mmio_state *state);
+void virtio_mmio_load(struct virtio_mmio_dev *dev, const struct virtio_mmio_state *state);
+
+int virtq_pop(struct virtio_mmio_dev *dev, unsigned int queue, struct virtq_elem *elem);
+void virtq_push(struct virtio_mmio_dev *dev, unsigned int queue, struct virtq_elem *elem, uint32_t written);
+void virtq_interrupt(struct virtio_mmio_dev *dev, unsigned int queue);
+void virtq_set_used_flags(struct virtio_mmio_dev *dev, unsigned int queue, uint16_t flags);
+
+#endif
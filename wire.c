@@ -0,0 +1,175 @@
+#include <string.h>
+#include "pool.h"
+#include "wire.h"
+
+#define WIRE_ALIGN(n)   (((n) + 7) & ~(size_t)7)
+
+/* Check the header and get ready to walk the records. Returns -1 if it isn't a good message of this kind. */
+int wire_open(struct wire_reader *r, const void *buf, size_t len, unsigned int kind)
+{
+    const struct wire_header *hdr = buf;
+
+    if (len < sizeof(*hdr) || ((uintptr_t)buf & 7))
+        return -1;
+    if (hdr->magic != WIRE_MAGIC || hdr->version != WIRE_VERSION
+        || hdr->kind != kind || hdr->status != WIRE_STATUS_SUCCESS)
+        return -1;
+
+    r->pos = (const uint8_t *)(hdr + 1);
+    r->end = (const uint8_t *)buf + len;
+    r->left = hdr->count;
+    return 0;
+}
+
+/*
+ * Peek at the next record, provided it's at least min_size bytes and its
+ * own length keeps it inside the buffer. At the end of the message, or on
+ * a malformed record, returns NULL; r->left stays non-zero in the latter
+ * case so the caller can tell the two apart.
+ * */
+static const void *peek_record(struct wire_reader *r, size_t min_size)
+{
+    uint32_t len;
+
+    if (!r->left || (size_t)(r->end - r->pos) < min_size)
+        return NULL;
+    len = *(const uint32_t *)r->pos;
+    if (len < min_size || (len & 7) || len > (size_t)(r->end - r->pos))
+        return NULL;
+    return r->pos;
+}
+
+static const void *take_record(struct wire_reader *r, const void *rec, size_t needed)
+{
+    if (needed > *(const uint32_t *)rec)
+        return NULL;    /* its strings run past its end */
+    r->pos += *(const uint32_t *)rec;
+    r->left--;
+    return rec;
+}
+
+const struct wire_tweet *wire_next_tweet(struct wire_reader *r)
+{
+    const struct wire_tweet *t = peek_record(r, sizeof(*t));
+
+    if (!t)
+        return NULL;
+    return take_record(r, t, sizeof(*t) + t->text_len);
+}
+
+const struct wire_weather *wire_next_weather(struct wire_reader *r)
+{
+    const struct wire_weather *w = peek_record(r, sizeof(*w));
+
+    if (!w)
+        return NULL;
+    return take_record(r, w, sizeof(*w) + w->date_len + w->state_len);
+}
+
+const struct wire_air_quality *wire_next_air_quality(struct wire_reader *r)
+{
+    const struct wire_air_quality *aq = peek_record(r, sizeof(*aq));
+
+    if (!aq)
+        return NULL;
+    return take_record(r, aq, sizeof(*aq) + aq->location_len + aq->reading_len);
+}
+
+void wire_begin(struct wire_writer *w, unsigned int kind, unsigned int status)
+{
+    struct wire_header *hdr;
+
+    w->len = sizeof(*hdr);
+    w->failed = 0;
+    w->buf = pool_zalloc(w->len);
+    if (!w->buf) {
+        w->failed = 1;
+        return;
+    }
+    hdr = (struct wire_header *)w->buf;
+    hdr->magic = WIRE_MAGIC;
+    hdr->version = WIRE_VERSION;
+    hdr->kind = kind;
+    hdr->status = status;
+}
+
+/* Make room for a record of fixed_size bytes plus its strings, and return it zeroed */
+static void *add_record(struct wire_writer *w, size_t fixed_size, size_t strings_len)
+{
+    size_t len = WIRE_ALIGN(fixed_size + strings_len);
+    uint8_t *buf;
+
+    if (w->failed)
+        return NULL;
+    if (len > UINT32_MAX || !(buf = pool_realloc(w->buf, w->len + len))) {
+        w->failed = 1;
+        return NULL;
+    }
+    w->buf = buf;
+    memset(buf + w->len, 0, len);
+    *(uint32_t *)(buf + w->len) = len;
+    ((struct wire_header *)buf)->count++;
+    w->len += len;
+    return buf + w->len - len;
+}
+
+void wire_put_tweet(struct wire_writer *w, const char *text)
+{
+    size_t text_len = strlen(text);
+    struct wire_tweet *t;
+
+    if (text_len > UINT16_MAX || !(t = add_record(w, sizeof(*t), text_len))) {
+        w->failed = 1;
+        return;
+    }
+    t->text_len = text_len;
+    memcpy(t + 1, text, text_len);
+}
+
+void wire_put_weather(struct wire_writer *w, const char *date, const char *state,
+                      double min_temp, double max_temp, int humidity)
+{
+    size_t date_len = strlen(date), state_len = strlen(state);
+    struct wire_weather *rec;
+
+    if (date_len > UINT16_MAX || state_len > UINT16_MAX
+        || !(rec = add_record(w, sizeof(*rec), date_len + state_len))) {
+        w->failed = 1;
+        return;
+    }
+    rec->humidity = humidity;
+    rec->min_temp = min_temp;
+    rec->max_temp = max_temp;
+    rec->date_len = date_len;
+    rec->state_len = state_len;
+    memcpy(rec + 1, date, date_len);
+    memcpy((char *)(rec + 1) + date_len, state, state_len);
+}
+
+void wire_put_air_quality(struct wire_writer *w, const char *location, const char *reading)
+{
+    size_t location_len = strlen(location), reading_len = strlen(reading);
+    struct wire_air_quality *aq;
+
+    if (location_len > UINT16_MAX || reading_len > UINT16_MAX
+        || !(aq = add_record(w, sizeof(*aq), location_len + reading_len))) {
+        w->failed = 1;
+        return;
+    }
+    aq->location_len = location_len;
+    aq->reading_len = reading_len;
+    memcpy(aq + 1, location, location_len);
+    memcpy((char *)(aq + 1) + location_len, reading, reading_len);
+}
+
+/* Returns 0 with the message in w->buf and w->len, or -1 (and nothing to free) if building it failed */
+int wire_end(struct wire_writer *w)
+{
+    if (w->failed) {
+        pool_free(w->buf);
+        w->buf = NULL;
+        w->len = 0;
+        return -1;
+    }
+    return 0;
+}
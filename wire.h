@@ -0,0 +1,117 @@
+#ifndef SPARKLER_WIRE_H
+#define SPARKLER_WIRE_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+/*
+ * A compact binary encoding of what the sparkler service sends us, as an
+ * alternative to JSON. We ask for it with an Accept header and fall back
+ * to JSON whenever the service answers with anything else.
+ *
+ * A message is a header followed by `count` records. Every record starts
+ * with its own length, is padded to a multiple of 8 bytes, and is laid out
+ * exactly like the matching struct below followed by its strings, which
+ * are not NUL terminated. That lets the reader hand out pointers straight
+ * into the response buffer instead of copying anything out. Everything is
+ * little endian, which is what the x86 hosts we run on use natively.
+ * */
+
+#define WIRE_CONTENT_TYPE       "application/x-sparkler-records"
+#define WIRE_MAGIC              0x424b5053  /* "SPKB" */
+#define WIRE_VERSION            1
+
+#define WIRE_KIND_TWEET         1
+#define WIRE_KIND_WEATHER       2
+#define WIRE_KIND_AIR_QUALITY   3
+
+#define WIRE_STATUS_SUCCESS     0
+#define WIRE_STATUS_FAILED      1
+
+struct wire_header {
+    uint32_t magic;
+    uint8_t version;
+    uint8_t kind;
+    uint8_t status;
+    uint8_t reserved;
+    uint32_t count;             /* records that follow */
+    uint32_t reserved2;
+};
+
+/* Followed by text_len bytes of text */
+struct wire_tweet {
+    uint32_t len;
+    uint16_t text_len;
+    uint16_t reserved;
+};
+
+/* Followed by date_len bytes of date, then state_len bytes of weather state name */
+struct wire_weather {
+    uint32_t len;
+    int32_t humidity;
+    double min_temp;
+    double max_temp;
+    uint16_t date_len;
+    uint16_t state_len;
+    uint32_t reserved;
+};
+
+/* Followed by location_len bytes of location, then reading_len bytes of reading */
+struct wire_air_quality {
+    uint32_t len;
+    uint16_t location_len;
+    uint16_t reading_len;
+};
+
+static inline const char *wire_tweet_text(const struct wire_tweet *t)
+{
+    return (const char *)(t + 1);
+}
+
+static inline const char *wire_weather_date(const struct wire_weather *w)
+{
+    return (const char *)(w + 1);
+}
+
+static inline const char *wire_weather_state(const struct wire_weather *w)
+{
+    return wire_weather_date(w) + w->date_len;
+}
+
+static inline const char *wire_air_quality_location(const struct wire_air_quality *aq)
+{
+    return (const char *)(aq + 1);
+}
+
+static inline const char *wire_air_quality_reading(const struct wire_air_quality *aq)
+{
+    return wire_air_quality_location(aq) + aq->location_len;
+}
+
+/* Walks the records of a message that's sitting in an 8 byte aligned buffer */
+struct wire_reader {
+    const uint8_t *pos;
+    const uint8_t *end;
+    uint32_t left;
+};
+
+int wire_open(struct wire_reader *r, const void *buf, size_t len, unsigned int kind);
+const struct wire_tweet *wire_next_tweet(struct wire_reader *r);
+const struct wire_weather *wire_next_weather(struct wire_reader *r);
+const struct wire_air_quality *wire_next_air_quality(struct wire_reader *r);
+
+/* Builds a message in a growing pool buffer; used by the stand-in service */
+struct wire_writer {
+    uint8_t *buf;
+    size_t len;
+    int failed;
+};
+
+void wire_begin(struct wire_writer *w, unsigned int kind, unsigned int status);
+void wire_put_tweet(struct wire_writer *w, const char *text);
+void wire_put_weather(struct wire_writer *w, const char *date, const char *state,
+                      double min_temp, double max_temp, int humidity);
+void wire_put_air_quality(struct wire_writer *w, const char *location, const char *reading);
+int wire_end(struct wire_writer *w);
+
+#endif